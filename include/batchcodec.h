@@ -0,0 +1,143 @@
+//
+// Copyright 2023 Suzuki Yoshinori(wave.suzuki.z@gmail.com)
+//
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <listcodec.h>
+#include <string>
+
+//
+// 複数ファイルをまとめて返す形式(/batch)
+//
+// エントリ: [varint ヘッダ長][varint パスの長さ][パス][varint フラグ][varint サイズ][サイズ分の内容]
+// ない、または個別に取得すべきファイルはサイズ0でフラグを立てる
+// ヘッダ長0で終端
+//
+constexpr const char *BatchContentType = "application/x-fsrv-batch";
+
+// フラグ
+constexpr uint64_t BatchFlagMissing = 1 << 0; // ない(削除された)
+constexpr uint64_t BatchFlagSkipped = 1 << 1; // 大きいので個別に取得する
+
+//
+struct BatchEntry
+{
+    std::string path_;
+    uint64_t flags_{0};
+    uint64_t size_{0};
+};
+
+// ヘッダを追加(内容は続けて追加する)
+inline void encodeBatchHeader(std::string &out, const BatchEntry &entry)
+{
+    std::string header;
+    putVarint(header, entry.path_.size());
+    header += entry.path_;
+    putVarint(header, entry.flags_);
+    putVarint(header, entry.size_);
+    putVarint(out, header.size());
+    out += header;
+}
+
+// 終端
+inline void finishBatch(std::string &out) { putVarint(out, 0); }
+
+//
+// インクリメンタルデコーダ
+// handler.begin(entry)、handler.data(ptr, len)、handler.end(entry)の順に呼ぶ(falseで中断)
+//
+class BatchDecoder
+{
+    std::string buffer_;
+    BatchEntry entry_;
+    uint64_t remain_{0};
+    bool inBody_{false};
+    bool finished_{false};
+    bool error_{false};
+
+    //
+    bool decodeHeader(const char *p, const char *end)
+    {
+        uint64_t pathLen;
+        if (!getVarint(p, end, pathLen) || pathLen > static_cast<uint64_t>(end - p))
+        {
+            return false;
+        }
+        entry_.path_.assign(p, pathLen);
+        p += pathLen;
+        return getVarint(p, end, entry_.flags_) && getVarint(p, end, entry_.size_);
+    }
+
+  public:
+    // データ投入(不正なデータか中断ならfalse)
+    template <class Handler> bool feed(const char *data, size_t len, Handler &handler)
+    {
+        if (error_)
+        {
+            return false;
+        }
+        buffer_.append(data, len);
+
+        const char *p   = buffer_.data();
+        const char *end = p + buffer_.size();
+        while (!finished_)
+        {
+            if (inBody_)
+            {
+                auto n = static_cast<size_t>(std::min<uint64_t>(remain_, end - p));
+                if (n > 0 && !handler.data(p, n))
+                {
+                    error_ = true;
+                    return false;
+                }
+                p += n;
+                remain_ -= n;
+                if (remain_ > 0)
+                {
+                    break;
+                }
+                inBody_ = false;
+                if (!handler.end(static_cast<const BatchEntry &>(entry_)))
+                {
+                    error_ = true;
+                    return false;
+                }
+                continue;
+            }
+
+            const char *q = p;
+            uint64_t headerLen;
+            if (!getVarint(q, end, headerLen))
+            {
+                break;
+            }
+            if (headerLen == 0)
+            {
+                finished_ = true;
+                p         = q;
+                break;
+            }
+            if (headerLen > static_cast<uint64_t>(end - q))
+            {
+                break;
+            }
+            if (!decodeHeader(q, q + headerLen) ||
+                !handler.begin(static_cast<const BatchEntry &>(entry_)))
+            {
+                error_ = true;
+                return false;
+            }
+            p       = q + headerLen;
+            remain_ = entry_.size_;
+            inBody_ = true;
+        }
+        buffer_.erase(0, p - buffer_.data());
+        return true;
+    }
+
+    // 終端まで読んだか
+    bool finished() const { return finished_; }
+};
@@ -0,0 +1,71 @@
+//
+// Copyright 2023 Suzuki Yoshinori(wave.suzuki.z@gmail.com)
+//
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <openssl/evp.h>
+#include <string>
+
+// ブロックサイズ(デフォルトと許容範囲)
+constexpr size_t DefaultBlockSize = 64 * 1024;
+constexpr size_t MinBlockSize     = 1024;
+constexpr size_t MaxBlockSize     = 16 * 1024 * 1024;
+
+//
+// rsync方式の弱い(ローリング)チェックサム
+//
+class RollingChecksum
+{
+    uint32_t a_{0};
+    uint32_t b_{0};
+    size_t len_{0};
+
+  public:
+    RollingChecksum() = default;
+    RollingChecksum(const uint8_t *data, size_t len) { reset(data, len); }
+
+    //
+    void reset(const uint8_t *data, size_t len)
+    {
+        a_   = 0;
+        b_   = 0;
+        len_ = len;
+        for (size_t i = 0; i < len; i++)
+        {
+            a_ += data[i];
+            b_ += static_cast<uint32_t>(len - i) * data[i];
+        }
+    }
+
+    // 先頭の1バイトを捨てて末尾に1バイト追加
+    void roll(uint8_t out, uint8_t in)
+    {
+        a_ = a_ - out + in;
+        b_ = b_ - static_cast<uint32_t>(len_) * out + a_;
+    }
+
+    //
+    uint32_t value() const { return (a_ & 0xffff) | (b_ << 16); }
+};
+
+//
+// 強いチェックサム(SHA-256の先頭16バイトを16進文字列で)
+//
+inline std::string strongChecksum(const void *data, size_t len)
+{
+    static const char hex[] = "0123456789abcdef";
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int mdLen = 0;
+    EVP_Digest(data, len, md, &mdLen, EVP_sha256(), nullptr);
+
+    std::string result;
+    result.reserve(32);
+    for (unsigned int i = 0; i < 16 && i < mdLen; i++)
+    {
+        result += hex[md[i] >> 4];
+        result += hex[md[i] & 15];
+    }
+    return result;
+}
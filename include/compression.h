@@ -0,0 +1,292 @@
+//
+// Copyright 2023 Suzuki Yoshinori(wave.suzuki.z@gmail.com)
+//
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <cstddef>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <zlib.h>
+#include <zstd.h>
+
+//
+// 転送時の圧縮(Content-Encoding)
+//
+enum class Encoding
+{
+    Identity,
+    Gzip,
+    Zstd,
+};
+
+// ヘッダに書く名前
+inline const char *encodingName(Encoding enc)
+{
+    switch (enc)
+    {
+    case Encoding::Gzip:
+        return "gzip";
+    case Encoding::Zstd:
+        return "zstd";
+    default:
+        return "identity";
+    }
+}
+
+// Content-Encodingから(知らないものはokをfalseにする)
+inline Encoding parseEncoding(std::string_view name, bool &ok)
+{
+    ok = true;
+    if (name.empty() || name == "identity")
+    {
+        return Encoding::Identity;
+    }
+    if (name == "gzip" || name == "x-gzip")
+    {
+        return Encoding::Gzip;
+    }
+    if (name == "zstd")
+    {
+        return Encoding::Zstd;
+    }
+    ok = false;
+    return Encoding::Identity;
+}
+
+// Accept-Encodingから選ぶ(zstd優先、q=0は使わない)
+inline Encoding chooseEncoding(std::string_view accept)
+{
+    bool gzip = false;
+    bool zstd = false;
+    while (!accept.empty())
+    {
+        auto comma = accept.find(',');
+        auto item  = accept.substr(0, comma);
+        accept.remove_prefix(comma == std::string_view::npos ? accept.size() : comma + 1);
+
+        auto semi   = item.find(';');
+        auto name   = item.substr(0, semi);
+        auto params = semi == std::string_view::npos ? std::string_view{} : item.substr(semi + 1);
+        while (!name.empty() && std::isspace(static_cast<unsigned char>(name.front())))
+        {
+            name.remove_prefix(1);
+        }
+        while (!name.empty() && std::isspace(static_cast<unsigned char>(name.back())))
+        {
+            name.remove_suffix(1);
+        }
+        auto q = params.find("q=");
+        if (q != std::string_view::npos && std::strtod(std::string{params.substr(q + 2)}.c_str(),
+                                                        nullptr) <= 0.0)
+        {
+            continue;
+        }
+        gzip = gzip || name == "gzip" || name == "x-gzip";
+        zstd = zstd || name == "zstd";
+    }
+    return zstd ? Encoding::Zstd : gzip ? Encoding::Gzip : Encoding::Identity;
+}
+
+//
+// ストリーム圧縮
+//
+class Compressor
+{
+    Encoding enc_;
+    z_stream zs_{};
+    ZSTD_CCtx *zctx_{nullptr};
+    bool ok_{true};
+
+  public:
+    explicit Compressor(Encoding enc, int level = 0) : enc_(enc)
+    {
+        if (enc_ == Encoding::Gzip)
+        {
+            // windowBits 15 + 16でgzip形式
+            ok_ = deflateInit2(&zs_, level > 0 ? level : Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16,
+                               8, Z_DEFAULT_STRATEGY) == Z_OK;
+        }
+        else if (enc_ == Encoding::Zstd)
+        {
+            zctx_ = ZSTD_createCCtx();
+            ok_   = zctx_ != nullptr;
+            if (ok_)
+            {
+                ZSTD_CCtx_setParameter(zctx_, ZSTD_c_compressionLevel,
+                                       level > 0 ? level : ZSTD_CLEVEL_DEFAULT);
+            }
+        }
+    }
+    ~Compressor()
+    {
+        if (enc_ == Encoding::Gzip)
+        {
+            deflateEnd(&zs_);
+        }
+        ZSTD_freeCCtx(zctx_);
+    }
+    Compressor(const Compressor &)            = delete;
+    Compressor &operator=(const Compressor &) = delete;
+
+    // 圧縮してoutに追加(lastで終端、そうでなければここまでを相手が展開できるようにflush)
+    bool compress(const char *data, size_t len, bool last, std::string &out)
+    {
+        if (!ok_)
+        {
+            return false;
+        }
+        char buffer[64 * 1024];
+        if (enc_ == Encoding::Identity)
+        {
+            out.append(data, len);
+            return true;
+        }
+        if (enc_ == Encoding::Gzip)
+        {
+            zs_.next_in  = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+            zs_.avail_in = static_cast<uInt>(len);
+            int ret;
+            do
+            {
+                zs_.next_out  = reinterpret_cast<Bytef *>(buffer);
+                zs_.avail_out = sizeof(buffer);
+                ret           = deflate(&zs_, last ? Z_FINISH : Z_SYNC_FLUSH);
+                if (ret == Z_STREAM_ERROR)
+                {
+                    ok_ = false;
+                    return false;
+                }
+                out.append(buffer, sizeof(buffer) - zs_.avail_out);
+            } while (zs_.avail_out == 0 || (last && ret != Z_STREAM_END));
+            return true;
+        }
+
+        ZSTD_inBuffer in{data, len, 0};
+        auto mode = last ? ZSTD_e_end : ZSTD_e_flush;
+        for (;;)
+        {
+            ZSTD_outBuffer outBuf{buffer, sizeof(buffer), 0};
+            auto remain = ZSTD_compressStream2(zctx_, &outBuf, &in, mode);
+            if (ZSTD_isError(remain))
+            {
+                ok_ = false;
+                return false;
+            }
+            out.append(buffer, outBuf.pos);
+            if (remain == 0 && in.pos == in.size)
+            {
+                return true;
+            }
+        }
+    }
+};
+
+// まとめて圧縮
+inline bool compressString(Encoding enc, const std::string &src, std::string &out, int level = 0)
+{
+    Compressor comp{enc, level};
+    out.clear();
+    return comp.compress(src.data(), src.size(), true, out);
+}
+
+//
+// ストリーム展開
+//
+class Decompressor
+{
+    Encoding enc_;
+    z_stream zs_{};
+    ZSTD_DCtx *zctx_{nullptr};
+    bool ok_{true};
+
+  public:
+    explicit Decompressor(Encoding enc) : enc_(enc)
+    {
+        if (enc_ == Encoding::Gzip)
+        {
+            // windowBits 15 + 32でgzip/zlibを自動判別
+            ok_ = inflateInit2(&zs_, 15 + 32) == Z_OK;
+        }
+        else if (enc_ == Encoding::Zstd)
+        {
+            zctx_ = ZSTD_createDCtx();
+            ok_   = zctx_ != nullptr;
+        }
+    }
+    ~Decompressor()
+    {
+        if (enc_ == Encoding::Gzip)
+        {
+            inflateEnd(&zs_);
+        }
+        ZSTD_freeDCtx(zctx_);
+    }
+    Decompressor(const Decompressor &)            = delete;
+    Decompressor &operator=(const Decompressor &) = delete;
+
+    // 展開できた分を順にcallback(data, len)に渡す(callbackがfalseなら中断)
+    template <class Callback> bool decompress(const char *data, size_t len, Callback &&callback)
+    {
+        if (!ok_)
+        {
+            return false;
+        }
+        if (enc_ == Encoding::Identity)
+        {
+            return callback(data, len);
+        }
+        char buffer[64 * 1024];
+        if (enc_ == Encoding::Gzip)
+        {
+            zs_.next_in  = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+            zs_.avail_in = static_cast<uInt>(len);
+            while (zs_.avail_in > 0)
+            {
+                zs_.next_out  = reinterpret_cast<Bytef *>(buffer);
+                zs_.avail_out = sizeof(buffer);
+                auto ret      = inflate(&zs_, Z_NO_FLUSH);
+                if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+                {
+                    ok_ = false;
+                    return false;
+                }
+                auto produced = sizeof(buffer) - zs_.avail_out;
+                if (produced > 0 && !callback(buffer, produced))
+                {
+                    return false;
+                }
+                if (ret == Z_STREAM_END)
+                {
+                    // 連結されたgzipにも対応
+                    inflateReset(&zs_);
+                }
+                else if (produced == 0)
+                {
+                    break;
+                }
+            }
+            return true;
+        }
+
+        ZSTD_inBuffer in{data, len, 0};
+        while (in.pos < in.size)
+        {
+            ZSTD_outBuffer out{buffer, sizeof(buffer), 0};
+            auto ret = ZSTD_decompressStream(zctx_, &out, &in);
+            if (ZSTD_isError(ret))
+            {
+                ok_ = false;
+                return false;
+            }
+            if (out.pos > 0 && !callback(buffer, out.pos))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+};
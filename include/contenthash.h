@@ -0,0 +1,227 @@
+//
+// Copyright 2023 Suzuki Yoshinori(wave.suzuki.z@gmail.com)
+//
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <openssl/evp.h>
+#include <string>
+#include <vector>
+
+//
+// XXH64(非暗号学的な高速ハッシュ、リトルエンディアン前提)
+//
+class XxHash64
+{
+    static constexpr uint64_t Prime1 = 0x9E3779B185EBCA87ULL;
+    static constexpr uint64_t Prime2 = 0xC2B2AE3D27D4EB4FULL;
+    static constexpr uint64_t Prime3 = 0x165667B19E3779F9ULL;
+    static constexpr uint64_t Prime4 = 0x85EBCA77C2B2AE63ULL;
+    static constexpr uint64_t Prime5 = 0x27D4EB2F165667C5ULL;
+
+    uint64_t acc_[4];
+    uint64_t seed_;
+    uint64_t total_{0};
+    uint8_t buffer_[32];
+    size_t buffered_{0};
+
+    static uint64_t rotl(uint64_t v, int r) { return (v << r) | (v >> (64 - r)); }
+    static uint64_t read64(const uint8_t *p)
+    {
+        uint64_t v;
+        std::memcpy(&v, p, sizeof(v));
+        return v;
+    }
+    static uint32_t read32(const uint8_t *p)
+    {
+        uint32_t v;
+        std::memcpy(&v, p, sizeof(v));
+        return v;
+    }
+    static uint64_t round(uint64_t acc, uint64_t input)
+    {
+        acc += input * Prime2;
+        return rotl(acc, 31) * Prime1;
+    }
+    static uint64_t mergeRound(uint64_t acc, uint64_t v)
+    {
+        acc ^= round(0, v);
+        return acc * Prime1 + Prime4;
+    }
+
+    // 32バイト単位の処理
+    void consume(const uint8_t *p)
+    {
+        acc_[0] = round(acc_[0], read64(p));
+        acc_[1] = round(acc_[1], read64(p + 8));
+        acc_[2] = round(acc_[2], read64(p + 16));
+        acc_[3] = round(acc_[3], read64(p + 24));
+    }
+
+  public:
+    explicit XxHash64(uint64_t seed = 0) : seed_(seed) { reset(); }
+
+    //
+    void reset()
+    {
+        acc_[0]   = seed_ + Prime1 + Prime2;
+        acc_[1]   = seed_ + Prime2;
+        acc_[2]   = seed_;
+        acc_[3]   = seed_ - Prime1;
+        total_    = 0;
+        buffered_ = 0;
+    }
+
+    //
+    void update(const void *data, size_t len)
+    {
+        auto *p = static_cast<const uint8_t *>(data);
+        total_ += len;
+        if (buffered_ + len < sizeof(buffer_))
+        {
+            std::memcpy(buffer_ + buffered_, p, len);
+            buffered_ += len;
+            return;
+        }
+        if (buffered_ > 0)
+        {
+            auto fill = sizeof(buffer_) - buffered_;
+            std::memcpy(buffer_ + buffered_, p, fill);
+            consume(buffer_);
+            p += fill;
+            len -= fill;
+            buffered_ = 0;
+        }
+        for (; len >= sizeof(buffer_); p += sizeof(buffer_), len -= sizeof(buffer_))
+        {
+            consume(p);
+        }
+        std::memcpy(buffer_, p, len);
+        buffered_ = len;
+    }
+
+    //
+    uint64_t digest() const
+    {
+        uint64_t h;
+        if (total_ >= sizeof(buffer_))
+        {
+            h = rotl(acc_[0], 1) + rotl(acc_[1], 7) + rotl(acc_[2], 12) + rotl(acc_[3], 18);
+            for (auto acc : acc_)
+            {
+                h = mergeRound(h, acc);
+            }
+        }
+        else
+        {
+            h = seed_ + Prime5;
+        }
+        h += total_;
+
+        const uint8_t *p   = buffer_;
+        const uint8_t *end = buffer_ + buffered_;
+        for (; p + 8 <= end; p += 8)
+        {
+            h ^= round(0, read64(p));
+            h = rotl(h, 27) * Prime1 + Prime4;
+        }
+        if (p + 4 <= end)
+        {
+            h ^= static_cast<uint64_t>(read32(p)) * Prime1;
+            h = rotl(h, 23) * Prime2 + Prime3;
+            p += 4;
+        }
+        for (; p < end; p++)
+        {
+            h ^= *p * Prime5;
+            h = rotl(h, 11) * Prime1;
+        }
+
+        h ^= h >> 33;
+        h *= Prime2;
+        h ^= h >> 29;
+        h *= Prime3;
+        h ^= h >> 32;
+        return h;
+    }
+};
+
+// 16進文字列
+inline std::string toHexString(const uint8_t *data, size_t len)
+{
+    static const char hex[] = "0123456789abcdef";
+    std::string result;
+    result.reserve(len * 2);
+    for (size_t i = 0; i < len; i++)
+    {
+        result += hex[data[i] >> 4];
+        result += hex[data[i] & 15];
+    }
+    return result;
+}
+inline std::string toHexString(uint64_t v)
+{
+    uint8_t bytes[8];
+    for (int i = 0; i < 8; i++)
+    {
+        bytes[i] = static_cast<uint8_t>(v >> (56 - i * 8));
+    }
+    return toHexString(bytes, sizeof(bytes));
+}
+
+//
+// ファイル内容のハッシュ(XXH64と、必要ならSHA-256)
+//
+struct ContentHash
+{
+    std::string hash_;   // XXH64
+    std::string sha256_; // 求めていなければ空
+};
+
+// 読めなければfalse
+inline bool hashFile(const std::string &path, bool withSha256, ContentHash &result)
+{
+    std::ifstream inFile{path, std::ios::binary};
+    if (!inFile)
+    {
+        return false;
+    }
+
+    XxHash64 xxh;
+    EVP_MD_CTX *ctx = nullptr;
+    if (withSha256)
+    {
+        ctx = EVP_MD_CTX_new();
+        EVP_DigestInit_ex(ctx, EVP_sha256(), nullptr);
+    }
+    std::vector<char> buffer(1024 * 1024);
+    while (inFile)
+    {
+        inFile.read(buffer.data(), buffer.size());
+        auto len = static_cast<size_t>(inFile.gcount());
+        if (len == 0)
+        {
+            break;
+        }
+        xxh.update(buffer.data(), len);
+        if (ctx)
+        {
+            EVP_DigestUpdate(ctx, buffer.data(), len);
+        }
+    }
+    bool ok      = inFile.eof();
+    result.hash_ = toHexString(xxh.digest());
+    result.sha256_.clear();
+    if (ctx)
+    {
+        unsigned char md[EVP_MAX_MD_SIZE];
+        unsigned int mdLen = 0;
+        EVP_DigestFinal_ex(ctx, md, &mdLen);
+        EVP_MD_CTX_free(ctx);
+        result.sha256_ = toHexString(md, mdLen);
+    }
+    return ok;
+}
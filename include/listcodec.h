@@ -0,0 +1,252 @@
+//
+// Copyright 2023 Suzuki Yoshinori(wave.suzuki.z@gmail.com)
+//
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+//
+// ファイルリストのバイナリ形式
+//
+// レコード: [varint レコード長][varint 前のパスとの共通部分の長さ][varint 残りの長さ][残りのパス]
+//           [varint サイズ][varint 更新時刻(zigzag)][varint フラグ]
+// ハッシュのフラグがあればフラグの後に生のバイト列(XXH64は8バイト、SHA-256は32バイト)が続く
+// レコード長0で終端
+//
+constexpr const char *ListContentType = "application/x-fsrv-list";
+
+// フラグ
+constexpr uint64_t ListFlagDelete = 1 << 0;
+constexpr uint64_t ListFlagHash   = 1 << 1; // XXH64
+constexpr uint64_t ListFlagSha256 = 1 << 2;
+
+// ハッシュのバイト数
+constexpr size_t HashBytes   = 8;
+constexpr size_t Sha256Bytes = 32;
+
+//
+struct ListEntry
+{
+    std::string path_;
+    uint64_t size_{0};
+    int64_t time_{0};
+    bool delete_{false};
+    std::string hash_;   // XXH64(16進、なければ空)
+    std::string sha256_; // SHA-256(16進、なければ空)
+};
+
+//
+inline void putVarint(std::string &out, uint64_t v)
+{
+    while (v >= 0x80)
+    {
+        out += static_cast<char>((v & 0x7f) | 0x80);
+        v >>= 7;
+    }
+    out += static_cast<char>(v);
+}
+
+// 読めなければfalse(pは進めない)
+inline bool getVarint(const char *&p, const char *end, uint64_t &v)
+{
+    uint64_t result = 0;
+    const char *q   = p;
+    for (int shift = 0; shift < 64 && q < end; shift += 7)
+    {
+        auto byte = static_cast<uint8_t>(*q++);
+        result |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0)
+        {
+            v = result;
+            p = q;
+            return true;
+        }
+    }
+    return false;
+}
+
+// 16進文字列を生のバイト列で追加
+inline void putDigest(std::string &out, const std::string &hex)
+{
+    auto nibble = [](char c) { return c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10; };
+    for (size_t i = 0; i + 1 < hex.size(); i += 2)
+    {
+        out += static_cast<char>(nibble(hex[i]) << 4 | nibble(hex[i + 1]));
+    }
+}
+
+// 生のバイト列を16進文字列で取り出す(足りなければfalse)
+inline bool getDigest(const char *&p, const char *end, size_t len, std::string &hex)
+{
+    static const char digits[] = "0123456789abcdef";
+    if (static_cast<size_t>(end - p) < len)
+    {
+        return false;
+    }
+    hex.clear();
+    for (size_t i = 0; i < len; i++)
+    {
+        auto byte = static_cast<uint8_t>(*p++);
+        hex += digits[byte >> 4];
+        hex += digits[byte & 15];
+    }
+    return true;
+}
+
+// ハッシュのフラグ
+inline uint64_t digestFlags(const std::string &hash, const std::string &sha256)
+{
+    return (hash.size() == HashBytes * 2 ? ListFlagHash : 0) |
+           (sha256.size() == Sha256Bytes * 2 ? ListFlagSha256 : 0);
+}
+
+// フラグに応じてハッシュを書く、読む
+inline void putDigests(std::string &out, uint64_t flags, const std::string &hash,
+                       const std::string &sha256)
+{
+    if (flags & ListFlagHash)
+    {
+        putDigest(out, hash);
+    }
+    if (flags & ListFlagSha256)
+    {
+        putDigest(out, sha256);
+    }
+}
+inline bool getDigests(const char *&p, const char *end, uint64_t flags, std::string &hash,
+                       std::string &sha256)
+{
+    hash.clear();
+    sha256.clear();
+    return (!(flags & ListFlagHash) || getDigest(p, end, HashBytes, hash)) &&
+           (!(flags & ListFlagSha256) || getDigest(p, end, Sha256Bytes, sha256));
+}
+
+inline uint64_t zigzagEncode(int64_t v)
+{
+    return (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63);
+}
+inline int64_t zigzagDecode(uint64_t v)
+{
+    return static_cast<int64_t>(v >> 1) ^ -static_cast<int64_t>(v & 1);
+}
+
+//
+// エンコーダ
+//
+class ListEncoder
+{
+    std::string prevPath_;
+    std::string record_;
+
+  public:
+    //
+    void encode(std::string &out, const ListEntry &entry)
+    {
+        size_t shared = 0;
+        auto maxLen   = std::min(prevPath_.size(), entry.path_.size());
+        while (shared < maxLen && prevPath_[shared] == entry.path_[shared])
+        {
+            shared++;
+        }
+
+        record_.clear();
+        putVarint(record_, shared);
+        putVarint(record_, entry.path_.size() - shared);
+        record_.append(entry.path_, shared);
+        putVarint(record_, entry.size_);
+        putVarint(record_, zigzagEncode(entry.time_));
+        auto flags = (entry.delete_ ? ListFlagDelete : 0) | digestFlags(entry.hash_, entry.sha256_);
+        putVarint(record_, flags);
+        putDigests(record_, flags, entry.hash_, entry.sha256_);
+
+        putVarint(out, record_.size());
+        out += record_;
+        prevPath_ = entry.path_;
+    }
+
+    // 終端
+    void finish(std::string &out) { putVarint(out, 0); }
+};
+
+//
+// インクリメンタルデコーダ(届いた分だけ順次コールバックする)
+//
+class ListDecoder
+{
+    std::string buffer_;
+    ListEntry entry_;
+    bool finished_{false};
+    bool error_{false};
+
+    //
+    bool decodeRecord(const char *p, const char *end)
+    {
+        uint64_t shared, suffixLen, size, time, flags;
+        if (!getVarint(p, end, shared) || !getVarint(p, end, suffixLen) ||
+            shared > entry_.path_.size() || suffixLen > static_cast<uint64_t>(end - p))
+        {
+            return false;
+        }
+        entry_.path_.resize(shared);
+        entry_.path_.append(p, suffixLen);
+        p += suffixLen;
+        if (!getVarint(p, end, size) || !getVarint(p, end, time) || !getVarint(p, end, flags) ||
+            !getDigests(p, end, flags, entry_.hash_, entry_.sha256_))
+        {
+            return false;
+        }
+        entry_.size_   = size;
+        entry_.time_   = zigzagDecode(time);
+        entry_.delete_ = (flags & ListFlagDelete) != 0;
+        return true;
+    }
+
+  public:
+    // データ投入(不正なデータならfalse)
+    template <class Callback> bool feed(const char *data, size_t len, Callback &&callback)
+    {
+        if (error_)
+        {
+            return false;
+        }
+        buffer_.append(data, len);
+
+        const char *p   = buffer_.data();
+        const char *end = p + buffer_.size();
+        while (!finished_ && p < end)
+        {
+            const char *q = p;
+            uint64_t recLen;
+            if (!getVarint(q, end, recLen))
+            {
+                break;
+            }
+            if (recLen == 0)
+            {
+                finished_ = true;
+                p         = q;
+                break;
+            }
+            if (recLen > static_cast<uint64_t>(end - q))
+            {
+                break;
+            }
+            if (!decodeRecord(q, q + recLen))
+            {
+                error_ = true;
+                return false;
+            }
+            callback(static_cast<const ListEntry &>(entry_));
+            p = q + recLen;
+        }
+        buffer_.erase(0, p - buffer_.data());
+        return true;
+    }
+
+    // 終端まで読んだか
+    bool finished() const { return finished_; }
+};
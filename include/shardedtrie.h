@@ -0,0 +1,216 @@
+//
+// Copyright 2023 Suzuki Yoshinori(wave.suzuki.z@gmail.com)
+//
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <trie.h>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+//
+// キーの範囲毎に分けたトライ
+// snapshot()で作る公開用の複製は各部分を共有するだけで、
+// その後の変更は共有している部分だけを複製してから行う(公開の手間が全体の大きさによらない)
+//
+template <class Key, class Body> class ShardedTrie
+{
+  public:
+    using Part = Trie<Key, Body>;
+
+  private:
+    static constexpr size_t ShardSize = 4096; // 分けた後の1つの大きさ(この倍を超えたら分ける)
+
+    struct Shard
+    {
+        std::string first_; // この部分の最小のキー(最初の部分は空)
+        std::shared_ptr<Part> trie_;
+        uint64_t owner_{0}; // 変更してよい版(違えば共有しているので複製する)
+    };
+    std::vector<Shard> shards_;
+    uint64_t version_{1};
+    size_t count_{0};
+
+    // キーを含む部分
+    size_t find(std::string_view key) const
+    {
+        auto it = std::upper_bound(shards_.begin() + 1, shards_.end(), key,
+                                   [](std::string_view k, const Shard &s) { return k < s.first_; });
+        return it - shards_.begin() - 1;
+    }
+
+    // 変更する部分(共有していれば複製する)
+    Part &edit(size_t idx)
+    {
+        auto &shard = shards_[idx];
+        if (shard.owner_ != version_)
+        {
+            shard.trie_  = std::make_shared<Part>(*shard.trie_);
+            shard.owner_ = version_;
+        }
+        return *shard.trie_;
+    }
+
+    // 大きくなった部分を分ける(走査直後の一括登録も公開時にまとめて分ける)
+    void split()
+    {
+        if (std::none_of(shards_.begin(), shards_.end(),
+                         [](const Shard &s) { return s.trie_->size() > ShardSize * 2; }))
+        {
+            return;
+        }
+        std::vector<Shard> result;
+        for (auto &shard : shards_)
+        {
+            if (shard.trie_->size() <= ShardSize * 2)
+            {
+                result.push_back(std::move(shard));
+                continue;
+            }
+            size_t n = 0;
+            shard.trie_->forEachEntry(
+                [&](const std::string &key, const Body &body)
+                {
+                    if (n++ % ShardSize == 0)
+                    {
+                        auto first = n == 1 ? shard.first_ : key;
+                        result.push_back({std::move(first), std::make_shared<Part>(), version_});
+                    }
+                    result.back().trie_->insert(key, body);
+                });
+        }
+        shards_ = std::move(result);
+    }
+
+    ShardedTrie(const ShardedTrie &) = default;
+
+  public:
+    //
+    // プレフィックス以下を辞書順にたどるカーソル(部分をまたいで続ける)
+    // 元のトライ(公開用の複製)が残っている間だけ使える
+    //
+    class Cursor
+    {
+        const std::vector<Shard> *shards_{nullptr};
+        size_t idx_{0};
+        std::string prefix_;
+        typename Part::Cursor cursor_;
+
+      public:
+        Cursor() = default;
+        Cursor(const std::vector<Shard> *shards, size_t idx, std::string prefix,
+               typename Part::Cursor cursor)
+            : shards_(shards), idx_(idx), prefix_(std::move(prefix)), cursor_(cursor)
+        {
+        }
+
+        // 次の要素(終わりならnullptr)
+        const Body *next()
+        {
+            while (shards_)
+            {
+                if (auto *body = cursor_.next())
+                {
+                    return body;
+                }
+                // 次の部分の最小のキーがプレフィックスより後なら終わり
+                if (++idx_ >= shards_->size() ||
+                    (*shards_)[idx_].first_.compare(0, prefix_.size(), prefix_) > 0)
+                {
+                    shards_ = nullptr;
+                    break;
+                }
+                cursor_ = (*shards_)[idx_].trie_->cursor(prefix_);
+            }
+            return nullptr;
+        }
+    };
+
+    ShardedTrie() : shards_{Shard{{}, std::make_shared<Part>(), 1}} {}
+    ShardedTrie(ShardedTrie &&)            = default;
+    ShardedTrie &operator=(ShardedTrie &&) = default;
+    ShardedTrie &operator=(const ShardedTrie &) = delete;
+
+    // 公開用の複製(各部分は共有し、以降こちらで変更するときに複製する)
+    ShardedTrie snapshot()
+    {
+        split();
+        ShardedTrie copy{*this};
+        copy.version_ = 0;
+        version_++;
+        return copy;
+    }
+
+    //
+    void insert(const Key &key, Body body)
+    {
+        auto &part   = edit(find(key));
+        auto before  = part.size();
+        part.insert(key, std::move(body));
+        count_ += part.size() - before;
+    }
+
+    //
+    std::optional<Body> search(const Key &key) const
+    {
+        return shards_[find(key)].trie_->search(key);
+    }
+
+    // プレフィックスで始まる要素のカーソル
+    Cursor cursor(const Key &prefix) const
+    {
+        auto idx = find(prefix);
+        return Cursor{&shards_, idx, prefix, shards_[idx].trie_->cursor(prefix)};
+    }
+
+    // プレフィックスで始まり、afterより後の要素のカーソル(afterはプレフィックスで始まること)
+    Cursor cursorAfter(const Key &prefix, const Key &after) const
+    {
+        if (!std::string_view{after}.starts_with(std::string_view{prefix}))
+        {
+            return Cursor{};
+        }
+        auto idx = find(after);
+        return Cursor{&shards_, idx, prefix, shards_[idx].trie_->cursorAfter(prefix, after)};
+    }
+
+    // プレフィックスで始まる要素を辞書順に呼び出す(boolを返す関数ならfalseで中断)
+    template <class Fn> void forEachWithPrefix(const Key &prefix, Fn &&fn) const
+    {
+        auto c = cursor(prefix);
+        while (auto *body = c.next())
+        {
+            if constexpr (std::is_same_v<std::invoke_result_t<Fn &, const Body &>, bool>)
+            {
+                if (!fn(*body))
+                {
+                    return;
+                }
+            }
+            else
+            {
+                fn(*body);
+            }
+        }
+    }
+
+    // 登録数
+    size_t size() const { return count_; }
+
+    // 使用メモリ(おおよそ、他と共有している部分も含む)
+    size_t memoryUsage() const
+    {
+        size_t total = shards_.capacity() * sizeof(Shard);
+        for (auto &shard : shards_)
+        {
+            total += shard.first_.capacity() + shard.trie_->memoryUsage();
+        }
+        return total;
+    }
+};
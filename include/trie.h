@@ -4,23 +4,41 @@
 //
 #pragma once
 
+#include <algorithm>
+#include <cstring>
+#include <deque>
 #include <iostream>
 #include <list>
 #include <memory>
 #include <optional>
 #include <string>
-#include <unordered_map>
+#include <string_view>
+#include <type_traits>
+#include <vector>
 
+//
+// 経路圧縮したノード(辺のラベルを持つ)
 //
 template <class Body> class TrieNode
 {
   public:
-    using Ptr = std::unique_ptr<TrieNode>;
-    std::unordered_map<char, Ptr> children;
+    std::string label;                // 親からこのノードまでの文字列
+    std::string childKeys;            // 子のラベルの先頭文字(ソート済み)
+    std::vector<TrieNode *> children; // childKeysと同じ順
+    TrieNode *parent{nullptr};
     Body body{};
     bool isEndOfWord{false}; // ノードが単語の終端を示す場合はtrue
+
+    //
+    size_t findChild(char c) const
+    {
+        auto *p = static_cast<const char *>(std::memchr(childKeys.data(), c, childKeys.size()));
+        return p ? p - childKeys.data() : std::string::npos;
+    }
 };
 
+//
+// ノードはアリーナからまとめて確保する
 //
 template <class Key, class Body> class Trie
 {
@@ -28,111 +46,446 @@ template <class Key, class Body> class Trie
     using MyNode = TrieNode<Body>;
 
   private:
-    std::unique_ptr<MyNode> root{std::make_unique<MyNode>()};
+    std::deque<MyNode> arena_;       // ノード本体(アドレスは変わらない)
+    std::vector<MyNode *> freeList_; // 削除されて再利用を待つノード
+    MyNode *root{newNode({})};
+    size_t count_{0};
 
-  public:
-    Trie()          = default;
-    virtual ~Trie() = default;
+    //
+    MyNode *newNode(std::string_view label)
+    {
+        MyNode *node;
+        if (freeList_.empty())
+        {
+            node = &arena_.emplace_back();
+        }
+        else
+        {
+            node = freeList_.back();
+            freeList_.pop_back();
+        }
+        node->label.assign(label);
+        return node;
+    }
 
     //
-    void insert(const Key &word, Body bodyarg)
+    void freeNode(MyNode *node)
+    {
+        node->parent = nullptr;
+        node->label.clear();
+        node->childKeys.clear();
+        node->children.clear();
+        node->body        = Body{};
+        node->isEndOfWord = false;
+        freeList_.push_back(node);
+    }
+
+    // ソート順を保って子を追加
+    static void addChild(MyNode *parent, MyNode *child)
+    {
+        auto c   = child->label[0];
+        auto pos = parent->childKeys.size();
+        while (pos > 0 && static_cast<unsigned char>(parent->childKeys[pos - 1]) >
+                              static_cast<unsigned char>(c))
+        {
+            pos--;
+        }
+        parent->childKeys.insert(parent->childKeys.begin() + pos, c);
+        parent->children.insert(parent->children.begin() + pos, child);
+        child->parent = parent;
+    }
+
+    // 子が1つだけの中継ノードは子とまとめる
+    void mergeWithChild(MyNode *node)
+    {
+        if (node == root || node->isEndOfWord || node->children.size() != 1)
+        {
+            return;
+        }
+        auto *child = node->children[0];
+        node->label += child->label;
+
+        node->childKeys   = std::move(child->childKeys);
+        node->children    = std::move(child->children);
+        node->body        = std::move(child->body);
+        node->isEndOfWord = child->isEndOfWord;
+        for (auto *c : node->children)
+        {
+            c->parent = node;
+        }
+        freeNode(child);
+    }
+
+    // 完全に一致するノード
+    MyNode *findNode(std::string_view word) const
+    {
+        MyNode *node = root;
+        while (!word.empty())
+        {
+            auto idx = node->findChild(word[0]);
+            if (idx == std::string::npos)
+            {
+                return nullptr;
+            }
+            node = node->children[idx];
+            if (word.substr(0, node->label.size()) != node->label)
+            {
+                return nullptr;
+            }
+            word.remove_prefix(node->label.size());
+        }
+        return node;
+    }
+
+    // プレフィックスに一致する部分木の根(ラベルの途中で終わってもよい)
+    MyNode *findPrefixNode(std::string_view prefix) const
     {
-        MyNode *node = root.get();
-        for (char c : word)
+        MyNode *node = root;
+        while (!prefix.empty())
         {
-            if (node->children.find(c) == node->children.end())
+            auto idx = node->findChild(prefix[0]);
+            if (idx == std::string::npos)
+            {
+                return nullptr;
+            }
+            node     = node->children[idx];
+            auto len = std::min(prefix.size(), node->label.size());
+            if (prefix.substr(0, len) != std::string_view{node->label}.substr(0, len))
             {
-                node->children[c]       = std::make_unique<MyNode>();
-                node->children[c]->body = bodyarg;
+                return nullptr;
             }
-            node = node->children[c].get();
+            prefix.remove_prefix(len);
         }
-        node->isEndOfWord = true;
+        return node;
     }
 
+  public:
     //
-    std::optional<Body> search(const Key &word)
+    // プレフィックス以下を辞書順にたどるカーソル
+    // コンテナを作らず、親へのポインタで戻るのでスタックも持たない
+    //
+    class Cursor
     {
-        MyNode *node = root.get();
-        for (char c : word)
+        friend class Trie;
+        const MyNode *start_{nullptr};
+        const MyNode *node_{nullptr};
+
+        // 前順で次のノード
+        const MyNode *advance(const MyNode *node) const
         {
-            if (node->children.find(c) == node->children.end())
+            if (!node->children.empty())
             {
-                return std::nullopt;
+                return node->children.front();
             }
-            node = node->children[c].get();
+            return skip(node);
         }
-        if (node->isEndOfWord)
+
+        // 部分木を飛ばして次のノード
+        const MyNode *skip(const MyNode *node) const
         {
-            return node->body;
+            while (node != start_)
+            {
+                auto *parent = node->parent;
+                auto idx     = parent->findChild(node->label[0]);
+                if (idx + 1 < parent->children.size())
+                {
+                    return parent->children[idx + 1];
+                }
+                node = parent;
+            }
+            return nullptr;
+        }
+
+      public:
+        Cursor() = default;
+        explicit Cursor(const MyNode *start) : start_(start), node_(start) {}
+
+        // 次の要素(終わりならnullptr)
+        const Body *next()
+        {
+            while (node_)
+            {
+                auto *node = node_;
+                node_      = advance(node);
+                if (node->isEndOfWord)
+                {
+                    return &node->body;
+                }
+            }
+            return nullptr;
+        }
+    };
+
+    Trie()                        = default;
+    Trie &operator=(const Trie &) = delete;
+    virtual ~Trie()               = default;
+
+    // 複製(削除で空いたノードは詰める)
+    Trie(const Trie &other) : count_(other.count_)
+    {
+        std::vector<std::pair<const MyNode *, MyNode *>> stack{{other.root, root}};
+        while (!stack.empty())
+        {
+            auto [src, dst] = stack.back();
+            stack.pop_back();
+            dst->body        = src->body;
+            dst->isEndOfWord = src->isEndOfWord;
+            dst->childKeys   = src->childKeys;
+            dst->children.resize(src->children.size());
+            for (size_t i = 0; i < src->children.size(); i++)
+            {
+                auto *child      = newNode(src->children[i]->label);
+                child->parent    = dst;
+                dst->children[i] = child;
+                stack.emplace_back(src->children[i], child);
+            }
         }
-        return std::nullopt;
     }
 
     //
-    std::list<Body> searchByPrefix(const Key &prefix)
+    void insert(const Key &wordarg, Body bodyarg)
     {
-        std::list<Body> results;
-        MyNode *node = root.get();
-
-        // プレフィックスまでのノードを探索
-        for (char c : prefix)
+        std::string_view word{wordarg};
+        MyNode *node = root;
+        for (;;)
         {
-            if (node->children.find(c) == node->children.end())
+            if (word.empty())
             {
-                return results; // プレフィックスが存在しない場合、空のリストを返す
+                node->body = std::move(bodyarg);
+                if (!node->isEndOfWord)
+                {
+                    node->isEndOfWord = true;
+                    count_++;
+                }
+                return;
             }
-            node = node->children[c].get();
+
+            auto idx = node->findChild(word[0]);
+            if (idx == std::string::npos)
+            {
+                // 残り全部をラベルにした葉を追加
+                auto *leaf        = newNode(word);
+                leaf->body        = std::move(bodyarg);
+                leaf->isEndOfWord = true;
+                addChild(node, leaf);
+                count_++;
+                return;
+            }
+
+            auto *child = node->children[idx];
+            auto &label = child->label;
+            size_t len  = 1;
+            while (len < label.size() && len < word.size() && label[len] == word[len])
+            {
+                len++;
+            }
+            if (len < label.size())
+            {
+                // ラベルの途中で分かれるので分割
+                auto *mid = newNode(word.substr(0, len));
+                label.erase(0, len);
+                mid->childKeys.assign(1, label[0]);
+                mid->children.assign(1, child);
+                mid->parent         = node;
+                child->parent       = mid;
+                node->children[idx] = mid;
+                child               = mid;
+            }
+            node = child;
+            word.remove_prefix(len);
         }
+    }
 
-        // この時点で、nodeはプレフィックスの最後の文字を指しています
-        findAllWordsWithPrefix(node, results);
-        return results;
+    //
+    std::optional<Body> search(const Key &word) const
+    {
+        auto *node = findNode(word);
+        if (node && node->isEndOfWord)
+        {
+            return node->body;
+        }
+        return std::nullopt;
     }
 
     //
-    bool remove(const Key &word) { return _remove(root, word, 0); }
+    std::list<Body> searchByPrefix(const Key &prefix) const
+    {
+        std::list<Body> results;
+        forEachWithPrefix(prefix, [&](const Body &body) { results.push_back(body); });
+        return results;
+    }
 
-  private:
-    void findAllWordsWithPrefix(MyNode *node, std::list<Body> &results)
+    // プレフィックスで始まる要素のカーソル
+    Cursor cursor(const Key &prefix) const
+    {
+        auto *node = findPrefixNode(prefix);
+        return node ? Cursor{node} : Cursor{};
+    }
+
+    // プレフィックスで始まり、afterより後の要素のカーソル(afterが前回の最後なら続きから)
+    // afterはプレフィックスで始まること
+    Cursor cursorAfter(const Key &prefix, const Key &after) const
     {
-        if (node->isEndOfWord)
+        auto *start = findPrefixNode(prefix);
+        if (!start || !std::string_view{after}.starts_with(std::string_view{prefix}))
         {
-            results.push_back(node->body);
+            return Cursor{};
         }
-        for (const auto &pair : node->children)
+        Cursor c{start};
+        std::string_view word{after};
+        const MyNode *node = root;
+        for (;;)
         {
-            findAllWordsWithPrefix(pair.second.get(), results);
+            if (word.empty())
+            {
+                // afterそのもの
+                c.node_ = c.advance(node);
+                return c;
+            }
+            auto uc  = static_cast<unsigned char>(word[0]);
+            auto idx = node->findChild(word[0]);
+            if (idx == std::string::npos)
+            {
+                // afterより大きい最初の子、なければこの部分木の後
+                auto &keys = node->childKeys;
+                auto it    = std::find_if(keys.begin(), keys.end(), [uc](char k)
+                                          { return static_cast<unsigned char>(k) > uc; });
+                c.node_ = it != keys.end() ? node->children[it - keys.begin()] : c.skip(node);
+                return c;
+            }
+            auto *child = node->children[idx];
+            auto &label = child->label;
+            size_t len  = 1;
+            while (len < label.size() && len < word.size() && label[len] == word[len])
+            {
+                len++;
+            }
+            if (len == label.size())
+            {
+                node = child;
+                word.remove_prefix(len);
+                continue;
+            }
+            // ラベルの途中で分かれた(afterが短いか小さければ部分木全体がafterより後)
+            bool greater = len == word.size() || static_cast<unsigned char>(label[len]) >
+                                                     static_cast<unsigned char>(word[len]);
+            c.node_      = greater ? child : c.skip(child);
+            return c;
         }
     }
 
-    bool _remove(typename MyNode::Ptr &node, const std::string &word, int index)
+    // プレフィックスで始まる要素を辞書順に呼び出す(boolを返す関数ならfalseで中断)
+    template <class Fn> void forEachWithPrefix(const Key &prefix, Fn &&fn) const
     {
-        if (index == word.size())
+        auto c = cursor(prefix);
+        while (auto *body = c.next())
         {
-            if (node->isEndOfWord)
+            if constexpr (std::is_same_v<std::invoke_result_t<Fn &, const Body &>, bool>)
             {
-                node->isEndOfWord = false;
-                return node->children.empty();
+                if (!fn(*body))
+                {
+                    return;
+                }
+            }
+            else
+            {
+                fn(*body);
             }
-            return false;
         }
+    }
 
-        char c = word[index];
-        if (node->children.find(c) == node->children.end())
+    //
+    bool remove(const Key &wordarg)
+    {
+        std::string_view word{wordarg};
+        MyNode *parent = nullptr;
+        MyNode *node   = root;
+        size_t index   = 0;
+        while (!word.empty())
+        {
+            auto idx = node->findChild(word[0]);
+            if (idx == std::string::npos)
+            {
+                return false;
+            }
+            auto *child = node->children[idx];
+            if (word.substr(0, child->label.size()) != child->label)
+            {
+                return false;
+            }
+            word.remove_prefix(child->label.size());
+            parent = node;
+            node   = child;
+            index  = idx;
+        }
+        if (!node->isEndOfWord)
         {
             return false;
         }
 
-        bool shouldDeleteChild = _remove(node->children[c], word, index + 1);
+        node->isEndOfWord = false;
+        node->body        = Body{};
+        count_--;
+        if (node == root)
+        {
+            return true;
+        }
+        if (node->children.empty())
+        {
+            // 葉を外して、親が中継だけになったらまとめる
+            parent->childKeys.erase(index, 1);
+            parent->children.erase(parent->children.begin() + index);
+            freeNode(node);
+            mergeWithChild(parent);
+        }
+        else
+        {
+            mergeWithChild(node);
+        }
+        return true;
+    }
 
-        if (shouldDeleteChild)
+    // キーと要素を辞書順に呼び出す
+    template <class Fn> void forEachEntry(Fn &&fn) const
+    {
+        std::string key;
+        std::vector<std::pair<const MyNode *, size_t>> stack{{root, 0}}; // ノードと親までのキー長
+        while (!stack.empty())
         {
-            node->children[c].reset();
-            node->children.erase(c);
-            return node->children.empty() && !node->isEndOfWord;
+            auto [node, len] = stack.back();
+            stack.pop_back();
+            key.resize(len);
+            key += node->label;
+            if (node->isEndOfWord)
+            {
+                fn(key, node->body);
+            }
+            for (auto it = node->children.rbegin(); it != node->children.rend(); ++it)
+            {
+                stack.emplace_back(*it, key.size());
+            }
         }
+    }
 
-        return false;
+    // 登録数
+    size_t size() const { return count_; }
+
+    // 使用メモリ(おおよそ)
+    size_t memoryUsage() const
+    {
+        size_t total = arena_.size() * sizeof(MyNode);
+        for (auto &node : arena_)
+        {
+            if (node.label.capacity() > 15)
+            {
+                total += node.label.capacity();
+            }
+            if (node.childKeys.capacity() > 15)
+            {
+                total += node.childKeys.capacity();
+            }
+            total += node.children.capacity() * sizeof(MyNode *);
+        }
+        return total;
     }
 };
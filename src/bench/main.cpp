@@ -0,0 +1,671 @@
+//
+// Copyright 2023 Suzuki Yoshinori(wave.suzuki.z@gmail.com)
+//
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cxxopts.hpp>
+#include <filesystem>
+#include <fstream>
+#include <httplib.h>
+#include <iostream>
+#include <map>
+#include <nlohmann/json.hpp>
+#include <random>
+#include <string>
+#include <thread>
+#include <trie.h>
+#include <unordered_set>
+#include <vector>
+#if !_WIN32
+#include <csignal>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#ifndef FSRV_PATH
+#define FSRV_PATH "fsrv"
+#endif
+#ifndef FCLI_PATH
+#define FCLI_PATH "fcli"
+#endif
+
+namespace
+{
+using FilePath = std::filesystem::path;
+using Clock    = std::chrono::steady_clock;
+
+bool verboseMode = false; // 詳細モード
+
+// 進み具合の表示(結果は標準出力に出すので標準エラーへ)
+template <class... Args> void printVerbose(Args... args)
+{
+    if (verboseMode)
+    {
+        (std::cerr << ... << args) << std::endl;
+    }
+}
+
+// 経過時間
+double elapsedMs(Clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+// 計測結果(名前 -> 値)
+// 名前が_per_secで終わるものは大きいほど、それ以外は小さいほど良い
+using Metrics = std::map<std::string, double>;
+
+//
+// 合成ツリー
+//
+struct TreeSpec
+{
+    size_t files_        = 10000;
+    int depth_           = 3;       // ディレクトリの深さ
+    int fanout_          = 8;       // ディレクトリ毎の子ディレクトリ数
+    size_t minSize_      = 256;     // ファイルサイズの下限
+    size_t maxSize_      = 1 << 20; // 上限(その間で対数一様に分布させる)
+    double compressible_ = 0.5;     // テキスト(圧縮が効く)ファイルの割合
+    uint32_t seed_       = 1;
+};
+
+struct TreeFile
+{
+    std::string path_; // ルートからの相対パス
+    size_t size_;
+    bool text_;
+};
+
+// ファイルの一覧を決める(同じspecなら同じものになる)
+std::vector<TreeFile> planTree(const TreeSpec &spec)
+{
+    std::mt19937 rng{spec.seed_};
+    std::uniform_int_distribution<int> dirDist{0, std::max(spec.fanout_, 1) - 1};
+    std::uniform_real_distribution<double> sizeDist{std::log(static_cast<double>(spec.minSize_)),
+                                                    std::log(static_cast<double>(spec.maxSize_))};
+    std::bernoulli_distribution textDist{spec.compressible_};
+
+    std::vector<TreeFile> files;
+    files.reserve(spec.files_);
+    for (size_t i = 0; i < spec.files_; i++)
+    {
+        std::string path;
+        for (int level = 0; level < spec.depth_; level++)
+        {
+            path += "d" + std::to_string(dirDist(rng)) + "/";
+        }
+        bool text = textDist(rng);
+        path += "f" + std::to_string(i) + (text ? ".txt" : ".bin");
+        auto size = static_cast<size_t>(std::exp(sizeDist(rng)));
+        files.push_back({std::move(path), size, text});
+    }
+    return files;
+}
+
+// ツリーを作る(中身は乱数とテキストの使い回し)
+bool generateTree(const FilePath &root, const std::vector<TreeFile> &files, uint32_t seed)
+{
+    constexpr size_t PoolSize = 4 * 1024 * 1024;
+    std::mt19937 rng{seed};
+    std::string randomPool(PoolSize, '\0');
+    for (auto &c : randomPool)
+    {
+        c = static_cast<char>(rng());
+    }
+    std::string textPool;
+    static const char *words[] = {"file ", "sync ", "server ", "client ", "index ",
+                                  "trie ", "list ", "dir\n", "generation ", "hash "};
+    while (textPool.size() < PoolSize)
+    {
+        textPool += words[rng() % std::size(words)];
+    }
+
+    std::error_code ec;
+    std::filesystem::remove_all(root, ec);
+    for (auto &f : files)
+    {
+        FilePath fname = root / f.path_;
+        std::filesystem::create_directories(fname.parent_path(), ec);
+        std::ofstream outFile{fname, std::ios::binary | std::ios::trunc};
+        auto &pool = f.text_ ? textPool : randomPool;
+        for (size_t written = 0; written < f.size_;)
+        {
+            auto len    = std::min(f.size_ - written, PoolSize);
+            auto offset = rng() % (PoolSize - len + 1);
+            outFile.write(pool.data() + offset, static_cast<std::streamsize>(len));
+            written += len;
+        }
+        if (!outFile)
+        {
+            std::cerr << "write failed: " << fname << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+//
+// トライのマイクロベンチマーク
+//
+void benchTrie(const std::vector<TreeFile> &files, Metrics &metrics)
+{
+    std::vector<std::string> keys;
+    keys.reserve(files.size());
+    std::unordered_set<std::string> dirSet;
+    for (auto &f : files)
+    {
+        keys.push_back("bench/" + f.path_);
+        dirSet.insert(FilePath{keys.back()}.parent_path().string() + "/");
+    }
+    std::vector<std::string> dirs{dirSet.begin(), dirSet.end()};
+    auto count = static_cast<double>(keys.size());
+
+    Trie<std::string, size_t> trie;
+    auto start = Clock::now();
+    for (size_t i = 0; i < keys.size(); i++)
+    {
+        trie.insert(keys[i], i);
+    }
+    metrics["trie.insert_ns"] = elapsedMs(start) * 1e6 / count;
+
+    // 登録順とは別の順で引く
+    std::vector<size_t> order(keys.size());
+    for (size_t i = 0; i < order.size(); i++)
+    {
+        order[i] = i;
+    }
+    std::shuffle(order.begin(), order.end(), std::mt19937{7});
+    size_t found = 0;
+    start        = Clock::now();
+    for (auto i : order)
+    {
+        found += trie.search(keys[i]).has_value();
+    }
+    metrics["trie.search_ns"] = elapsedMs(start) * 1e6 / count;
+
+    size_t missed = 0;
+    start         = Clock::now();
+    for (auto i : order)
+    {
+        missed += !trie.search(keys[i] + ".x").has_value();
+    }
+    metrics["trie.search_miss_ns"] = elapsedMs(start) * 1e6 / count;
+
+    size_t entries = 0;
+    start          = Clock::now();
+    for (auto &dir : dirs)
+    {
+        entries += trie.searchByPrefix(dir).size();
+    }
+    auto prefixMs                        = elapsedMs(start);
+    metrics["trie.prefix_ns"]            = prefixMs * 1e6 / static_cast<double>(dirs.size());
+    metrics["trie.prefix_per_sec"]       = static_cast<double>(entries) * 1e3 / prefixMs;
+    metrics["trie.memory_bytes_per_key"] = static_cast<double>(trie.memoryUsage()) / count;
+
+    if (found != keys.size() || missed != keys.size() || entries != keys.size())
+    {
+        std::cerr << "trie mismatch: found " << found << ", missed " << missed << ", prefix "
+                  << entries << " of " << keys.size() << std::endl;
+    }
+}
+
+#if !_WIN32
+//
+// ループバックでのエンドツーエンド計測(fsrv、fcliを子プロセスで動かす)
+//
+struct E2ESpec
+{
+    std::string fsrv_;
+    std::string fcli_;
+    int port_         = DEFAULT_PORT + 100;
+    int jobs_         = 4;
+    int listRequests_ = 20;
+    int rawRequests_  = 4; // 大きなファイルをGETする回数
+};
+
+// サーバーの構成
+struct ServerConfig
+{
+    std::string name_;
+    std::string fileServer_; // mmap or mount
+    bool compress_;
+};
+
+// 子プロセスを起動(cwdが空なら今のディレクトリ)
+pid_t spawn(const std::vector<std::string> &args, const FilePath &cwd)
+{
+    auto pid = ::fork();
+    if (pid != 0)
+    {
+        return pid;
+    }
+    if (!cwd.empty() && ::chdir(cwd.c_str()) != 0)
+    {
+        ::_exit(127);
+    }
+    if (!verboseMode)
+    {
+        int null = ::open("/dev/null", O_WRONLY);
+        ::dup2(null, STDOUT_FILENO);
+        ::dup2(null, STDERR_FILENO);
+    }
+    std::vector<char *> argv;
+    for (auto &a : args)
+    {
+        argv.push_back(const_cast<char *>(a.c_str()));
+    }
+    argv.push_back(nullptr);
+    ::execv(argv[0], argv.data());
+    ::_exit(127);
+}
+
+// 終了を待つ(終了コード、異常終了なら-1、cpuMsには使ったCPU時間)
+int waitExit(pid_t pid, double *cpuMs = nullptr)
+{
+    int status = 0;
+    struct rusage usage{};
+    if (::wait4(pid, &status, 0, &usage) < 0)
+    {
+        return -1;
+    }
+    if (cpuMs)
+    {
+        auto ms = [](const timeval &tv) { return tv.tv_sec * 1e3 + tv.tv_usec / 1e3; };
+        *cpuMs  = ms(usage.ru_utime) + ms(usage.ru_stime);
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+// サーバーを起動して/listに答えるまで待つ(失敗なら-1)
+pid_t startServer(const E2ESpec &spec, const ServerConfig &config, const FilePath &root)
+{
+    auto compress = config.compress_ ? "--compress=true" : "--compress=false";
+    auto start    = Clock::now();
+    auto server   = spawn({spec.fsrv_, "-r", "-p", std::to_string(spec.port_), "--watch=false",
+                           "--file_server", config.fileServer_, compress, root.string()},
+                          {});
+    if (server < 0)
+    {
+        std::cerr << "fork failed" << std::endl;
+        return -1;
+    }
+    httplib::Client cli("localhost", spec.port_);
+    while (elapsedMs(start) < 600 * 1000.0)
+    {
+        auto res = cli.Get("/list?prefix=.fsrv-bench-ready");
+        if (res && res->status == 200)
+        {
+            return server;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds{10});
+    }
+    std::cerr << "server did not start: " << spec.fsrv_ << std::endl;
+    ::kill(server, SIGTERM);
+    waitExit(server);
+    return -1;
+}
+
+// ディレクトリ以下のファイル数
+size_t countFiles(const FilePath &dir)
+{
+    size_t count = 0;
+    std::error_code ec;
+    for (std::filesystem::recursive_directory_iterator it{dir, ec}, end; !ec && it != end;
+         it.increment(ec))
+    {
+        count += it->is_regular_file(ec);
+    }
+    return count;
+}
+
+// パーセンタイル(ソート済み)
+double percentile(const std::vector<double> &sorted, double p)
+{
+    auto idx = static_cast<size_t>(p * static_cast<double>(sorted.size() - 1) + 0.5);
+    return sorted[std::min(idx, sorted.size() - 1)];
+}
+
+//
+bool benchServer(const E2ESpec &spec, const ServerConfig &config, const FilePath &workDir,
+                 const FilePath &treeRoot, size_t fileCount, uint64_t totalBytes,
+                 Metrics &metrics)
+{
+    auto prefix = config.name_ + ".";
+    auto port   = std::to_string(spec.port_);
+    printVerbose("server config: ", config.name_);
+
+    // 起動(走査が終わって/listに答えるまで)
+    auto start  = Clock::now();
+    auto server = startServer(spec, config, treeRoot);
+    if (server < 0)
+    {
+        return false;
+    }
+    metrics[prefix + "startup_ms"] = elapsedMs(start);
+    httplib::Client cli("localhost", spec.port_);
+    cli.set_keep_alive(true);
+    cli.set_decompress(false);
+
+    // /listの応答時間(全ファイル、バイナリ形式)
+    httplib::Headers headers;
+    if (config.compress_)
+    {
+        headers.emplace("Accept-Encoding", "zstd, gzip");
+    }
+    std::vector<double> latencies;
+    size_t listBytes = 0;
+    for (int i = 0; i < spec.listRequests_; i++)
+    {
+        start    = Clock::now();
+        auto res = cli.Get("/list?format=bin", headers);
+        if (res && res->status == 200)
+        {
+            latencies.push_back(elapsedMs(start));
+            listBytes = res->body.size();
+        }
+    }
+    if (!latencies.empty())
+    {
+        std::sort(latencies.begin(), latencies.end());
+        metrics[prefix + "list_p50_ms"] = percentile(latencies, 0.5);
+        metrics[prefix + "list_p95_ms"] = percentile(latencies, 0.95);
+        metrics[prefix + "list_bytes"]  = static_cast<double>(listBytes);
+    }
+
+    // 空のディレクトリに同期、続けて変更なしで同期し直す
+    auto clientDir = workDir / ("client-" + config.name_);
+    std::error_code ec;
+    std::filesystem::remove_all(clientDir, ec);
+    std::filesystem::create_directories(clientDir, ec);
+    std::vector<std::string> syncArgs{spec.fcli_, "localhost", "sync",
+                                      treeRoot.filename().string(), "-p", port,
+                                      "-j", std::to_string(spec.jobs_)};
+    start       = Clock::now();
+    bool synced = waitExit(spawn(syncArgs, clientDir)) == 0;
+    auto syncMs = elapsedMs(start);
+    auto copied = countFiles(clientDir / treeRoot.filename());
+    if (synced && copied == fileCount)
+    {
+        auto megaBytes = static_cast<double>(totalBytes) / (1024.0 * 1024.0);
+
+        metrics[prefix + "sync_ms"]            = syncMs;
+        metrics[prefix + "sync_files_per_sec"] = static_cast<double>(fileCount) * 1e3 / syncMs;
+        metrics[prefix + "sync_mb_per_sec"]    = megaBytes * 1e3 / syncMs;
+
+        start = Clock::now();
+        if (waitExit(spawn(syncArgs, clientDir)) == 0)
+        {
+            metrics[prefix + "resync_ms"] = elapsedMs(start);
+        }
+    }
+    else
+    {
+        std::cerr << "sync failed: " << copied << " of " << fileCount << " files" << std::endl;
+    }
+
+    // 走査、/list、2回の同期で使ったサーバーのCPU時間
+    double cpuMs = 0.0;
+    ::kill(server, SIGTERM);
+    waitExit(server, &cpuMs);
+    metrics[prefix + "server_cpu_ms"] = cpuMs;
+    return synced;
+}
+
+// 大きなファイル1つをfcliを通さずにGETし続けたときの転送速度と、1GB送るのに使ったサーバーのCPU時間
+// (ファイル1つのツリーなので起動時の走査の分はほぼ含まない)
+bool benchThroughput(const E2ESpec &spec, const ServerConfig &config, const FilePath &largeRoot,
+                     uint64_t largeBytes, Metrics &metrics)
+{
+    auto prefix = config.name_ + ".";
+    auto server = startServer(spec, config, largeRoot);
+    if (server < 0)
+    {
+        return false;
+    }
+    httplib::Client cli("localhost", spec.port_);
+    cli.set_keep_alive(true);
+    cli.set_decompress(false);
+    auto path         = "/files/" + largeRoot.filename().string() + "/large.bin";
+    uint64_t received = 0;
+    bool ok           = true;
+    auto start        = Clock::now();
+    for (int i = 0; ok && i < spec.rawRequests_; i++)
+    {
+        auto res = cli.Get(path,
+                           [&](const char *, size_t length)
+                           {
+                               received += length;
+                               return true;
+                           });
+        ok = res && res->status == 200;
+    }
+    auto rawMs = elapsedMs(start);
+
+    double cpuMs = 0.0;
+    ::kill(server, SIGTERM);
+    waitExit(server, &cpuMs);
+    if (!ok || received != largeBytes * static_cast<uint64_t>(spec.rawRequests_))
+    {
+        std::cerr << "raw GET failed: " << received << " bytes" << std::endl;
+        return false;
+    }
+    auto megaBytes = static_cast<double>(received) / (1024.0 * 1024.0);
+
+    metrics[prefix + "raw_mb_per_sec"]       = megaBytes * 1e3 / rawMs;
+    metrics[prefix + "server_cpu_ms_per_gb"] = cpuMs * 1024.0 / megaBytes;
+    return true;
+}
+#endif
+
+// 基準の結果と比べて悪くなったものを表示(なければtrue)
+bool compareBaseline(const Metrics &metrics, const nlohmann::json &baseline, double tolerance)
+{
+    if (!baseline.contains("metrics") || !baseline["metrics"].is_object())
+    {
+        std::cerr << "baseline has no metrics" << std::endl;
+        return false;
+    }
+    bool ok = true;
+    for (auto &[name, value] : metrics)
+    {
+        if (!baseline["metrics"].contains(name))
+        {
+            continue;
+        }
+        auto base = baseline["metrics"][name].get<double>();
+        if (base <= 0.0)
+        {
+            continue;
+        }
+        bool higherIsBetter = name.ends_with("_per_sec");
+        auto ratio          = higherIsBetter ? base / std::max(value, 1e-9) : value / base;
+        if (ratio > 1.0 + tolerance)
+        {
+            std::cerr << "regression: " << name << " " << value << " (baseline " << base << ")"
+                      << std::endl;
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+} // namespace
+
+//
+//
+//
+int main(int argc, char **argv)
+{
+    cxxopts::Options options(argv[0], "fsrv benchmark");
+
+    options.add_options()("h,help", "Print usage")(
+        // verbose
+        "v,verbose", "verbose mode", cxxopts::value<bool>()->default_value("false"))(
+        // tree
+        "files", "number of files in the synthetic tree",
+        cxxopts::value<size_t>()->default_value("10000"))(
+        // depth
+        "depth", "directory depth", cxxopts::value<int>()->default_value("3"))(
+        // fanout
+        "fanout", "subdirectories per directory", cxxopts::value<int>()->default_value("8"))(
+        // size distribution
+        "min_size", "minimum file size in bytes", cxxopts::value<size_t>()->default_value("256"))(
+        "max_size", "maximum file size in bytes (log-uniform between min and max)",
+        cxxopts::value<size_t>()->default_value("1048576"))(
+        // content
+        "compressible", "fraction of text (compressible) files",
+        cxxopts::value<double>()->default_value("0.5"))(
+        // seed
+        "seed", "random seed", cxxopts::value<uint32_t>()->default_value("1"))(
+        // work directory
+        "work_dir", "directory for the tree and the sync clients",
+        cxxopts::value<std::string>()->default_value("fsrv_bench_work"))(
+        // which benchmarks
+        "trie_only", "run only the trie microbenchmarks",
+        cxxopts::value<bool>()->default_value("false"))(
+        // binaries
+        "fsrv", "fsrv executable", cxxopts::value<std::string>()->default_value(FSRV_PATH))(
+        "fcli", "fcli executable", cxxopts::value<std::string>()->default_value(FCLI_PATH))(
+        // port
+        "p,port", "port number for the loopback server",
+        cxxopts::value<int>()->default_value(std::to_string(DEFAULT_PORT + 100)))(
+        // parallel downloads
+        "j,jobs", "parallel downloads for sync", cxxopts::value<int>()->default_value("4"))(
+        // list
+        "list_requests", "number of /list requests to time",
+        cxxopts::value<int>()->default_value("20"))(
+        // raw throughput
+        "large_size", "size of the large file for the raw GET throughput in MiB (0: skip)",
+        cxxopts::value<size_t>()->default_value("256"))(
+        "raw_requests", "number of GETs of the large file",
+        cxxopts::value<int>()->default_value("4"))(
+        // output
+        "o,output", "write JSON results to this file (default: stdout)",
+        cxxopts::value<std::string>())(
+        // regression check
+        "baseline", "compare with a previous JSON result and fail on regressions",
+        cxxopts::value<std::string>())(
+        "tolerance", "allowed slowdown against the baseline (0.2 = 20%)",
+        cxxopts::value<double>()->default_value("0.2"));
+
+    auto result = options.parse(argc, argv);
+    if (result.count("help"))
+    {
+        std::cout << options.help() << std::endl;
+        return 0;
+    }
+    verboseMode = result["verbose"].as<bool>();
+
+    TreeSpec tree;
+    tree.files_        = result["files"].as<size_t>();
+    tree.depth_        = std::max(result["depth"].as<int>(), 0);
+    tree.fanout_       = std::max(result["fanout"].as<int>(), 1);
+    tree.minSize_      = std::max<size_t>(result["min_size"].as<size_t>(), 1);
+    tree.maxSize_      = std::max(result["max_size"].as<size_t>(), tree.minSize_);
+    tree.compressible_ = std::clamp(result["compressible"].as<double>(), 0.0, 1.0);
+    tree.seed_         = result["seed"].as<uint32_t>();
+
+    auto files          = planTree(tree);
+    uint64_t totalBytes = 0;
+    for (auto &f : files)
+    {
+        totalBytes += f.size_;
+    }
+
+    Metrics metrics;
+    printVerbose("trie: ", files.size(), " keys");
+    benchTrie(files, metrics);
+
+    bool ok = true;
+    if (!result["trie_only"].as<bool>())
+    {
+#if _WIN32
+        std::cerr << "end-to-end benchmarks are not supported on Windows" << std::endl;
+#else
+        FilePath workDir{result["work_dir"].as<std::string>()};
+        workDir       = std::filesystem::absolute(workDir);
+        auto treeRoot = workDir / "tree" / "bench_root";
+        printVerbose("generate tree: ", treeRoot, " (", files.size(), " files, ", totalBytes,
+                     " bytes)");
+        auto start = Clock::now();
+        if (!generateTree(treeRoot, files, tree.seed_))
+        {
+            return 1;
+        }
+        metrics["tree.generate_ms"] = elapsedMs(start);
+
+        E2ESpec e2e;
+        e2e.fsrv_         = std::filesystem::absolute(result["fsrv"].as<std::string>()).string();
+        e2e.fcli_         = std::filesystem::absolute(result["fcli"].as<std::string>()).string();
+        e2e.port_         = result["port"].as<int>();
+        e2e.jobs_         = std::max(result["jobs"].as<int>(), 1);
+        e2e.listRequests_ = std::max(result["list_requests"].as<int>(), 1);
+        e2e.rawRequests_  = std::max(result["raw_requests"].as<int>(), 1);
+
+        // 生のGETの転送速度用の大きなファイル
+        uint64_t largeBytes = result["large_size"].as<size_t>() * 1024 * 1024;
+        auto largeRoot      = workDir / "large" / "bench_large";
+        if (largeBytes > 0 &&
+            !generateTree(largeRoot, {{"large.bin", static_cast<size_t>(largeBytes), false}},
+                          tree.seed_))
+        {
+            return 1;
+        }
+
+        // ページキャッシュから直接送るか、マウントポイントか、圧縮するか
+        const ServerConfig configs[] = {
+            {"mmap", "mmap", false},
+            {"mount", "mount", false},
+            {"mmap_compress", "mmap", true},
+        };
+        for (auto &config : configs)
+        {
+            ok = benchServer(e2e, config, workDir, treeRoot, files.size(), totalBytes, metrics) &&
+                 ok;
+            if (largeBytes > 0)
+            {
+                ok = benchThroughput(e2e, config, largeRoot, largeBytes, metrics) && ok;
+            }
+        }
+#endif
+    }
+
+    // 結果
+    nlohmann::json spec;
+    spec["Files"]        = tree.files_;
+    spec["Depth"]        = tree.depth_;
+    spec["Fanout"]       = tree.fanout_;
+    spec["MinSize"]      = tree.minSize_;
+    spec["MaxSize"]      = tree.maxSize_;
+    spec["Compressible"] = tree.compressible_;
+    spec["Seed"]         = tree.seed_;
+    spec["TotalBytes"]   = totalBytes;
+    nlohmann::json out;
+    out["spec"]    = spec;
+    out["metrics"] = metrics;
+    if (result.count("output"))
+    {
+        std::ofstream outFile{result["output"].as<std::string>()};
+        outFile << out.dump(2) << std::endl;
+    }
+    else
+    {
+        std::cout << out.dump(2) << std::endl;
+    }
+
+    if (result.count("baseline"))
+    {
+        std::ifstream inFile{result["baseline"].as<std::string>()};
+        auto baseline = nlohmann::json::parse(inFile, nullptr, false);
+        if (baseline.is_discarded() ||
+            !compareBaseline(metrics, baseline, result["tolerance"].as<double>()))
+        {
+            return 1;
+        }
+    }
+    return ok ? 0 : 1;
+}
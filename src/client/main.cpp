@@ -2,20 +2,54 @@
 // Copyright 2023 Suzuki Yoshinori(wave.suzuki.z@gmail.com)
 //
 #include "nlohmann/json_fwd.hpp"
+#include <algorithm>
+#include <atomic>
+#include <batchcodec.h>
+#include <blocksum.h>
+#include <compression.h>
+#include <condition_variable>
+#include <contenthash.h>
+#include <cstdlib>
+#include <cstring>
 #include <cxxopts.hpp>
+#include <deque>
 #include <exception>
+#include <fcntl.h>
 #include <filesystem>
 #include <fstream>
+#include <functional>
 #include <httplib.h>
 #include <iostream>
 #include <leveldb/db.h>
+#include <leveldb/write_batch.h>
 #include <list>
+#include <listcodec.h>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <nlohmann/json.hpp>
+#include <openssl/ssl.h>
+#include <optional>
+#include <sstream>
 #include <string>
+#include <string_view>
 #include <sys/_types/_int64_t.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <thread>
 #include <trie.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+#if __linux__
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#if FSRV_IO_URING
+#include <liburing.h>
+#endif
+#elif __APPLE__
+#include <sys/clonefile.h>
+#endif
 
 namespace
 {
@@ -40,6 +74,14 @@ template <class Msg, class... Args> void printVerbose(Msg msg, Args... args)
     }
 }
 
+// 複数スレッドから行単位で表示
+template <class... Args> void printMessage(Args... args)
+{
+    std::ostringstream line;
+    (line << ... << args) << '\n';
+    std::cout << line.str() << std::flush;
+}
+
 //
 // levelDB
 //
@@ -98,6 +140,67 @@ class LevelDB
 
         auto s = db->Get(leveldb::ReadOptions(), key, &value);
         if (!s.ok())
+        {
+            if (!s.IsNotFound())
+            {
+                std::cerr << s.ToString() << std::endl;
+            }
+            return false;
+        }
+        return true;
+    }
+
+    //
+    bool remove(std::string key)
+    {
+        if (db == nullptr)
+        {
+            return false;
+        }
+
+        auto s = db->Delete(leveldb::WriteOptions(), key);
+        if (!s.ok())
+        {
+            std::cerr << s.ToString() << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    // まとめて書き込む
+    bool write(leveldb::WriteBatch &batch)
+    {
+        if (db == nullptr)
+        {
+            return false;
+        }
+
+        auto s = db->Write(leveldb::WriteOptions(), &batch);
+        if (!s.ok())
+        {
+            std::cerr << s.ToString() << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    // prefixで始まるキーを順にcallback(key, value)に渡す
+    template <class Callback> bool scan(const std::string &prefix, Callback &&callback)
+    {
+        if (db == nullptr)
+        {
+            return false;
+        }
+
+        leveldb::ReadOptions options{};
+        options.fill_cache = false; // 一度しか読まないのでキャッシュを荒らさない
+        std::unique_ptr<leveldb::Iterator> it{db->NewIterator(options)};
+        for (it->Seek(prefix); it->Valid() && it->key().starts_with(prefix); it->Next())
+        {
+            callback(it->key().ToString(), it->value());
+        }
+        auto s = it->status();
+        if (!s.ok())
         {
             std::cerr << s.ToString() << std::endl;
             return false;
@@ -107,42 +210,281 @@ class LevelDB
 };
 
 //
+// 接続
+// httplib::Clientは同時に1つのリクエストしか扱えないので、プールから借りて使い終わったら返す
+// 返された接続はkeep-aliveのまま次に使う
+// TLSのセッションはデータベースに保存して、次の起動でも再開(resumption)しハンドシェイクを省く
 //
-//
+const std::string TlsSessionKeyPrefix = "@tls-session:";
 
-// ファイル名が示すディレクトリがなければ作成する
-void checkAndMakeDir(const FilePath &fname)
+// 接続先
+struct ConnectOptions
 {
-    auto parentPath = fname.parent_path();
-    if (!std::filesystem::exists(parentPath))
+    std::string url_;            // https://で始まればTLS
+    int port_    = DEFAULT_PORT; // urlにポートがなければ使う
+    bool verify_ = true;         // サーバー証明書を検証する
+    std::string caCert_;         // 検証に使うCA証明書(空ならシステムのもの)
+
+    bool tls() const { return url_.rfind("https://", 0) == 0; }
+
+    // スキームとポートを付けた接続先
+    std::string hostUrl() const
     {
-        // ディレクトリも作る
-        printVerbose("create directory: ", parentPath, "(", fname, ")");
-        std::filesystem::create_directories(parentPath);
+        auto scheme = url_.find("://");
+        auto host   = scheme == std::string::npos ? url_ : url_.substr(scheme + 3);
+        auto result = scheme == std::string::npos ? "http://" + url_ : url_;
+        if (host.find(':') == std::string::npos)
+        {
+            result += ":" + std::to_string(port_);
+        }
+        return result;
+    }
+};
+
+// 接続の統計
+struct ConnectionMetrics
+{
+    std::atomic<size_t> connects_{0};          // 新しく張った接続
+    std::atomic<size_t> requests_{0};          // リクエスト数(差が使い回した分)
+    std::atomic<size_t> fullHandshakes_{0};    // TLSの完全なハンドシェイク
+    std::atomic<size_t> resumedHandshakes_{0}; // セッションを再開したハンドシェイク
+    std::atomic<int64_t> handshakeMicros_{0};  // ハンドシェイクにかかった時間の合計
+
+    //
+    void print() const
+    {
+        size_t handshakes = fullHandshakes_ + resumedHandshakes_;
+        printVerbose("connections: ", connects_.load(), ", requests: ", requests_.load());
+        if (handshakes > 0)
+        {
+            printVerbose("tls handshakes: ", handshakes, " (resumed ", resumedHandshakes_.load(),
+                         "), average ", handshakeMicros_ / static_cast<int64_t>(handshakes),
+                         " us");
+        }
+    }
+};
+ConnectionMetrics connectionMetrics;
+
+//
+// TLSセッションのキャッシュ(最後に受け取ったものを新しい接続で使う)
+//
+class TlsSessionCache
+{
+    std::mutex mutex_;
+    SSL_SESSION *session_{nullptr};
+    bool updated_{false}; // 保存していないセッションがある
+
+  public:
+    ~TlsSessionCache() { SSL_SESSION_free(session_); }
+
+    // 新しいセッションに差し替える(所有権を受け取る)
+    void store(SSL_SESSION *session)
+    {
+        std::lock_guard lock{mutex_};
+        SSL_SESSION_free(session_);
+        session_ = session;
+        updated_ = true;
+    }
+
+    // ハンドシェイクを始める接続に設定
+    void apply(SSL *ssl)
+    {
+        std::lock_guard lock{mutex_};
+        if (session_ && SSL_SESSION_is_resumable(session_))
+        {
+            SSL_set_session(ssl, session_);
+        }
+    }
+
+    // 前回のセッションを読み込む
+    void load(LevelDB *ldb, const std::string &key)
+    {
+        std::string value;
+        if (!ldb->get(key, value))
+        {
+            return;
+        }
+        auto *p = reinterpret_cast<const unsigned char *>(value.data());
+        if (auto *session = d2i_SSL_SESSION(nullptr, &p, static_cast<long>(value.size())))
+        {
+            std::lock_guard lock{mutex_};
+            SSL_SESSION_free(session_);
+            session_ = session;
+        }
+    }
+
+    // 新しいセッションを受け取っていれば保存
+    void save(LevelDB *ldb, const std::string &key)
+    {
+        std::lock_guard lock{mutex_};
+        if (!updated_ || session_ == nullptr)
+        {
+            return;
+        }
+        std::string value(static_cast<size_t>(i2d_SSL_SESSION(session_, nullptr)), '\0');
+        auto *p = reinterpret_cast<unsigned char *>(value.data());
+        if (!value.empty() && i2d_SSL_SESSION(session_, &p) > 0 && ldb->put(key, value))
+        {
+            updated_ = false;
+        }
     }
+};
+TlsSessionCache tlsSessions;
+
+// クライアントのSSL_CTXでセッションを保存、再開し、ハンドシェイクを計測する
+void attachTlsSessions(SSL_CTX *ctx)
+{
+    thread_local std::chrono::steady_clock::time_point handshakeStart;
+
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ctx,
+                            [](SSL *, SSL_SESSION *session)
+                            {
+                                tlsSessions.store(session);
+                                return 1;
+                            });
+    // ClientHelloを作る前に呼ばれるので、ここでセッションを設定する
+    SSL_CTX_set_info_callback(
+        ctx,
+        [](const SSL *ssl, int where, int /*ret*/)
+        {
+            using namespace std::chrono;
+            if (where & SSL_CB_HANDSHAKE_START)
+            {
+                handshakeStart = steady_clock::now();
+                tlsSessions.apply(const_cast<SSL *>(ssl));
+            }
+            else if (where & SSL_CB_HANDSHAKE_DONE)
+            {
+                auto elapsed = duration_cast<microseconds>(steady_clock::now() - handshakeStart);
+                connectionMetrics.handshakeMicros_ += elapsed.count();
+                if (SSL_session_reused(const_cast<SSL *>(ssl)))
+                {
+                    connectionMetrics.resumedHandshakes_++;
+                }
+                else
+                {
+                    connectionMetrics.fullHandshakes_++;
+                }
+            }
+        });
 }
 
-// ファイル更新チェック
-bool checkUpdateFile(LevelDB *ldb, const FilePath &fname, size_t fsize, int64_t ftime)
+//
+// 接続プール
+//
+class ClientPool
 {
-    std::string infoJsonStr;
-    if (ldb->get(fname.string(), infoJsonStr))
+    ConnectOptions conn_;
+    LevelDB *ldb_; // TLSのセッションの保存先(nullptrなら保存しない)
+    std::string sessionKey_;
+    std::mutex mutex_;
+    std::vector<std::unique_ptr<httplib::Client>> idle_;
+
+    //
+    std::unique_ptr<httplib::Client> create()
     {
-        nlohmann::json infoJson = nlohmann::json::parse(infoJsonStr);
-        auto localSize          = infoJson["Size"].get<size_t>();
-        auto localTime          = infoJson["Time"].get<int64_t>();
-        if (localSize == fsize && localTime == ftime)
+        auto cli = std::make_unique<httplib::Client>(conn_.hostUrl());
+        cli->set_keep_alive(true);
+        cli->set_socket_options([](httplib::socket_t) { connectionMetrics.connects_++; });
+        cli->set_logger([](const httplib::Request &, const httplib::Response &)
+                        { connectionMetrics.requests_++; });
+        if (conn_.tls())
         {
-            printVerbose("no update: ", fname);
-            return false;
+            cli->enable_server_certificate_verification(conn_.verify_);
+            if (!conn_.caCert_.empty())
+            {
+                cli->set_ca_cert_path(conn_.caCert_);
+            }
+            if (auto *ctx = cli->ssl_context())
+            {
+                attachTlsSessions(ctx);
+            }
         }
+        return cli;
     }
-    else
+
+    //
+    void release(std::unique_ptr<httplib::Client> cli)
     {
-        printVerbose("not found in database: ", fname);
+        std::lock_guard lock{mutex_};
+        idle_.push_back(std::move(cli));
     }
 
-    return true;
+  public:
+    // 借りた接続(破棄すると返す)
+    class Lease
+    {
+        ClientPool *pool_;
+        std::unique_ptr<httplib::Client> cli_;
+
+      public:
+        Lease(ClientPool *pool, std::unique_ptr<httplib::Client> cli)
+            : pool_(pool), cli_(std::move(cli))
+        {
+        }
+        Lease(Lease &&)            = default;
+        Lease &operator=(Lease &&) = delete;
+        ~Lease()
+        {
+            if (cli_)
+            {
+                pool_->release(std::move(cli_));
+            }
+        }
+        httplib::Client &operator*() { return *cli_; }
+        httplib::Client *operator->() { return cli_.get(); }
+    };
+
+    ClientPool(ConnectOptions conn, LevelDB *ldb) : conn_(std::move(conn)), ldb_(ldb)
+    {
+        sessionKey_ = TlsSessionKeyPrefix + conn_.hostUrl();
+        if (ldb_ && conn_.tls())
+        {
+            tlsSessions.load(ldb_, sessionKey_);
+        }
+    }
+    ~ClientPool()
+    {
+        if (ldb_ && conn_.tls())
+        {
+            tlsSessions.save(ldb_, sessionKey_);
+        }
+        connectionMetrics.print();
+    }
+    ClientPool(const ClientPool &)            = delete;
+    ClientPool &operator=(const ClientPool &) = delete;
+
+    // 空いている接続を借りる(なければ作る)
+    Lease acquire()
+    {
+        std::unique_ptr<httplib::Client> cli;
+        {
+            std::lock_guard lock{mutex_};
+            if (!idle_.empty())
+            {
+                cli = std::move(idle_.back());
+                idle_.pop_back();
+            }
+        }
+        return {this, cli ? std::move(cli) : create()};
+    }
+};
+
+//
+//
+//
+
+// ファイル名が示すディレクトリがなければ作成する
+void checkAndMakeDir(const FilePath &fname)
+{
+    auto parentPath = fname.parent_path();
+    if (!std::filesystem::exists(parentPath))
+    {
+        // ディレクトリも作る
+        printVerbose("create directory: ", parentPath, "(", fname, ")");
+        std::filesystem::create_directories(parentPath);
+    }
 }
 
 //
@@ -171,11 +513,13 @@ void dumpDir(nlohmann::json dir, std::string tab, FilePath allPath)
 }
 
 //
-void getDirectory(std::string url, int port, std::string pattern)
+void getDirectory(const ConnectOptions &conn, std::string pattern)
 {
-    httplib::Client cli(url, port);
+    LevelDB ldb; // TLSのセッションの保存先
+    ClientPool pool{conn, conn.tls() && ldb.open() ? &ldb : nullptr};
+    auto cli = pool.acquire();
 
-    if (auto res = cli.Get("/dir"))
+    if (auto res = cli->Get("/dir"))
     {
         if (res->status == 200)
         {
@@ -193,148 +537,2263 @@ void getDirectory(std::string url, int port, std::string pattern)
 //
 // ファイルリスト
 //
-void getFileList(std::string url, int port, std::string pattern)
-{
-    httplib::Client cli(url, port);
 
-    httplib::Params params{{"prefix", pattern}};
-    if (auto res = cli.Get("/list", params, {}))
-    {
-        if (res->status == 200)
-        {
-            nlohmann::json fileList = nlohmann::json::parse(res->body);
-            for (auto &file : fileList["Files"].items())
-            {
-                auto value = file.value();
-                std::cout << value["Path"].get<std::string>()
-                          << "(size=" << value["Size"].get<size_t>() << ")" << std::endl;
-            }
-        }
-    }
-    else
+// 圧縮して受け取る(展開はこちらで行うのでクライアントにはset_decompress(false)を指定する)
+const httplib::Headers AcceptCompressed{{"Accept-Encoding", "zstd, gzip"}};
+
+// 応答のContent-Encodingに合った展開器(知らない方式ならnullptr)
+std::unique_ptr<Decompressor> makeDecompressor(const httplib::Response &response)
+{
+    bool ok;
+    auto enc = parseEncoding(response.get_header_value("Content-Encoding"), ok);
+    if (!ok)
     {
-        auto err = res.error();
-        std::cout << "HTTP error: " << httplib::to_string(err) << std::endl;
+        std::cerr << "unsupported encoding: " << response.get_header_value("Content-Encoding")
+                  << std::endl;
+        return nullptr;
     }
+    return std::make_unique<Decompressor>(enc);
 }
 
-//
-// ファイル同期
-//
-void syncFiles(std::string url, int port, std::string pattern)
+// リストの世代
+struct ListStamp
 {
-    httplib::Client cli(url, port);
+    std::string epoch_;
+    uint64_t generation_{0};
+};
 
-    httplib::Params params{{"prefix", pattern}, {"update", "true"}};
-    if (auto res = cli.Get("/list", params, {}))
-    {
-        if (res->status == 200)
+// リスト取得(バイナリ形式なら届いた順に、JSONなら全体を受け取ってからcallbackを呼ぶ)
+bool fetchFileList(httplib::Client &cli, httplib::Params params,
+                   const std::function<void(const ListEntry &)> &callback,
+                   ListStamp *stamp = nullptr)
+{
+    params.emplace("format", "bin");
+    int status  = 0;
+    bool binary = false;
+    std::string jsonBody;
+    ListDecoder decoder;
+    std::unique_ptr<Decompressor> decomp;
+    cli.set_decompress(false);
+    auto res = cli.Get(
+        "/list", params, AcceptCompressed,
+        [&](const httplib::Response &response)
         {
-            auto ldb = std::make_unique<LevelDB>();
-            if (!ldb->open())
+            status = response.status;
+            binary = response.get_header_value("Content-Type") == ListContentType;
+            decomp = makeDecompressor(response);
+            if (!decomp)
             {
-                return;
+                return false;
             }
-
-            nlohmann::json fileList = nlohmann::json::parse(res->body);
-            for (auto &file : fileList["Files"].items())
+            if (stamp)
             {
-                auto value     = file.value();
-                FilePath fname = value["Path"].get<std::string>();
-                auto fsize     = value["Size"].get<size_t>();
-                auto ftime     = value["Time"].get<int64_t>();
-                auto fdel      = value["Delete"].get<bool>();
-
-                printVerbose(fname, ":size=", fsize, ",time=", ftime, (fdel ? "[DELETED]" : ""));
-                bool needUpdate = false;
-                bool fileExists = std::filesystem::exists(fname);
-                if (fdel)
-                {
-                    if (fileExists)
-                    {
-                        // ファイルは消されているのでこちらも消去
-                        std::cout << "remove file: " << fname << std::endl;
-                        std::filesystem::remove(fname);
-                    }
-                }
-                else if (fileExists)
-                {
-                    // ファイルが存在するなら更新されたか確認する
-                    needUpdate = checkUpdateFile(ldb.get(), fname, fsize, ftime);
-                }
-                else
-                {
-                    // ない
-                    needUpdate = true;
-                    checkAndMakeDir(fname);
-                    printVerbose("  -> not exists(need update)");
-                }
-                //
-                if (needUpdate)
-                {
-                    // ファイル更新
-                    const FilePath pathPrefix{"/files"};
-                    auto downloadPath = (pathPrefix / fname).lexically_normal();
-                    std::cout << "DOWNLOAD: " << downloadPath << " -> " << fname << std::endl;
-                    std::ofstream outFile{fname, std::ios::binary};
-                    auto r = cli.Get(
-                        downloadPath.string(), httplib::Headers(),
-                        [&](const httplib::Response &response)
-                        {
-                            printVerbose(" response: ", response.status);
-                            return true;
-                        },
-                        [&](const char *data, size_t data_length)
-                        {
-                            outFile.write(data, data_length);
-                            return true;
-                        },
-                        [&](uint64_t current, uint64_t total)
-                        {
-                            std::cout << current << "/" << total << '\r';
-                            return true;
-                        });
-                    outFile.close();
-                    if (r->status == 200)
-                    {
-                        std::cout << "Download size: " << fsize << " ===> done." << std::endl;
-                    }
-                    else
-                    {
-                        std::filesystem::remove(fname);
-                    }
-                }
-                ldb->put(fname.string(), value.dump());
+                stamp->epoch_      = response.get_header_value("X-Fsrv-Epoch");
+                stamp->generation_ = std::strtoull(
+                    response.get_header_value("X-Fsrv-Generation").c_str(), nullptr, 10);
             }
-        }
-    }
-    else
+            return true;
+        },
+        [&](const char *data, size_t data_length)
+        {
+            if (status != 200)
+            {
+                return true;
+            }
+            return decomp->decompress(data, data_length,
+                                      [&](const char *p, size_t len)
+                                      {
+                                          if (binary)
+                                          {
+                                              return decoder.feed(p, len, callback);
+                                          }
+                                          jsonBody.append(p, len);
+                                          return true;
+                                      });
+        });
+    if (!res)
     {
         auto err = res.error();
         std::cout << "HTTP error: " << httplib::to_string(err) << std::endl;
+        return false;
+    }
+    if (res->status != 200)
+    {
+        std::cout << "HTTP status: " << res->status << std::endl;
+        return false;
+    }
+    if (binary)
+    {
+        if (!decoder.finished())
+        {
+            std::cerr << "file list truncated" << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    // JSON形式(古いサーバー)
+    nlohmann::json fileList = nlohmann::json::parse(jsonBody);
+    for (auto &file : fileList["Files"].items())
+    {
+        auto value = file.value();
+        ListEntry entry;
+        entry.path_   = value["Path"].get<std::string>();
+        entry.size_   = value["Size"].get<size_t>();
+        entry.time_   = value["Time"].get<int64_t>();
+        entry.delete_ = value["Delete"].get<bool>();
+        if (value.contains("Hash"))
+        {
+            entry.hash_ = value["Hash"].get<std::string>();
+        }
+        if (value.contains("Sha256"))
+        {
+            entry.sha256_ = value["Sha256"].get<std::string>();
+        }
+        callback(entry);
     }
+    return true;
 }
 
-} // namespace
+//
+void getFileList(const ConnectOptions &conn, std::string pattern)
+{
+    LevelDB ldb; // TLSのセッションの保存先
+    ClientPool pool{conn, conn.tls() && ldb.open() ? &ldb : nullptr};
+    auto cli = pool.acquire();
+
+    httplib::Params params{{"prefix", pattern}};
+    fetchFileList(*cli, params,
+                  [](const ListEntry &entry)
+                  { std::cout << entry.path_ << "(size=" << entry.size_ << ")" << std::endl; });
+}
+
+// 同期済みの世代のキー
+const std::string GenerationKeyPrefix = "@generation:";
 
 //
+// データベースに記録するエントリ
 //
+// [形式のバージョン][varint サイズ][varint 更新時刻(zigzag)][varint フラグ][ハッシュ]
+// [varint 手元の更新時刻(zigzag、記録したときにファイルがあれば)]
+// フラグとハッシュはファイルリストのバイナリ形式と同じ、パスはキーなので持たない
+// 更新時刻はサーバーのもの、手元の更新時刻はpushで手元の変更を見つけるのに使う
 //
-int main(int argc, char **argv)
+constexpr char RecordVersion = 1;
+
+//
+std::string makeRecord(const ListEntry &entry)
 {
-    cxxopts::Options options(argv[0], "file synchronize server");
+    std::string record;
+    record += RecordVersion;
+    putVarint(record, entry.size_);
+    putVarint(record, zigzagEncode(entry.time_));
+    auto flags = (entry.delete_ ? ListFlagDelete : 0) | digestFlags(entry.hash_, entry.sha256_);
+    putVarint(record, flags);
+    putDigests(record, flags, entry.hash_, entry.sha256_);
+    return record;
+}
 
-    options.add_options()("h,help", "Print usage")(
-        // verbose
-        "v,verbose", "verbose mode", cxxopts::value<bool>()->default_value("false"))(
-        // port
-        "p,port", "port number", cxxopts::value<int>())(
-        // file directory
-        "url", "target url", cxxopts::value<std::string>()->default_value("localhost"))(
-        // command
-        "command", "command [dir,files,sync]", cxxopts::value<std::string>()->default_value("dir"))(
-        // match pattern
-        "pattern", "matching pattern", cxxopts::value<std::string>()->default_value(""));
+// 手元のファイルの更新時刻(この環境でのみ比べるので単位はそのまま、なければ0)
+int64_t localFileTime(const FilePath &fname)
+{
+    std::error_code ec;
+    auto mtime = std::filesystem::last_write_time(fname, ec);
+    return ec ? 0 : static_cast<int64_t>(mtime.time_since_epoch().count());
+}
+
+// 記録を読む(以前のJSON形式も読める、path_は埋めない、手元の更新時刻がなければlocalTimeは空)
+bool parseRecord(std::string_view record, ListEntry &entry,
+                 std::optional<int64_t> *localTime = nullptr)
+{
+    if (localTime)
+    {
+        localTime->reset();
+    }
+    if (!record.empty() && record.front() == '{')
+    {
+        auto value = nlohmann::json::parse(record, nullptr, false);
+        if (!value.is_object() || !value.contains("Size") || !value.contains("Time"))
+        {
+            return false;
+        }
+        entry.size_   = value["Size"].get<uint64_t>();
+        entry.time_   = value["Time"].get<int64_t>();
+        entry.delete_ = value.value("Delete", false);
+        entry.hash_   = value.value("Hash", "");
+        entry.sha256_ = value.value("Sha256", "");
+        return true;
+    }
+
+    const char *p   = record.data();
+    const char *end = p + record.size();
+    uint64_t time, flags;
+    if (p == end || *p++ != RecordVersion || !getVarint(p, end, entry.size_) ||
+        !getVarint(p, end, time) || !getVarint(p, end, flags) ||
+        !getDigests(p, end, flags, entry.hash_, entry.sha256_))
+    {
+        return false;
+    }
+    entry.time_   = zigzagDecode(time);
+    entry.delete_ = (flags & ListFlagDelete) != 0;
+    uint64_t mtime;
+    if (localTime && getVarint(p, end, mtime))
+    {
+        *localTime = zigzagDecode(mtime);
+    }
+    return true;
+}
+
+// 手元の更新時刻を追加(すでにあるもの、以前のJSON形式はそのまま)
+std::string withLocalTime(std::string record, const FilePath &fname)
+{
+    ListEntry entry;
+    std::optional<int64_t> localTime;
+    if (!record.empty() && record.front() == RecordVersion &&
+        parseRecord(record, entry, &localTime) && !localTime)
+    {
+        putVarint(record, zigzagEncode(localFileTime(fname)));
+    }
+    return record;
+}
+
+// 同期前に読み込んだ記録
+struct StoredRecord
+{
+    ListEntry remote_;     // 最後に見たサーバーの状態
+    int64_t localTime_{0}; // そのときの手元の更新時刻(不明なら0)
+};
+using RecordMap = std::unordered_map<std::string, StoredRecord>; // パス -> 記録
+
+// ファイル更新チェック(双方にハッシュがあれば中身で比べる)
+bool checkUpdateFile(const RecordMap &records, const FilePath &fname, const ListEntry &entry)
+{
+    auto it = records.find(fname.string());
+    if (it == records.end())
+    {
+        printVerbose("not found in database: ", fname);
+        return true;
+    }
+
+    auto &local = it->second.remote_;
+    for (auto [mine, remote] :
+         {std::pair{&local.sha256_, &entry.sha256_}, {&local.hash_, &entry.hash_}})
+    {
+        if (remote->empty() || mine->empty())
+        {
+            continue;
+        }
+        if (*mine == *remote)
+        {
+            printVerbose("same content: ", fname);
+            return false;
+        }
+        printVerbose("content changed: ", fname);
+        return true;
+    }
+    if (local.size_ == entry.size_ && local.time_ == entry.time_)
+    {
+        printVerbose("no update: ", fname);
+        return false;
+    }
+    return true;
+}
+
+//
+// 作業キュー(上限付き)
+//
+template <class Task> class WorkQueue
+{
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::deque<Task> queue_;
+    size_t limit_;
+    bool closed_ = false;
+
+  public:
+    explicit WorkQueue(size_t limit) : limit_(limit) {}
+
+    // 追加(いっぱいなら空くまで待つ)
+    void push(Task task)
+    {
+        std::unique_lock lock{mutex_};
+        cond_.wait(lock, [&] { return queue_.size() < limit_; });
+        queue_.push_back(std::move(task));
+        cond_.notify_all();
+    }
+
+    // 取り出し(閉じられていて空ならfalse)
+    bool pop(Task &task)
+    {
+        std::unique_lock lock{mutex_};
+        cond_.wait(lock, [&] { return closed_ || !queue_.empty(); });
+        if (queue_.empty())
+        {
+            return false;
+        }
+        task = std::move(queue_.front());
+        queue_.pop_front();
+        cond_.notify_all();
+        return true;
+    }
+
+    // 取り出し(空なら待たずにfalse)
+    bool tryPop(Task &task)
+    {
+        std::lock_guard lock{mutex_};
+        if (queue_.empty())
+        {
+            return false;
+        }
+        task = std::move(queue_.front());
+        queue_.pop_front();
+        cond_.notify_all();
+        return true;
+    }
+
+    // これ以上追加しない
+    void close()
+    {
+        std::lock_guard lock{mutex_};
+        closed_ = true;
+        cond_.notify_all();
+    }
+};
+
+//
+// ディスク書き込みステージ
+// 受信側は決まった数の整列したバッファに詰めて渡すだけにして、書き込みは専用のスレッドで行う
+// (FSRV_IO_URINGならio_uringでまとめて発行する)。バッファが尽きると受信側が待つので、
+// メモリを増やさずに受信と書き込みが重なる
+//
+constexpr size_t WriteBufferSize  = 1024 * 1024;
+constexpr size_t WriteBufferAlign = 4096;
+#if FSRV_IO_URING
+constexpr unsigned UringQueueDepth = 64;
+#endif
+
+// 書き込み先のファイル(書き込み中の数と失敗を数える)
+class WriteTarget
+{
+    int fd_;
+    bool closeFd_;
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    size_t pending_{0};
+    std::atomic<bool> failed_{false};
+
+  public:
+    WriteTarget(int fd, bool closeFd) : fd_(fd), closeFd_(closeFd) {}
+    ~WriteTarget()
+    {
+        if (closeFd_)
+        {
+            ::close(fd_);
+        }
+    }
+
+    int fd() const { return fd_; }
+    bool failed() const { return failed_; }
+
+    //
+    void begin()
+    {
+        std::lock_guard lock{mutex_};
+        pending_++;
+    }
+    void complete(bool ok)
+    {
+        std::lock_guard lock{mutex_};
+        if (!ok)
+        {
+            failed_ = true;
+        }
+        pending_--;
+        cond_.notify_all();
+    }
+
+    // 発行した分が全部書き終わるまで待つ
+    bool wait()
+    {
+        std::unique_lock lock{mutex_};
+        cond_.wait(lock, [&] { return pending_ == 0; });
+        return !failed_;
+    }
+};
+using WriteTargetPtr = std::shared_ptr<WriteTarget>;
+
+//
+class DiskWriter
+{
+  public:
+    struct Request
+    {
+        WriteTargetPtr target_;
+        char *buffer_;
+        size_t length_;
+        off_t offset_;
+    };
+
+  private:
+    std::mutex mutex_; // バッファの排他
+    std::condition_variable cond_;
+    std::vector<char *> buffers_;
+    std::vector<char *> free_;
+
+    std::unique_ptr<WorkQueue<Request>> queue_;
+    std::vector<std::thread> threads_;
+
+    //
+    void release(char *buffer)
+    {
+        std::lock_guard lock{mutex_};
+        free_.push_back(buffer);
+        cond_.notify_one();
+    }
+
+    // 同期で書く(途中までしか書けなかった残りもここで書く)
+    static bool writeAll(int fd, const char *data, size_t length, off_t offset)
+    {
+        while (length > 0)
+        {
+            auto w = ::pwrite(fd, data, length, offset);
+            if (w <= 0)
+            {
+                return false;
+            }
+            data += w;
+            length -= w;
+            offset += w;
+        }
+        return true;
+    }
+
+    //
+    void finish(Request &req, bool ok)
+    {
+        release(req.buffer_);
+        req.target_->complete(ok);
+    }
+
+    // スレッドプール版
+    void run()
+    {
+        Request req;
+        while (queue_->pop(req))
+        {
+            bool ok = writeAll(req.target_->fd(), req.buffer_, req.length_, req.offset_);
+            finish(req, ok);
+        }
+    }
+
+#if FSRV_IO_URING
+    // io_uring版(初期化できなければfalseでスレッドプール版に任せる)
+    bool runUring()
+    {
+        io_uring ring;
+        if (io_uring_queue_init(UringQueueDepth, &ring, 0) < 0)
+        {
+            return false;
+        }
+        unsigned inflight = 0;
+        bool closed       = false;
+        while (!closed)
+        {
+            // 空きがあるだけ発行(何も書いていなければ来るまで待つ)
+            while (inflight < UringQueueDepth)
+            {
+                Request req;
+                if (inflight == 0 ? !queue_->pop(req) : !queue_->tryPop(req))
+                {
+                    closed = inflight == 0;
+                    break;
+                }
+                auto *sqe = io_uring_get_sqe(&ring);
+                io_uring_prep_write(sqe, req.target_->fd(), req.buffer_, req.length_, req.offset_);
+                io_uring_sqe_set_data(sqe, new Request{std::move(req)});
+                inflight++;
+            }
+            if (inflight == 0)
+            {
+                continue;
+            }
+            io_uring_submit(&ring);
+
+            // 少なくとも1つは完了を待つ
+            io_uring_cqe *cqe;
+            if (io_uring_wait_cqe(&ring, &cqe) < 0)
+            {
+                continue;
+            }
+            do
+            {
+                std::unique_ptr<Request> done{static_cast<Request *>(io_uring_cqe_get_data(cqe))};
+                auto res = cqe->res;
+                io_uring_cqe_seen(&ring, cqe);
+                inflight--;
+                bool ok = res >= 0;
+                if (ok && static_cast<size_t>(res) < done->length_)
+                {
+                    ok = writeAll(done->target_->fd(), done->buffer_ + res, done->length_ - res,
+                                  done->offset_ + res);
+                }
+                finish(*done, ok);
+            } while (io_uring_peek_cqe(&ring, &cqe) == 0);
+        }
+        io_uring_queue_exit(&ring);
+        return true;
+    }
+#endif
+
+  public:
+    ~DiskWriter() { stop(); }
+
+    // バッファ数と書き込みスレッド数(io_uringなら発行するスレッド数)
+    void start(size_t bufferCount, int threads)
+    {
+        for (size_t i = 0; i < bufferCount; i++)
+        {
+            auto *buffer =
+                static_cast<char *>(std::aligned_alloc(WriteBufferAlign, WriteBufferSize));
+            buffers_.push_back(buffer);
+            free_.push_back(buffer);
+        }
+        queue_ = std::make_unique<WorkQueue<Request>>(bufferCount);
+        for (int i = 0; i < threads; i++)
+        {
+#if FSRV_IO_URING
+            threads_.emplace_back(
+                [this]
+                {
+                    if (!runUring())
+                    {
+                        run();
+                    }
+                });
+#else
+            threads_.emplace_back([this] { run(); });
+#endif
+        }
+    }
+
+    // 書き終わるのを待って止める
+    void stop()
+    {
+        if (!queue_)
+        {
+            return;
+        }
+        queue_->close();
+        for (auto &t : threads_)
+        {
+            t.join();
+        }
+        threads_.clear();
+        queue_.reset();
+        for (auto *buffer : buffers_)
+        {
+            std::free(buffer);
+        }
+        buffers_.clear();
+        free_.clear();
+    }
+
+    // 空いているバッファ(なければ空くまで待つ)
+    char *acquire()
+    {
+        std::unique_lock lock{mutex_};
+        cond_.wait(lock, [&] { return !free_.empty(); });
+        auto *buffer = free_.back();
+        free_.pop_back();
+        return buffer;
+    }
+
+    // 書き込みを依頼(バッファは書き終わったら戻る)
+    void submit(Request req)
+    {
+        req.target_->begin();
+        queue_->push(std::move(req));
+    }
+};
+DiskWriter diskWriter;
+
+//
+// 受信したデータを順に書き込みステージに渡す
+//
+class AsyncFileWriter
+{
+    WriteTargetPtr target_;
+    char *buffer_{nullptr};
+    size_t filled_{0};
+    off_t offset_;
+
+    //
+    void flush()
+    {
+        if (buffer_)
+        {
+            diskWriter.submit({target_, buffer_, filled_, offset_});
+            offset_ += filled_;
+            buffer_ = nullptr;
+            filled_ = 0;
+        }
+    }
+
+  public:
+    // fdのoffsetから書く(closeFdなら書き終わったら閉じる)
+    AsyncFileWriter(int fd, off_t offset, bool closeFd)
+        : target_(std::make_shared<WriteTarget>(fd, closeFd)), offset_(offset)
+    {
+    }
+    ~AsyncFileWriter() { finish(); }
+    AsyncFileWriter(const AsyncFileWriter &)            = delete;
+    AsyncFileWriter &operator=(const AsyncFileWriter &) = delete;
+
+    // 先に失敗していればfalse
+    bool write(const char *data, size_t length)
+    {
+        while (length > 0)
+        {
+            if (target_->failed())
+            {
+                return false;
+            }
+            if (!buffer_)
+            {
+                buffer_ = diskWriter.acquire();
+            }
+            auto n = std::min(length, WriteBufferSize - filled_);
+            std::memcpy(buffer_ + filled_, data, n);
+            filled_ += n;
+            data += n;
+            length -= n;
+            if (filled_ == WriteBufferSize)
+            {
+                flush();
+            }
+        }
+        return true;
+    }
+
+    // 残りを書いて全部終わるまで待つ
+    bool finish()
+    {
+        flush();
+        return target_->wait();
+    }
+};
+
+//
+// 書き込みの永続化
+// ファイルは同じディレクトリの一時ファイルに書いてrenameで置き換える(途中で失敗しても元のファイルは残る)
+// fsyncはレベルに応じて、none: しない、batch: まとめて、full: ファイル毎
+// batchではrenameもまとめて行う時まで遅らせ、一時ファイルをまとめて永続化してから置き換え、
+// 最後にディレクトリ毎に1回fsyncする(落ちても元のファイルか新しいファイルが残る)
+// それが済むまでデータベースに記録しないので、落ちたら次回取り直すだけになる
+//
+enum class Durability
+{
+    None,
+    Batch,
+    Full,
+};
+
+constexpr const char *TempSuffix = ".fsrv-tmp";
+
+// ダウンロード中の一時ファイル
+FilePath makeTempPath(const FilePath &fname)
+{
+    auto tmpPath = fname;
+    tmpPath += TempSuffix;
+    return tmpPath;
+}
+
+//
+class FileDurability
+{
+    Durability level_{Durability::Batch};
+    std::mutex mutex_;
+    std::vector<std::pair<FilePath, FilePath>> unsynced_; // batchで置き換え待ちの(一時, 元)
+
+    //
+    static bool syncPath(const FilePath &path, bool directory)
+    {
+        int fd = ::open(path.c_str(), (directory ? O_RDONLY | O_DIRECTORY : O_RDONLY) | O_CLOEXEC);
+        if (fd < 0)
+        {
+            return false;
+        }
+        bool ok = ::fsync(fd) == 0;
+        ::close(fd);
+        return ok;
+    }
+
+    // 親ディレクトリ(相対パスならカレント)
+    static FilePath parentDir(const FilePath &fname)
+    {
+        auto dir = fname.parent_path();
+        return dir.empty() ? FilePath{"."} : dir;
+    }
+
+    //
+    static bool rename(const FilePath &tmpPath, const FilePath &fname)
+    {
+        std::error_code ec;
+        std::filesystem::rename(tmpPath, fname, ec);
+        if (ec)
+        {
+            std::cerr << "rename failed: " << fname << " (" << ec.message() << ")" << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+  public:
+    void setLevel(Durability level) { level_ = level; }
+    Durability level() const { return level_; }
+
+    // 書き終わった一時ファイルで置き換える(batchではflush()まで置き換えない)
+    bool replace(const FilePath &tmpPath, const FilePath &fname)
+    {
+        if (level_ == Durability::Batch)
+        {
+            std::lock_guard lock{mutex_};
+            unsynced_.emplace_back(tmpPath, fname);
+            return true;
+        }
+        if (level_ == Durability::Full && !syncPath(tmpPath, false))
+        {
+            return false;
+        }
+        if (!rename(tmpPath, fname))
+        {
+            return false;
+        }
+        return level_ != Durability::Full || syncPath(parentDir(fname), true);
+    }
+
+    // batchでたまった分
+    size_t pending()
+    {
+        std::lock_guard lock{mutex_};
+        return unsynced_.size();
+    }
+
+    // batchでたまった分を永続化して置き換える
+    bool flush()
+    {
+        std::vector<std::pair<FilePath, FilePath>> files;
+        {
+            std::lock_guard lock{mutex_};
+            files.swap(unsynced_);
+        }
+        if (files.empty())
+        {
+            return true;
+        }
+        bool ok = true;
+#if __linux__
+        // 一時ファイルの中身はファイルシステム毎にsyncfsで1回
+        std::vector<dev_t> devices;
+        for (auto &[tmpPath, fname] : files)
+        {
+            struct stat st;
+            if (::stat(tmpPath.c_str(), &st) != 0)
+            {
+                ok = false;
+                continue;
+            }
+            if (std::find(devices.begin(), devices.end(), st.st_dev) != devices.end())
+            {
+                continue;
+            }
+            devices.push_back(st.st_dev);
+            int fd = ::open(tmpPath.c_str(), O_RDONLY | O_CLOEXEC);
+            ok     = fd >= 0 && ::syncfs(fd) == 0 && ok;
+            if (fd >= 0)
+            {
+                ::close(fd);
+            }
+        }
+#else
+        for (auto &[tmpPath, fname] : files)
+        {
+            ok = syncPath(tmpPath, false) && ok;
+        }
+#endif
+        if (!ok)
+        {
+            // 元のファイルは残し、置き換えは次のflush()でやり直す
+            std::lock_guard lock{mutex_};
+            unsynced_.insert(unsynced_.end(), files.begin(), files.end());
+            return false;
+        }
+
+        // 置き換えてからディレクトリ毎に1回
+        std::vector<FilePath> dirs;
+        for (auto &[tmpPath, fname] : files)
+        {
+            ok       = rename(tmpPath, fname) && ok;
+            auto dir = parentDir(fname);
+            if (std::find(dirs.begin(), dirs.end(), dir) == dirs.end())
+            {
+                dirs.push_back(dir);
+            }
+        }
+        for (auto &dir : dirs)
+        {
+            ok = syncPath(dir, true) && ok;
+        }
+        printVerbose("synced ", files.size(), " files");
+        return ok;
+    }
+};
+FileDurability fileDurability;
+
+//
+// 内容が同じファイルの再利用
+//
+const std::string ContentKeyPrefix = "@content:";
+
+// 再利用の方法
+enum class DedupMode
+{
+    None,
+    Copy,
+    Hardlink,
+    Reflink, // できなければコピー
+};
+
+// 内容のキー(SHA-256がなければXXH64とサイズ、どちらもなければ空)
+std::string makeContentKey(const std::string &hash, const std::string &sha256, size_t size)
+{
+    if (!sha256.empty())
+    {
+        return ContentKeyPrefix + "sha256:" + sha256;
+    }
+    if (!hash.empty())
+    {
+        return ContentKeyPrefix + "xxh64:" + hash + ":" + std::to_string(size);
+    }
+    return {};
+}
+
+// 記録したファイルを内容のキーで引けるようにする
+void registerContent(leveldb::WriteBatch &batch, const std::string &fname,
+                     const std::string &record)
+{
+    ListEntry entry;
+    if (!parseRecord(record, entry) || entry.delete_)
+    {
+        return;
+    }
+    auto key = makeContentKey(entry.hash_, entry.sha256_, entry.size_);
+    if (!key.empty())
+    {
+        batch.Put(key, fname);
+    }
+}
+
+// 置き換える前の記録を指している内容のキーを消す(別のファイルを指していればそのまま)
+void unregisterContent(LevelDB *ldb, leveldb::WriteBatch &batch, const std::string &fname)
+{
+    std::string record;
+    std::string owner;
+    ListEntry entry;
+    if (!ldb->get(fname, record) || !parseRecord(record, entry) || entry.delete_)
+    {
+        return;
+    }
+    auto key = makeContentKey(entry.hash_, entry.sha256_, entry.size_);
+    if (!key.empty() && ldb->get(key, owner) && owner == fname)
+    {
+        batch.Delete(key);
+    }
+}
+
+// 同じ内容で記録されている手元のファイル
+std::optional<FilePath> findSameContent(LevelDB *ldb, const ListEntry &entry, const FilePath &fname)
+{
+    std::string source;
+    auto key = makeContentKey(entry.hash_, entry.sha256_, entry.size_);
+    if (key.empty() || !ldb->get(key, source) || FilePath{source} == fname)
+    {
+        return std::nullopt;
+    }
+    std::error_code ec;
+    if (!std::filesystem::is_regular_file(source, ec) ||
+        std::filesystem::file_size(source, ec) != entry.size_ || ec)
+    {
+        return std::nullopt;
+    }
+    return FilePath{source};
+}
+
+// 手元のファイルから作る(記録後に書き換えられているかもしれないので中身を確かめる)
+bool cloneLocalFile(const FilePath &source, const FilePath &fname, DedupMode mode,
+                    const ContentHash &digest)
+{
+    ContentHash actual;
+    bool withSha256 = !digest.sha256_.empty();
+    if (!hashFile(source.string(), withSha256, actual) ||
+        (withSha256 ? actual.sha256_ != digest.sha256_ : actual.hash_ != digest.hash_))
+    {
+        return false;
+    }
+
+    // 一時ファイルに作ってから置き換える
+    auto tmpPath = fname;
+    tmpPath += ".fsrv-dedup";
+    std::error_code ec;
+    std::filesystem::remove(tmpPath, ec);
+    bool done = false;
+    if (mode == DedupMode::Hardlink)
+    {
+        std::filesystem::create_hard_link(source, tmpPath, ec);
+        done = !ec;
+    }
+    else if (mode == DedupMode::Reflink)
+    {
+#if __linux__
+        int in = ::open(source.c_str(), O_RDONLY | O_CLOEXEC);
+        if (in >= 0)
+        {
+            int out = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (out >= 0)
+            {
+                done = ::ioctl(out, FICLONE, in) == 0;
+                ::close(out);
+            }
+            ::close(in);
+        }
+#elif __APPLE__
+        done = ::clonefile(source.c_str(), tmpPath.c_str(), 0) == 0;
+#endif
+    }
+    if (!done)
+    {
+        // リンクできないファイルシステムならコピー
+        auto opts = std::filesystem::copy_options::overwrite_existing;
+        std::filesystem::copy_file(source, tmpPath, opts, ec);
+        done = !ec;
+    }
+    if (!done || !fileDurability.replace(tmpPath, fname))
+    {
+        std::filesystem::remove(tmpPath, ec);
+        return false;
+    }
+    printMessage("LOCAL: ", source, " -> ", fname);
+    return true;
+}
+
+//
+// リスト順にデータベースへ書き込む
+//
+class OrderedCommitter
+{
+  public:
+    using Record = std::optional<std::pair<std::string, std::string>>;
+
+    static constexpr size_t SyncGroupSize = 1024; // まとめて書き込む数(batchならfsyncも)
+
+  private:
+    LevelDB *ldb_;
+    std::mutex mutex_;
+    std::map<size_t, Record> pending_;
+    std::vector<std::pair<std::string, std::string>> ready_; // 順番がそろってfsync待ち
+    size_t next_     = 0;
+    size_t failures_ = 0;
+
+    // ファイルを永続化してから書き込む(mutex_を持って呼ぶ)
+    void writeReady()
+    {
+        if (fileDurability.level() == Durability::Batch && !fileDurability.flush())
+        {
+            // 記録しなければ次回取り直す
+            std::cerr << "fsync failed" << std::endl;
+            failures_ += ready_.size();
+            ready_.clear();
+            return;
+        }
+        // まとめて1回で書き込む(古い内容のキーを先に消してから登録し直す)
+        leveldb::WriteBatch batch;
+        for (auto &[key, value] : ready_)
+        {
+            unregisterContent(ldb_, batch, key);
+        }
+        for (auto &[key, value] : ready_)
+        {
+            auto record = withLocalTime(std::move(value), key);
+            batch.Put(key, record);
+            registerContent(batch, key, record);
+        }
+        if (!ready_.empty() && !ldb_->write(batch))
+        {
+            failures_ += ready_.size();
+        }
+        ready_.clear();
+    }
+
+  public:
+    explicit OrderedCommitter(LevelDB *ldb) : ldb_(ldb) {}
+
+    // seq番目の結果を登録(失敗したならrecordは空)
+    void commit(size_t seq, Record record)
+    {
+        std::lock_guard lock{mutex_};
+        if (!record)
+        {
+            failures_++;
+        }
+        pending_.emplace(seq, std::move(record));
+        // 先頭から連続している分だけ書き込む
+        for (auto it = pending_.begin(); it != pending_.end() && it->first == next_;
+             it = pending_.erase(it))
+        {
+            if (it->second)
+            {
+                ready_.push_back(std::move(*it->second));
+            }
+            next_++;
+        }
+        if (ready_.size() >= SyncGroupSize)
+        {
+            writeReady();
+        }
+    }
+
+    // 残りを書き込む
+    void finish()
+    {
+        std::lock_guard lock{mutex_};
+        writeReady();
+    }
+
+    // 失敗した数
+    size_t failures()
+    {
+        std::lock_guard lock{mutex_};
+        return failures_;
+    }
+};
+
+// ダウンロード用のパス
+std::string makeDownloadPath(const FilePath &fname)
+{
+    const FilePath pathPrefix{"/files"};
+    return (pathPrefix / fname).lexically_normal().string();
+}
+
+// 指定範囲をダウンロードしてfdの同じ位置に書き込む(ifRangeを指定すると違う版なら失敗する)
+bool downloadRange(httplib::Client &cli, const FilePath &fname, int fd, size_t offset,
+                   size_t length, const std::string &ifRange = {})
+{
+    httplib::Headers headers{
+        httplib::make_range_header({{static_cast<ssize_t>(offset),
+                                     static_cast<ssize_t>(offset + length - 1)}})};
+    if (!ifRange.empty())
+    {
+        headers.emplace("If-Range", ifRange);
+    }
+    size_t received = 0;
+    AsyncFileWriter writer{fd, static_cast<off_t>(offset), false};
+    auto r = cli.Get(
+        makeDownloadPath(fname), headers,
+        [&](const httplib::Response &response) { return response.status == 206; },
+        [&](const char *data, size_t data_length)
+        {
+            if (received + data_length > length)
+            {
+                return false;
+            }
+            received += data_length;
+            return writer.write(data, data_length);
+        });
+    bool written = writer.finish();
+    return r && r->status == 206 && written && received == length;
+}
+
+//
+// 分割ダウンロード(Range指定で並列取得、中断しても未完了のチャンクのみ再開)
+//
+const std::string ChunkKeyPrefix = "@chunk:";
+
+struct ChunkedFile
+{
+    FilePath fname_;
+    FilePath tempName_;
+    size_t size_;
+    int64_t time_;
+    size_t chunkSize_;
+    std::string record_; // 完了時に書き込むエントリ
+    int fd_ = -1;
+    std::mutex mutex_;
+    std::string done_; // チャンク毎の完了状態('0' or '1')
+    size_t remain_ = 0;
+    bool failed_   = false;
+
+    ~ChunkedFile()
+    {
+        if (fd_ >= 0)
+        {
+            ::close(fd_);
+        }
+    }
+
+    size_t chunkCount() const { return (size_ + chunkSize_ - 1) / chunkSize_; }
+    size_t chunkOffset(size_t idx) const { return idx * chunkSize_; }
+    size_t chunkLength(size_t idx) const
+    {
+        return std::min(chunkSize_, size_ - chunkOffset(idx));
+    }
+
+    // 進捗の保存
+    void saveState(LevelDB *ldb)
+    {
+        nlohmann::json state;
+        state["Size"]      = size_;
+        state["Time"]      = time_;
+        state["ChunkSize"] = chunkSize_;
+        state["Done"]      = done_;
+        ldb->put(ChunkKeyPrefix + fname_.string(), state.dump());
+    }
+};
+using ChunkedFilePtr = std::shared_ptr<ChunkedFile>;
+
+// 分割ダウンロードの準備(前回の途中経過があれば引き継ぐ)
+ChunkedFilePtr prepareChunkedFile(LevelDB *ldb, const FilePath &fname, size_t fsize, int64_t ftime,
+                                  size_t chunkSize, std::string record)
+{
+    auto cf        = std::make_shared<ChunkedFile>();
+    cf->fname_     = fname;
+    cf->tempName_  = fname.string() + ".fsrv-part";
+    cf->size_      = fsize;
+    cf->time_      = ftime;
+    cf->chunkSize_ = chunkSize;
+    cf->record_    = std::move(record);
+
+    auto count = cf->chunkCount();
+    cf->done_.assign(count, '0');
+
+    bool resume = false;
+    std::string stateStr;
+    if (std::filesystem::exists(cf->tempName_) &&
+        ldb->get(ChunkKeyPrefix + fname.string(), stateStr))
+    {
+        auto state = nlohmann::json::parse(stateStr);
+        auto done  = state["Done"].get<std::string>();
+        if (state["Size"].get<size_t>() == fsize && state["Time"].get<int64_t>() == ftime &&
+            state["ChunkSize"].get<size_t>() == chunkSize && done.size() == count &&
+            std::filesystem::file_size(cf->tempName_) == fsize)
+        {
+            cf->done_ = done;
+            resume    = true;
+        }
+    }
+
+    cf->fd_ = ::open(cf->tempName_.c_str(), O_RDWR | O_CREAT, 0644);
+    if (cf->fd_ < 0)
+    {
+        std::cerr << "open failed: " << cf->tempName_ << std::endl;
+        return nullptr;
+    }
+    if (!resume)
+    {
+        // 最初から: 領域を確保しておく
+        int r = ::ftruncate(cf->fd_, 0);
+#if __linux__
+        if (r == 0 && fsize > 0)
+        {
+            r = ::posix_fallocate(cf->fd_, 0, static_cast<off_t>(fsize));
+        }
+#endif
+        if (r != 0 || ::ftruncate(cf->fd_, static_cast<off_t>(fsize)) != 0)
+        {
+            std::cerr << "allocate failed: " << cf->tempName_ << std::endl;
+            return nullptr;
+        }
+        cf->saveState(ldb);
+    }
+    else
+    {
+        printMessage("RESUME: ", fname);
+    }
+    cf->remain_ = std::count(cf->done_.begin(), cf->done_.end(), '0');
+    return cf;
+}
+
+// 1チャンクダウンロード
+bool downloadChunk(httplib::Client &cli, ChunkedFile &cf, size_t idx)
+{
+    auto offset = cf.chunkOffset(idx);
+    auto length = cf.chunkLength(idx);
+    printVerbose("DOWNLOAD CHUNK: ", cf.fname_, "[", offset, "+", length, "]");
+    return downloadRange(cli, cf.fname_, cf.fd_, offset, length);
+}
+
+// チャンク完了(全チャンク処理済みになったらtrue)
+bool finishChunk(LevelDB *ldb, ChunkedFile &cf, size_t idx, bool ok)
+{
+    std::lock_guard lock{cf.mutex_};
+    if (ok && fileDurability.level() != Durability::None && ::fsync(cf.fd_) != 0)
+    {
+        // 書けていないチャンクを完了として記録しない
+        ok = false;
+    }
+    if (ok)
+    {
+        cf.done_[idx] = '1';
+        cf.saveState(ldb);
+    }
+    else
+    {
+        cf.failed_ = true;
+    }
+    return --cf.remain_ == 0;
+}
+
+// 分割ダウンロード完了
+OrderedCommitter::Record completeChunkedFile(LevelDB *ldb, ChunkedFile &cf)
+{
+    ::close(cf.fd_);
+    cf.fd_ = -1;
+    if (cf.failed_)
+    {
+        // 一時ファイルと進捗は次回のために残す
+        printMessage("Download failed: ", cf.fname_, " (resume on next sync)");
+        return std::nullopt;
+    }
+    if (!fileDurability.replace(cf.tempName_, cf.fname_))
+    {
+        return std::nullopt;
+    }
+    ldb->remove(ChunkKeyPrefix + cf.fname_.string());
+    printMessage("Download size: ", cf.size_, " ===> done. ", cf.fname_);
+    return std::make_pair(cf.fname_.string(), cf.record_);
+}
+
+//
+// 差分ダウンロード(サーバーのブロックチェックサムと一致する部分は手元のファイルから流用)
+//
+
+// 読み込み専用のメモリマップ
+class MappedFile
+{
+    int fd_{-1};
+    void *addr_{nullptr};
+    size_t size_{0};
+
+  public:
+    explicit MappedFile(const FilePath &fname)
+    {
+        fd_ = ::open(fname.c_str(), O_RDONLY);
+        struct stat st;
+        if (fd_ < 0 || ::fstat(fd_, &st) != 0 || st.st_size <= 0)
+        {
+            return;
+        }
+        auto addr = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd_, 0);
+        if (addr != MAP_FAILED)
+        {
+            addr_ = addr;
+            size_ = st.st_size;
+        }
+    }
+    ~MappedFile()
+    {
+        if (addr_)
+        {
+            ::munmap(addr_, size_);
+        }
+        if (fd_ >= 0)
+        {
+            ::close(fd_);
+        }
+    }
+    MappedFile(const MappedFile &)            = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    bool valid() const { return addr_ != nullptr; }
+    const uint8_t *data() const { return static_cast<const uint8_t *>(addr_); }
+    size_t size() const { return size_; }
+};
+
+// 差分ダウンロード(差分が取れない場合や組み立てた結果が合わない場合はnullopt)
+// /blocksはリストと同じ版のときだけ使い、範囲の取得はIf-Rangeで同じ版に限り、
+// 最後に全体のSHA-256を確かめる(途中で変わっても古い部分と混ざったものを置かない)
+std::optional<bool> deltaDownload(httplib::Client &cli, const FilePath &fname, size_t fsize,
+                                  int64_t ftime)
+{
+    httplib::Params params{{"path", fname.string()}};
+    auto res = cli.Get("/blocks", params, {});
+    if (!res || res->status != 200)
+    {
+        return std::nullopt;
+    }
+    auto blocks = nlohmann::json::parse(res->body, nullptr, false);
+    if (!blocks.is_object() || !blocks["Weak"].is_array() || !blocks["Strong"].is_array())
+    {
+        return std::nullopt;
+    }
+    auto blockSize = blocks.value("BlockSize", size_t{0});
+    auto etag      = blocks.value("ETag", std::string{});
+    auto digest    = blocks.value("Digest", std::string{});
+    auto weak      = blocks["Weak"];
+    auto strong    = blocks["Strong"];
+    auto count     = weak.size();
+    if (blocks.value("Size", size_t{0}) != fsize || blocks.value("Time", int64_t{0}) != ftime ||
+        etag.empty() || digest.empty() || blockSize == 0 || count != strong.size() ||
+        count != (fsize + blockSize - 1) / blockSize)
+    {
+        return std::nullopt;
+    }
+    for (size_t idx = 0; idx < count; idx++)
+    {
+        if (!weak[idx].is_number_unsigned() || !strong[idx].is_string())
+        {
+            return std::nullopt;
+        }
+    }
+
+    MappedFile local{fname};
+    if (!local.valid())
+    {
+        return std::nullopt;
+    }
+    const uint8_t *data = local.data();
+    auto localSize      = local.size();
+
+    // ブロック毎の手元での位置(-1は見つからなかった)
+    std::vector<int64_t> source(count, -1);
+    auto blockLength = [&](size_t idx) { return std::min(blockSize, fsize - idx * blockSize); };
+    auto tryMatch    = [&](size_t idx, size_t pos, const std::string &sum)
+    {
+        if (source[idx] < 0 && strong[idx].get<std::string>() == sum)
+        {
+            source[idx] = static_cast<int64_t>(pos);
+            return true;
+        }
+        return false;
+    };
+
+    // 弱いチェックサムで候補を探し、強いチェックサムで確認
+    std::unordered_multimap<uint32_t, size_t> weakMap;
+    for (size_t idx = 0; idx < count; idx++)
+    {
+        if (blockLength(idx) == blockSize)
+        {
+            weakMap.emplace(weak[idx].get<uint32_t>(), idx);
+        }
+    }
+    if (localSize >= blockSize && !weakMap.empty())
+    {
+        RollingChecksum rc{data, blockSize};
+        size_t pos = 0;
+        for (;;)
+        {
+            bool matched = false;
+            auto range   = weakMap.equal_range(rc.value());
+            if (range.first != range.second)
+            {
+                auto sum = strongChecksum(data + pos, blockSize);
+                for (auto it = range.first; it != range.second; ++it)
+                {
+                    matched |= tryMatch(it->second, pos, sum);
+                }
+            }
+            if (matched)
+            {
+                pos += blockSize;
+                if (pos + blockSize > localSize)
+                {
+                    break;
+                }
+                rc.reset(data + pos, blockSize);
+                continue;
+            }
+            if (pos + blockSize >= localSize)
+            {
+                break;
+            }
+            rc.roll(data[pos], data[pos + blockSize]);
+            pos++;
+        }
+    }
+    // 端数の最終ブロックは同じ位置か末尾のみ確認
+    auto lastIdx = count - 1;
+    auto lastLen = blockLength(lastIdx);
+    if (lastLen != blockSize)
+    {
+        for (size_t pos : {lastIdx * blockSize, localSize - std::min(localSize, lastLen)})
+        {
+            if (pos + lastLen <= localSize &&
+                tryMatch(lastIdx, pos, strongChecksum(data + pos, lastLen)))
+            {
+                break;
+            }
+        }
+    }
+
+    // 一時ファイルに組み立てる
+    FilePath tempName = fname.string() + ".fsrv-part";
+    int fd            = ::open(tempName.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        std::cerr << "open failed: " << tempName << std::endl;
+        return false;
+    }
+    bool ok        = ::ftruncate(fd, static_cast<off_t>(fsize)) == 0;
+    size_t reused  = 0;
+    size_t fetched = 0;
+    for (size_t idx = 0; ok && idx < count;)
+    {
+        auto offset = idx * blockSize;
+        if (source[idx] >= 0)
+        {
+            auto len = blockLength(idx);
+            ok       = ::pwrite(fd, data + source[idx], len, static_cast<off_t>(offset)) ==
+                 static_cast<ssize_t>(len);
+            reused += len;
+            idx++;
+            continue;
+        }
+        // 連続して足りないブロックはまとめて取得
+        auto end = idx;
+        while (end < count && source[end] < 0)
+        {
+            end++;
+        }
+        auto len = std::min(end * blockSize, fsize) - offset;
+        ok       = downloadRange(cli, fname, fd, offset, len, etag);
+        fetched += len;
+        idx = end;
+    }
+    ::close(fd);
+    ContentHash built;
+    if (!ok || !hashFile(tempName.string(), true, built) || built.sha256_ != digest)
+    {
+        // サーバーで変わったか組み立てに失敗したので全体を取り直す
+        std::filesystem::remove(tempName);
+        return std::nullopt;
+    }
+    if (!fileDurability.replace(tempName, fname))
+    {
+        std::filesystem::remove(tempName);
+        return false;
+    }
+    printMessage("DELTA: ", fname, " reused=", reused, " fetched=", fetched, " ===> done.");
+    return true;
+}
+
+//
+// ファイル同期
+//
+struct DownloadTask
+{
+    size_t seq_;
+    FilePath fname_;
+    size_t size_;
+    std::string record_;
+    ChunkedFilePtr chunked_{};
+    size_t chunk_ = 0;
+    bool delta_   = false;
+    int64_t time_ = 0;  // サーバーでの更新時刻(差分で確かめる)
+    FilePath source_{}; // 同じ内容の手元のファイル
+    ContentHash digest_{};
+    DedupMode dedup_ = DedupMode::None;
+    std::vector<DownloadTask> batch_{}; // まとめて取得する小さなファイル
+};
+
+// 1ファイルダウンロード
+bool downloadFile(httplib::Client &cli, const FilePath &fname, size_t fsize)
+{
+    auto downloadPath = makeDownloadPath(fname);
+    printMessage("DOWNLOAD: ", downloadPath, " -> ", fname);
+    auto tmpPath = makeTempPath(fname);
+    int fd       = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        std::cerr << "open failed: " << tmpPath << std::endl;
+        return false;
+    }
+    AsyncFileWriter writer{fd, 0, true};
+    std::unique_ptr<Decompressor> decomp;
+    cli.set_decompress(false);
+    auto r = cli.Get(
+        downloadPath, AcceptCompressed,
+        [&](const httplib::Response &response)
+        {
+            printVerbose(" response: ", response.status,
+                         " encoding: ", response.get_header_value("Content-Encoding"));
+            decomp = makeDecompressor(response);
+            return decomp != nullptr;
+        },
+        [&](const char *data, size_t data_length)
+        {
+            return decomp->decompress(data, data_length, [&](const char *p, size_t len)
+                                      { return writer.write(p, len); });
+        });
+    bool written = writer.finish();
+    if (r && r->status == 200 && written && fileDurability.replace(tmpPath, fname))
+    {
+        printMessage("Download size: ", fsize, " ===> done. ", fname);
+        return true;
+    }
+    // 元のファイルはそのまま
+    std::error_code ec;
+    std::filesystem::remove(tmpPath, ec);
+    return false;
+}
+
+//
+// 小さなファイルをまとめてダウンロード(/batch)
+// 受け取れなかったもの(古いサーバー、大きくなったファイルなど)は1つずつダウンロードする
+//
+void downloadBatch(httplib::Client &cli, std::vector<DownloadTask> &tasks,
+                   OrderedCommitter &committer)
+{
+    std::unordered_map<std::string, size_t> taskIndex;
+    nlohmann::json paths = nlohmann::json::array();
+    for (size_t i = 0; i < tasks.size(); i++)
+    {
+        auto key = tasks[i].fname_.generic_string();
+        taskIndex.emplace(key, i);
+        paths.push_back(key);
+    }
+    nlohmann::json body;
+    body["Paths"] = paths;
+    printMessage("DOWNLOAD: ", tasks.size(), " files in a batch");
+
+    // 受け取った順にファイルへ書き出す
+    struct Unpacker
+    {
+        std::vector<DownloadTask> &tasks_;
+        std::unordered_map<std::string, size_t> &taskIndex_;
+        OrderedCommitter &committer_;
+        std::vector<bool> done_;
+        DownloadTask *current_{nullptr};
+        std::optional<AsyncFileWriter> writer_;
+
+        bool begin(const BatchEntry &entry)
+        {
+            auto it = taskIndex_.find(entry.path_);
+            if (it == taskIndex_.end() || done_[it->second])
+            {
+                return false;
+            }
+            current_ = &tasks_[it->second];
+            if (entry.flags_ & BatchFlagMissing)
+            {
+                // リストの後で消された
+                printVerbose(" missing: ", entry.path_);
+                committer_.commit(current_->seq_, std::nullopt);
+                done_[it->second] = true;
+                current_          = nullptr;
+                return true;
+            }
+            if (entry.flags_ & BatchFlagSkipped)
+            {
+                current_ = nullptr;
+                return true;
+            }
+            auto tmpPath = makeTempPath(current_->fname_);
+            int fd       = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (fd < 0)
+            {
+                return false;
+            }
+            writer_.emplace(fd, 0, true);
+            return true;
+        }
+        bool data(const char *p, size_t len) { return writer_->write(p, len); }
+        bool end(const BatchEntry &entry)
+        {
+            if (!current_)
+            {
+                return true;
+            }
+            bool written = writer_->finish();
+            writer_.reset();
+            auto tmpPath = makeTempPath(current_->fname_);
+            if (!written || !fileDurability.replace(tmpPath, current_->fname_))
+            {
+                return false;
+            }
+            printVerbose(" unpacked: ", entry.path_, " size=", entry.size_);
+            committer_.commit(current_->seq_,
+                              std::make_pair(current_->fname_.string(), current_->record_));
+            done_[current_ - tasks_.data()] = true;
+            current_                         = nullptr;
+            return true;
+        }
+    };
+    Unpacker unpacker{tasks, taskIndex, committer, std::vector<bool>(tasks.size()), nullptr, {}};
+
+    BatchDecoder decoder;
+    std::unique_ptr<Decompressor> decomp;
+    httplib::Request req;
+    req.method  = "POST";
+    req.path    = "/batch";
+    req.headers = AcceptCompressed;
+    req.headers.emplace("Content-Type", "application/json");
+    req.body             = body.dump();
+    req.response_handler = [&](const httplib::Response &response)
+    {
+        if (response.status != 200 ||
+            response.get_header_value("Content-Type") != BatchContentType)
+        {
+            return false;
+        }
+        decomp = makeDecompressor(response);
+        return decomp != nullptr;
+    };
+    req.content_receiver = [&](const char *data, size_t data_length, uint64_t, uint64_t)
+    {
+        return decomp->decompress(data, data_length,
+                                  [&](const char *p, size_t len)
+                                  { return decoder.feed(p, len, unpacker); });
+    };
+    cli.set_decompress(false);
+    auto r = cli.send(req);
+    if (!r || !decoder.finished())
+    {
+        printVerbose("batch incomplete: ",
+                     r ? std::to_string(r->status) : httplib::to_string(r.error()));
+    }
+    if (unpacker.current_)
+    {
+        // 途中で切れたファイル(元のファイルはそのまま)
+        unpacker.writer_.reset();
+        std::error_code ec;
+        std::filesystem::remove(makeTempPath(unpacker.current_->fname_), ec);
+    }
+
+    for (size_t i = 0; i < tasks.size(); i++)
+    {
+        if (!unpacker.done_[i])
+        {
+            auto &task = tasks[i];
+            OrderedCommitter::Record record;
+            if (downloadFile(cli, task.fname_, task.size_))
+            {
+                record = std::make_pair(task.fname_.string(), std::move(task.record_));
+            }
+            committer.commit(task.seq_, std::move(record));
+        }
+    }
+}
+
+// ダウンロードワーカー(ワーカー毎にkeep-aliveの接続を持つ)
+void downloadWorker(ClientPool &pool, WorkQueue<DownloadTask> &queue,
+                    OrderedCommitter &committer, LevelDB *ldb)
+{
+    auto lease = pool.acquire();
+    auto &cli  = *lease;
+
+    DownloadTask task;
+    while (queue.pop(task))
+    {
+        if (!task.batch_.empty())
+        {
+            downloadBatch(cli, task.batch_, committer);
+            continue;
+        }
+        if (!task.source_.empty())
+        {
+            if (cloneLocalFile(task.source_, task.fname_, task.dedup_, task.digest_))
+            {
+                committer.commit(task.seq_, std::make_pair(task.fname_.string(), task.record_));
+                continue;
+            }
+            printVerbose("local copy unavailable, download: ", task.fname_);
+        }
+        if (task.chunked_)
+        {
+            auto &cf = *task.chunked_;
+            bool ok  = downloadChunk(cli, cf, task.chunk_);
+            if (finishChunk(ldb, cf, task.chunk_, ok))
+            {
+                committer.commit(task.seq_, completeChunkedFile(ldb, cf));
+            }
+            continue;
+        }
+        if (task.delta_)
+        {
+            if (auto r = deltaDownload(cli, task.fname_, task.size_, task.time_))
+            {
+                OrderedCommitter::Record record;
+                if (*r)
+                {
+                    record = std::make_pair(task.fname_.string(), std::move(task.record_));
+                }
+                committer.commit(task.seq_, std::move(record));
+                continue;
+            }
+            printVerbose("delta unavailable, full download: ", task.fname_);
+        }
+        OrderedCommitter::Record record;
+        if (downloadFile(cli, task.fname_, task.size_))
+        {
+            record = std::make_pair(task.fname_.string(), std::move(task.record_));
+        }
+        committer.commit(task.seq_, std::move(record));
+    }
+}
+
+// 同期の設定
+struct SyncOptions
+{
+    int jobs_              = 4;
+    size_t chunkSize_      = 0;
+    bool delta_            = false;
+    bool full_             = false;
+    DedupMode dedup_       = DedupMode::None;
+    size_t batchSize_      = 0; // これ以下のファイルはまとめて取得する(0で無効)
+    int writeThreads_      = 2;
+    Durability durability_ = Durability::Batch;
+};
+
+// まとめる単位
+constexpr size_t BatchMaxFiles = 256;
+constexpr size_t BatchMaxBytes = 4 * 1024 * 1024;
+
+// prefix以下の記録を1回のスキャンでまとめて読み込む
+RecordMap loadRecords(LevelDB *ldb, const std::string &prefix)
+{
+    RecordMap records;
+    ldb->scan(prefix,
+              [&](std::string key, const leveldb::Slice &value)
+              {
+                  for (auto &internal :
+                       {GenerationKeyPrefix, ContentKeyPrefix, ChunkKeyPrefix, TlsSessionKeyPrefix})
+                  {
+                      if (key.rfind(internal, 0) == 0)
+                      {
+                          return;
+                      }
+                  }
+                  StoredRecord stored;
+                  std::optional<int64_t> localTime;
+                  if (parseRecord({value.data(), value.size()}, stored.remote_, &localTime))
+                  {
+                      stored.localTime_ = localTime.value_or(0);
+                      records.emplace(std::move(key), std::move(stored));
+                  }
+              });
+    return records;
+}
+
+//
+void syncFiles(const ConnectOptions &conn, std::string pattern, const SyncOptions &opts)
+{
+    auto jobs      = opts.jobs_;
+    auto chunkSize = opts.chunkSize_;
+    auto delta     = opts.delta_;
+    auto full      = opts.full_;
+
+    auto ldb = std::make_unique<LevelDB>();
+    if (!ldb->open())
+    {
+        return;
+    }
+    auto records = loadRecords(ldb.get(), pattern);
+    printVerbose("records loaded: ", records.size());
+
+    // リストはこの接続で受け取る
+    ClientPool pool{conn, ldb.get()};
+    auto lease = pool.acquire();
+    auto &cli  = *lease;
+
+    // ワーカー起動(書き込みはワーカー毎に4バッファまで先行できる)
+    jobs = std::max(jobs, 1);
+    fileDurability.setLevel(opts.durability_);
+    diskWriter.start(static_cast<size_t>(jobs) * 4, opts.writeThreads_);
+    OrderedCommitter committer{ldb.get()};
+    WorkQueue<DownloadTask> queue{static_cast<size_t>(jobs) * 4};
+    std::vector<std::thread> workers;
+    for (int i = 0; i < jobs; i++)
+    {
+        workers.emplace_back([&] { downloadWorker(pool, queue, committer, ldb.get()); });
+    }
+
+    // 前回同期した世代以降の変更のみ要求する
+    const std::string genKey = GenerationKeyPrefix + pattern;
+    httplib::Params params{{"prefix", pattern}, {"update", "true"}};
+    std::string genStr;
+    if (!full && ldb->get(genKey, genStr))
+    {
+        auto gen = nlohmann::json::parse(genStr);
+        params.emplace("epoch", gen["Epoch"].get<std::string>());
+        params.emplace("since", std::to_string(gen["Generation"].get<uint64_t>()));
+    }
+
+    // 小さなファイルはある程度たまったらまとめてワーカーに渡す
+    DownloadTask batch{};
+    size_t batchBytes = 0;
+    auto flushBatch   = [&]
+    {
+        if (!batch.batch_.empty())
+        {
+            queue.push(std::move(batch));
+            batch      = DownloadTask{};
+            batchBytes = 0;
+        }
+    };
+
+    // リストが届いたものから順に処理する
+    size_t seq = 0;
+    ListStamp stamp;
+    bool listed = fetchFileList(
+        cli, params,
+        [&](const ListEntry &entry)
+        {
+            FilePath fname = entry.path_;
+            auto fsize     = entry.size_;
+            auto ftime     = entry.time_;
+            auto fdel      = entry.delete_;
+            auto record    = makeRecord(entry);
+
+            printVerbose(fname, ":size=", fsize, ",time=", ftime, (fdel ? "[DELETED]" : ""));
+            bool needUpdate = false;
+            bool fileExists = std::filesystem::exists(fname);
+            if (fdel)
+            {
+                if (fileExists)
+                {
+                    // ファイルは消されているのでこちらも消去
+                    printMessage("remove file: ", fname);
+                    std::filesystem::remove(fname);
+                }
+            }
+            else if (fileExists)
+            {
+                // ファイルが存在するなら更新されたか確認する
+                needUpdate = checkUpdateFile(records, fname, entry);
+            }
+            else
+            {
+                // ない
+                needUpdate = true;
+                checkAndMakeDir(fname);
+                printVerbose("  -> not exists(need update)");
+            }
+            // 同じ内容のファイルが手元にあれば使う
+            std::optional<FilePath> source;
+            if (needUpdate && opts.dedup_ != DedupMode::None)
+            {
+                source = findSameContent(ldb.get(), entry, fname);
+            }
+            //
+            if (source)
+            {
+                DownloadTask task{seq++, fname, fsize, record};
+                task.source_ = *source;
+                task.digest_ = {entry.hash_, entry.sha256_};
+                task.dedup_  = opts.dedup_;
+                queue.push(std::move(task));
+            }
+            else if (needUpdate && delta && fileExists && fsize > 0)
+            {
+                // 手元にあるファイルとの差分のみ取得
+                DownloadTask task{seq++, fname, fsize, record};
+                task.delta_ = true;
+                task.time_  = ftime;
+                queue.push(std::move(task));
+            }
+            else if (needUpdate && chunkSize > 0 && fsize > chunkSize)
+            {
+                // 大きなファイルは分割してワーカーに任せる
+                auto cf = prepareChunkedFile(ldb.get(), fname, fsize, ftime, chunkSize, record);
+                if (!cf)
+                {
+                    committer.commit(seq++, std::nullopt);
+                }
+                else if (cf->remain_ == 0)
+                {
+                    // 前回すべて取得済み
+                    committer.commit(seq++, completeChunkedFile(ldb.get(), *cf));
+                }
+                else
+                {
+                    for (size_t idx = 0; idx < cf->done_.size(); idx++)
+                    {
+                        if (cf->done_[idx] == '0')
+                        {
+                            queue.push({seq, fname, fsize, {}, cf, idx});
+                        }
+                    }
+                    seq++;
+                }
+            }
+            else if (needUpdate && opts.batchSize_ > 0 && fsize <= opts.batchSize_)
+            {
+                batch.batch_.push_back({seq++, fname, fsize, record});
+                batchBytes += fsize;
+                if (batch.batch_.size() >= BatchMaxFiles || batchBytes >= BatchMaxBytes)
+                {
+                    flushBatch();
+                }
+            }
+            else if (needUpdate)
+            {
+                // ファイル更新はワーカーに任せる
+                queue.push({seq++, fname, fsize, record});
+            }
+            else
+            {
+                // 手元の変更はpushするまで残すので、記録したときの手元の更新時刻を引き継ぐ
+                auto it = records.find(fname.string());
+                if (it != records.end())
+                {
+                    putVarint(record, zigzagEncode(it->second.localTime_));
+                }
+                committer.commit(seq++, std::make_pair(fname.string(), record));
+            }
+        },
+        &stamp);
+    flushBatch();
+
+    queue.close();
+    for (auto &w : workers)
+    {
+        w.join();
+    }
+    diskWriter.stop();
+    committer.finish();
+
+    // 全部成功したら世代を記録
+    if (listed && !stamp.epoch_.empty() && committer.failures() == 0)
+    {
+        nlohmann::json gen;
+        gen["Epoch"]      = stamp.epoch_;
+        gen["Generation"] = stamp.generation_;
+        ldb->put(genKey, gen.dump());
+        printVerbose("synced generation: ", stamp.generation_);
+    }
+}
+
+//
+// 手元の変更をサーバーに送る(サーバーを--writableで起動しておく)
+// 最後に同期したときの記録と手元のファイルを比べて、変わったものだけ送る
+// サーバーのファイルがその後に変わっていれば、上書きせずに衝突として報告する
+//
+struct PushOptions
+{
+    int jobs_   = 4;
+    bool force_ = false; // 衝突を確かめずに上書き
+};
+
+// 送る単位
+constexpr size_t UploadBufferSize = 1024 * 1024;
+
+// 同期中の一時ファイル
+bool isTempFile(const FilePath &fname)
+{
+    auto name = fname.filename().string();
+    return name.ends_with(TempSuffix) || name.ends_with(".fsrv-part");
+}
+
+// 手元で変更されたか(記録したときの手元の更新時刻が不明なら、サイズとあれば内容で比べる)
+bool checkLocalChange(const StoredRecord *stored, const FilePath &fname, size_t size,
+                      int64_t mtime)
+{
+    if (stored == nullptr || stored->remote_.delete_)
+    {
+        printVerbose("new local file: ", fname);
+        return true;
+    }
+    auto &remote = stored->remote_;
+    bool changed = size != remote.size_;
+    if (!changed && stored->localTime_ != 0)
+    {
+        changed = mtime != stored->localTime_;
+    }
+    else if (!changed && (!remote.hash_.empty() || !remote.sha256_.empty()))
+    {
+        ContentHash actual;
+        bool withSha256 = !remote.sha256_.empty();
+        if (hashFile(fname.string(), withSha256, actual))
+        {
+            changed = withSha256 ? actual.sha256_ != remote.sha256_ : actual.hash_ != remote.hash_;
+        }
+    }
+    printVerbose(changed ? "local changed: " : "no local change: ", fname);
+    return changed;
+}
+
+// 1ファイル送る(送った後の記録を返す、失敗や衝突なら空)
+OrderedCommitter::Record uploadFile(httplib::Client &cli, const FilePath &fname,
+                                    const StoredRecord *stored, size_t size, int64_t mtime,
+                                    const PushOptions &opts, std::atomic<size_t> &conflicts)
+{
+    // サーバーに最後に見た状態と同じか確かめてもらう
+    std::string base = "none";
+    if (opts.force_)
+    {
+        base = "*";
+    }
+    else if (stored && !stored->remote_.delete_)
+    {
+        base = std::to_string(stored->remote_.size_) + ":" + std::to_string(stored->remote_.time_);
+    }
+
+    std::ifstream inFile{fname, std::ios::binary};
+    if (!inFile)
+    {
+        std::cerr << "open failed: " << fname << std::endl;
+        return std::nullopt;
+    }
+    std::vector<char> buffer(UploadBufferSize);
+    httplib::Headers headers{{"X-Fsrv-Base", base}};
+    auto res = cli.Put(
+        makeDownloadPath(fname), headers, size,
+        [&](size_t offset, size_t length, httplib::DataSink &sink)
+        {
+            auto len = std::min(length, buffer.size());
+            inFile.seekg(static_cast<std::streamoff>(offset));
+            inFile.read(buffer.data(), static_cast<std::streamsize>(len));
+            auto n = static_cast<size_t>(inFile.gcount());
+            return n > 0 && sink.write(buffer.data(), n);
+        },
+        "application/octet-stream");
+    if (!res)
+    {
+        std::cerr << "upload failed: " << fname << " (" << httplib::to_string(res.error()) << ")"
+                  << std::endl;
+        return std::nullopt;
+    }
+    if (res->status == 409)
+    {
+        conflicts++;
+        printMessage("conflict: ", fname, " (changed on the server, sync first or use --force)");
+        return std::nullopt;
+    }
+    auto value = nlohmann::json::parse(res->body, nullptr, false);
+    if ((res->status != 200 && res->status != 201) || !value.is_object())
+    {
+        std::cerr << "upload failed: " << fname << " (status " << res->status << ")" << std::endl;
+        return std::nullopt;
+    }
+    printMessage("Upload size: ", size, " ===> done. ", fname);
+
+    // サーバーの状態と送ったときの手元の更新時刻を記録
+    ListEntry entry;
+    entry.size_ = value.value("Size", uint64_t{0});
+    entry.time_ = value.value("Time", int64_t{0});
+    auto record = makeRecord(entry);
+    putVarint(record, zigzagEncode(mtime));
+    return std::make_pair(fname.string(), std::move(record));
+}
+
+//
+void pushWorker(ClientPool &pool, WorkQueue<FilePath> &queue, const RecordMap &records,
+                const PushOptions &opts, std::atomic<size_t> &seq, OrderedCommitter &committer,
+                std::atomic<size_t> &conflicts)
+{
+    auto lease = pool.acquire();
+    auto &cli  = *lease;
+
+    FilePath fname;
+    while (queue.pop(fname))
+    {
+        std::error_code ec;
+        auto size  = std::filesystem::file_size(fname, ec);
+        auto mtime = localFileTime(fname);
+        if (ec || mtime == 0)
+        {
+            continue;
+        }
+        auto it      = records.find(fname.string());
+        auto *stored = it != records.end() ? &it->second : nullptr;
+        if (checkLocalChange(stored, fname, size, mtime))
+        {
+            committer.commit(seq++, uploadFile(cli, fname, stored, size, mtime, opts, conflicts));
+        }
+    }
+}
+
+//
+// 手元のディレクトリを複数のスレッドで走査(ディレクトリ単位で分担する)
+// fileは見つけたスレッドから呼ぶ。.ldbとシンボリックリンクのディレクトリは辿らない
+//
+template <class Callback> void walkDirectory(const FilePath &root, size_t threads, Callback &&file)
+{
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::vector<FilePath> dirs{root}; // 読んでいないディレクトリ
+    size_t busy = 0;                  // 読んでいる途中のスレッド
+
+    auto worker = [&]
+    {
+        std::unique_lock lock{mutex};
+        for (;;)
+        {
+            cond.wait(lock, [&] { return !dirs.empty() || busy == 0; });
+            if (dirs.empty())
+            {
+                return;
+            }
+            auto dir = std::move(dirs.back());
+            dirs.pop_back();
+            busy++;
+            lock.unlock();
+
+            std::vector<FilePath> found;
+            std::error_code ec;
+            auto dirOpts = std::filesystem::directory_options::skip_permission_denied;
+            for (std::filesystem::directory_iterator it{dir, dirOpts, ec}, end; !ec && it != end;
+                 it.increment(ec))
+            {
+                std::error_code sec;
+                if (it->is_directory(sec))
+                {
+                    if (!it->is_symlink(sec) && it->path().filename() != ".ldb")
+                    {
+                        found.push_back(it->path());
+                    }
+                }
+                else if (it->is_regular_file(sec))
+                {
+                    file(it->path());
+                }
+            }
+            if (ec)
+            {
+                std::cerr << "scan failed: " << dir << " (" << ec.message() << ")" << std::endl;
+            }
+
+            lock.lock();
+            busy--;
+            dirs.insert(dirs.end(), std::make_move_iterator(found.begin()),
+                        std::make_move_iterator(found.end()));
+            cond.notify_all();
+        }
+    };
+    std::vector<std::thread> pool;
+    for (size_t i = 1; i < threads; i++)
+    {
+        pool.emplace_back(worker);
+    }
+    worker();
+    for (auto &t : pool)
+    {
+        t.join();
+    }
+}
+
+//
+void pushFiles(const ConnectOptions &conn, std::string pattern, const PushOptions &opts)
+{
+    // 送るのはpatternで始まるものだけ(サーバーの対象ディレクトリ名から始める)
+    pattern = FilePath{pattern}.lexically_normal().generic_string();
+    FilePath root{pattern};
+    std::error_code ec;
+    if (!std::filesystem::is_directory(root, ec))
+    {
+        root = root.parent_path();
+    }
+    if (root.empty())
+    {
+        std::cerr << "push needs a pattern under the served directory" << std::endl;
+        return;
+    }
+
+    auto ldb = std::make_unique<LevelDB>();
+    if (!ldb->open())
+    {
+        return;
+    }
+    auto records = loadRecords(ldb.get(), pattern);
+    printVerbose("records loaded: ", records.size());
+
+    // 手元の走査と、比較と送信はそれぞれ別のスレッドで並行して行う
+    ClientPool pool{conn, ldb.get()};
+    auto jobs = std::max(opts.jobs_, 1);
+    OrderedCommitter committer{ldb.get()};
+    WorkQueue<FilePath> queue{static_cast<size_t>(jobs) * 64};
+    std::atomic<size_t> seq{0};
+    std::atomic<size_t> conflicts{0};
+    std::vector<std::thread> workers;
+    for (int i = 0; i < jobs; i++)
+    {
+        workers.emplace_back(
+            [&] { pushWorker(pool, queue, records, opts, seq, committer, conflicts); });
+    }
+
+    walkDirectory(root, static_cast<size_t>(jobs),
+                  [&](const FilePath &path)
+                  {
+                      auto fname = path.lexically_normal();
+                      if (!isTempFile(fname) && fname.string().rfind(pattern, 0) == 0)
+                      {
+                          queue.push(std::move(fname));
+                      }
+                  });
+    queue.close();
+    for (auto &w : workers)
+    {
+        w.join();
+    }
+    committer.finish();
+    printMessage("pushed: ", seq.load() - committer.failures(), ", conflicts: ", conflicts.load(),
+                 ", failed: ", committer.failures() - conflicts.load());
+}
+
+} // namespace
+
+//
+//
+//
+int main(int argc, char **argv)
+{
+    cxxopts::Options options(argv[0], "file synchronize server");
+
+    options.add_options()("h,help", "Print usage")(
+        // verbose
+        "v,verbose", "verbose mode", cxxopts::value<bool>()->default_value("false"))(
+        // port
+        "p,port", "port number", cxxopts::value<int>())(
+        // parallel downloads
+        "j,jobs", "number of parallel downloads", cxxopts::value<int>()->default_value("4"))(
+        // chunked download
+        "chunk_size", "split download size for large files in MiB (0: disable)",
+        cxxopts::value<int>()->default_value("16"))(
+        // delta sync
+        "d,delta", "fetch only changed blocks of existing files",
+        cxxopts::value<bool>()->default_value("false"))(
+        // dedup
+        "dedup",
+        "reuse local files with the same content: none, copy, hardlink or reflink "
+        "(each reused file is re-hashed to verify it)",
+        cxxopts::value<std::string>()->default_value("none"))(
+        // batched download
+        "batch_size", "fetch files up to this size in KiB together in one request (0: disable)",
+        cxxopts::value<int>()->default_value("64"))(
+        // disk writer threads
+        "write_threads", "number of disk writer threads",
+        cxxopts::value<int>()->default_value("2"))(
+        // durability
+        "durability", "fsync of downloaded files: none, batch (grouped) or full (each file)",
+        cxxopts::value<std::string>()->default_value("batch"))(
+        // full listing
+        "f,full", "ignore the synced generation and check all files",
+        cxxopts::value<bool>()->default_value("false"))(
+        // tls
+        "insecure", "do not verify the server certificate (https)",
+        cxxopts::value<bool>()->default_value("false"))(
+        // tls ca
+        "ca_cert", "CA certificate file to verify the server (https)",
+        cxxopts::value<std::string>())(
+        // push without conflict check
+        "force", "push: overwrite files changed on the server",
+        cxxopts::value<bool>()->default_value("false"))(
+        // file directory
+        "url", "target url (https://... for TLS)",
+        cxxopts::value<std::string>()->default_value("localhost"))(
+        // command
+        "command", "command [dir,files,sync,push]",
+        cxxopts::value<std::string>()->default_value("dir"))(
+        // match pattern
+        "pattern", "matching pattern", cxxopts::value<std::string>()->default_value(""));
 
     options.parse_positional({"url", "command", "pattern"});
 
@@ -358,17 +2817,76 @@ int main(int argc, char **argv)
     auto command = result["command"].as<std::string>();
     auto pattern = result["pattern"].as<std::string>();
 
+    // 接続先
+    ConnectOptions conn;
+    conn.url_    = url;
+    conn.port_   = port;
+    conn.verify_ = !result["insecure"].as<bool>();
+    if (result.count("ca_cert"))
+    {
+        conn.caCert_ = result["ca_cert"].as<std::string>();
+    }
+
     if (command == "dir")
     {
-        getDirectory(url, port, pattern);
+        getDirectory(conn, pattern);
     }
     else if (command == "files")
     {
-        getFileList(url, port, pattern);
+        getFileList(conn, pattern);
     }
     else if (command == "sync")
     {
-        syncFiles(url, port, pattern);
+        SyncOptions opts;
+        opts.jobs_      = result["jobs"].as<int>();
+        opts.chunkSize_ = static_cast<size_t>(std::max(result["chunk_size"].as<int>(), 0)) << 20;
+        opts.delta_     = result["delta"].as<bool>();
+        opts.full_      = result["full"].as<bool>();
+        opts.batchSize_ = static_cast<size_t>(std::max(result["batch_size"].as<int>(), 0)) << 10;
+
+        // ディスク書き込み
+        opts.writeThreads_ = std::max(result["write_threads"].as<int>(), 1);
+        auto durability    = result["durability"].as<std::string>();
+        if (durability == "none")
+        {
+            opts.durability_ = Durability::None;
+        }
+        else if (durability == "full")
+        {
+            opts.durability_ = Durability::Full;
+        }
+        else if (durability != "batch")
+        {
+            std::cerr << "unknown durability: " << durability << std::endl;
+            return 1;
+        }
+
+        auto dedup = result["dedup"].as<std::string>();
+        if (dedup == "reflink")
+        {
+            opts.dedup_ = DedupMode::Reflink;
+        }
+        else if (dedup == "hardlink")
+        {
+            opts.dedup_ = DedupMode::Hardlink;
+        }
+        else if (dedup == "copy")
+        {
+            opts.dedup_ = DedupMode::Copy;
+        }
+        else if (dedup != "none")
+        {
+            std::cerr << "unknown dedup mode: " << dedup << std::endl;
+            return 1;
+        }
+        syncFiles(conn, pattern, opts);
+    }
+    else if (command == "push")
+    {
+        PushOptions opts;
+        opts.jobs_  = result["jobs"].as<int>();
+        opts.force_ = result["force"].as<bool>();
+        pushFiles(conn, pattern, opts);
     }
     else
     {
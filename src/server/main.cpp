@@ -1,285 +1,3744 @@
 //
 // Copyright 2023 Suzuki Yoshinori(wave.suzuki.z@gmail.com)
 //
+#include <algorithm>
+#include <atomic>
+#include <batchcodec.h>
+#include <blocksum.h>
+#include <cctype>
+#include <cerrno>
+#include <climits>
+#include <chrono>
+#include <compression.h>
+#include <condition_variable>
+#include <cstring>
+#include <contenthash.h>
 #include <cxxopts.hpp>
+#include <deque>
 #include <exception>
 #include <filesystem>
+#include <fstream>
+#include <functional>
 #include <httplib.h>
 #include <iostream>
 #include <list>
+#include <listcodec.h>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <nlohmann/json.hpp>
+#include <optional>
+#include <random>
+#include <shardedtrie.h>
+#include <sstream>
 #include <string>
+#include <string_view>
 #include <thread>
-#include <trie.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#if !_WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#if __linux__
+#include <dirent.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#endif
+
+namespace
+{
+using FilePath = std::filesystem::path;
+
+bool verboseMode   = false; // 詳細モード
+bool recursiveMode = false; // 再帰検索モード
+
+#if _WIN32
+// wchar -> string
+std::string wcs2mbs(const FilePath &src)
+{
+    auto *srcPtr = src.c_str();
+    char buff[1024];
+    wcstombs(buff, srcPtr, sizeof(buff));
+    return buff;
+}
+
+// Windowsパス変換
+FilePath translateToPosix(const FilePath src)
+{
+    auto chgStr = src.string();
+    for (auto &ch : chgStr)
+    {
+        if (ch == '\\')
+        {
+            ch = '/';
+        }
+    }
+    return chgStr;
+}
+#endif
+
+// デバッグ表示(走査スレッドからも呼ぶので1行まとめて出す)
+template <class... Args> void printVerbose(Args... args)
+{
+    if (verboseMode)
+    {
+        std::ostringstream line;
+        (line << ... << args) << '\n';
+        std::cout << line.str() << std::flush;
+    }
+}
+
+//
+// エラーハンドラ
+//
+void errorHandler(const httplib::Request & /*req*/, httplib::Response &res)
+{
+    const char *fmt = "<p>Error Status: <span style='color:red;'>%d</span></p>";
+    char buf[BUFSIZ];
+    snprintf(buf, sizeof(buf), fmt, res.status);
+    res.set_content(buf, "text/html");
+}
+
+//
+// 計測(/metricsでPrometheusのテキスト形式で返す)
+// リクエスト毎の値はスレッド毎の区画に持ち主だけが書き、読み出すときに合計する
+// 1つのリクエストは受け付けから応答を書き終わるまで同じスレッドで処理される
+//
+enum class Route : size_t
+{
+    List,
+    Dir,
+    Files,
+    Blocks,
+    Batch,
+    Upload,
+    Metrics,
+    Other,
+    Count
+};
+constexpr const char *RouteNames[] = {"list",  "dir",    "files",   "blocks",
+                                      "batch", "upload", "metrics", "other"};
+constexpr size_t RouteCount        = static_cast<size_t>(Route::Count);
+
+// 応答時間のヒストグラムの境界(秒、最後に+Infが付く)
+constexpr double LatencyBuckets[] = {0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05,
+                                     0.1,    0.25,  0.5,    1.0,   2.5,  5.0,   10.0};
+constexpr size_t BucketCount      = std::size(LatencyBuckets) + 1;
+
+// パスと方式から経路
+Route routeOf(const httplib::Request &req)
+{
+    auto &path = req.path;
+    if (path.starts_with("/files/"))
+    {
+        return req.method == "PUT" || req.method == "POST" ? Route::Upload : Route::Files;
+    }
+    static const std::pair<const char *, Route> routes[] = {{"/list", Route::List},
+                                                            {"/dir", Route::Dir},
+                                                            {"/blocks", Route::Blocks},
+                                                            {"/batch", Route::Batch},
+                                                            {"/metrics", Route::Metrics}};
+    for (auto &[name, route] : routes)
+    {
+        if (path == name)
+        {
+            return route;
+        }
+    }
+    return Route::Other;
+}
+
+class ServerMetrics
+{
+    using Clock   = std::chrono::steady_clock;
+    using Counter = std::atomic<uint64_t>;
+
+    struct RouteCounters
+    {
+        Counter requests_{0};
+        Counter errors_{0}; // 400以上
+        Counter bytes_{0};  // 送った本体(圧縮後)
+        Counter micros_{0};
+        Counter buckets_[BucketCount]{};
+    };
+    // スレッド毎の区画(書き込みは持ち主のスレッドのみなのでロック付きの加算は要らない)
+    struct alignas(64) Shard
+    {
+        RouteCounters routes_[RouteCount];
+    };
+    // 処理中のリクエスト
+    struct Pending
+    {
+        Clock::time_point start_;
+        uint64_t streamed_{0}; // 長さを決めずに送った分
+        bool active_{false};
+    };
+
+    std::mutex mutex_;
+    std::vector<std::unique_ptr<Shard>> shards_; // スレッドが終わっても値は残す
+
+    Shard &local()
+    {
+        thread_local Shard *shard = nullptr;
+        if (!shard)
+        {
+            std::lock_guard lock{mutex_};
+            shards_.push_back(std::make_unique<Shard>());
+            shard = shards_.back().get();
+        }
+        return *shard;
+    }
+    static Pending &pending()
+    {
+        thread_local Pending p;
+        return p;
+    }
+    static void add(Counter &counter, uint64_t value)
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
+
+  public:
+    std::atomic<int64_t> activeConnections_{0}; // 処理中の接続
+    std::atomic<int64_t> queuedConnections_{0}; // スレッドプールで待っている接続
+    std::atomic<uint64_t> scans_{0};            // 走査した回数
+    std::atomic<uint64_t> scanMicros_{0};       // 最後の走査にかかった時間
+
+    // 走査(起動時とスナップショット後の突き合わせ)
+    void recordScan(Clock::duration elapsed)
+    {
+        scanMicros_ = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+        scans_++;
+    }
+
+    // リクエストの受け付け(ルーティングの前)
+    void begin()
+    {
+        auto &p     = pending();
+        p.start_    = Clock::now();
+        p.streamed_ = 0;
+        p.active_   = true;
+    }
+
+    // チャンクで送った量
+    void streamed(size_t bytes) { pending().streamed_ += bytes; }
+
+    // 応答を書き終わった
+    void finish(const httplib::Request &req, const httplib::Response &res)
+    {
+        auto &p = pending();
+        if (!p.active_)
+        {
+            return;
+        }
+        p.active_   = false;
+        auto micros = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() -
+                                                                            p.start_)
+                          .count();
+        uint64_t bytes = 0;
+        if (req.method != "HEAD")
+        {
+            bytes = res.has_header("Content-Length")
+                        ? std::strtoull(res.get_header_value("Content-Length").c_str(), nullptr,
+                                        10)
+                        : res.body.size() + p.streamed_;
+        }
+        auto seconds  = static_cast<double>(micros) / 1e6;
+        size_t bucket = 0;
+        while (bucket < std::size(LatencyBuckets) && seconds > LatencyBuckets[bucket])
+        {
+            bucket++;
+        }
+
+        auto &r = local().routes_[static_cast<size_t>(routeOf(req))];
+        add(r.requests_, 1);
+        add(r.errors_, res.status >= 400);
+        add(r.bytes_, bytes);
+        add(r.micros_, static_cast<uint64_t>(micros));
+        add(r.buckets_[bucket], 1);
+    }
+
+    // 経路毎の値を書き出す
+    void format(std::ostringstream &out)
+    {
+        struct Total
+        {
+            uint64_t requests_{0};
+            uint64_t errors_{0};
+            uint64_t bytes_{0};
+            uint64_t micros_{0};
+            uint64_t buckets_[BucketCount]{};
+        };
+        Total totals[RouteCount];
+        {
+            std::lock_guard lock{mutex_};
+            for (auto &shard : shards_)
+            {
+                for (size_t i = 0; i < RouteCount; i++)
+                {
+                    auto &r = shard->routes_[i];
+                    auto &t = totals[i];
+                    t.requests_ += r.requests_.load(std::memory_order_relaxed);
+                    t.errors_ += r.errors_.load(std::memory_order_relaxed);
+                    t.bytes_ += r.bytes_.load(std::memory_order_relaxed);
+                    t.micros_ += r.micros_.load(std::memory_order_relaxed);
+                    for (size_t b = 0; b < BucketCount; b++)
+                    {
+                        t.buckets_[b] += r.buckets_[b].load(std::memory_order_relaxed);
+                    }
+                }
+            }
+        }
+
+        auto counter = [&](const char *name, const char *help, uint64_t Total::*field)
+        {
+            out << "# HELP " << name << " " << help << "\n# TYPE " << name << " counter\n";
+            for (size_t i = 0; i < RouteCount; i++)
+            {
+                out << name << "{route=\"" << RouteNames[i] << "\"} " << totals[i].*field << "\n";
+            }
+        };
+        counter("fsrv_requests_total", "Requests handled.", &Total::requests_);
+        counter("fsrv_request_errors_total", "Requests answered with status 400 or above.",
+                &Total::errors_);
+        counter("fsrv_response_bytes_total", "Response body bytes sent.", &Total::bytes_);
+
+        const char *hist = "fsrv_request_duration_seconds";
+        out << "# HELP " << hist << " Time from routing to the end of the response.\n# TYPE "
+            << hist << " histogram\n";
+        for (size_t i = 0; i < RouteCount; i++)
+        {
+            uint64_t cumulative = 0;
+            for (size_t b = 0; b < BucketCount; b++)
+            {
+                cumulative += totals[i].buckets_[b];
+                out << hist << "_bucket{route=\"" << RouteNames[i] << "\",le=\"";
+                if (b < std::size(LatencyBuckets))
+                {
+                    out << LatencyBuckets[b];
+                }
+                else
+                {
+                    out << "+Inf";
+                }
+                out << "\"} " << cumulative << "\n";
+            }
+            out << hist << "_sum{route=\"" << RouteNames[i] << "\"} "
+                << static_cast<double>(totals[i].micros_) / 1e6 << "\n";
+            out << hist << "_count{route=\"" << RouteNames[i] << "\"} " << cumulative << "\n";
+        }
+    }
+};
+ServerMetrics serverMetrics;
+
+// 接続の待ちと処理中の数を数えるスレッドプール(httplibの既定と同じ数のスレッド)
+class MeteredTaskQueue : public httplib::TaskQueue
+{
+    httplib::ThreadPool pool_;
+
+  public:
+    explicit MeteredTaskQueue(size_t threads) : pool_(threads) {}
+
+    bool enqueue(std::function<void()> fn) override
+    {
+        serverMetrics.queuedConnections_++;
+        bool queued = pool_.enqueue(
+            [fn = std::move(fn)]
+            {
+                serverMetrics.queuedConnections_--;
+                serverMetrics.activeConnections_++;
+                fn();
+                serverMetrics.activeConnections_--;
+            });
+        if (!queued)
+        {
+            serverMetrics.queuedConnections_--;
+        }
+        return queued;
+    }
+    void shutdown() override { pool_.shutdown(); }
+};
+
+//
+// ファイル情報
+//
+struct FileInfo
+{
+    FilePath key_;
+    FilePath path_;
+    int64_t time_;
+    size_t size_;
+    bool delete_;
+    uint64_t gen_;       // 最後に変更された世代
+    std::string hash_;   // 内容のXXH64(求めていなければ空)
+    std::string sha256_; // 内容のSHA-256(求めていなければ空)
+};
+using FileInfoPtr = std::shared_ptr<const FileInfo>; // 登録後は書き換えず差し替える
+using FileTrie    = ShardedTrie<std::string, FileInfoPtr>;
+using FileCursor  = FileTrie::Cursor;
+
+// 更新時刻(last_write_time()と同じ値にする)
+int64_t toFileTime(int64_t sec, int64_t nsec)
+{
+    using namespace std::chrono;
+    auto sys = system_clock::time_point{duration_cast<system_clock::duration>(seconds{sec}) +
+                                        duration_cast<system_clock::duration>(nanoseconds{nsec})};
+    return duration_cast<seconds>(file_clock::from_sys(sys).time_since_epoch()).count();
+}
+
+//
+// ディレクトリ情報
+// 公開したものは変更せず、編集するときは親までの経路を複製する(変更のない部分木は共有したまま)
+//
+struct DirInfo
+{
+    using Ptr = std::shared_ptr<DirInfo>;
+    FilePath path_;
+    uint32_t count_;
+    std::list<Ptr> children_;
+    uint64_t owner_{0};                               // 編集してよい版(dirVersionと違えば公開済み)
+    mutable std::shared_ptr<const std::string> json_; // 部分木の/dirのJSON(初めて求めたとき作る)
+};
+using DirMap = std::unordered_map<std::string, DirInfo::Ptr>; // パス -> ディレクトリ情報
+
+//
+// インデックス
+// 書き込み(走査、監視、update指定)はindexMutexで排他して編集用を変更し、
+// 読み込みは公開されたスナップショットをロックなしで参照する
+//
+FileTrie fileList;                  // 編集用
+DirInfo::Ptr currentDir;            // 編集用
+DirMap dirIndex;                    // 編集用
+uint64_t dirVersion = 1;            // 編集中のディレクトリ情報の版(公開する度に進める)
+std::mutex indexMutex;              // 書き込み側の排他
+std::atomic<bool> liveIndex{false}; // 監視中ならリクエスト時のstatは不要
+
+//
+// 変更履歴(世代番号順に並べた全ファイル)
+//
+class ChangeJournal
+{
+  public:
+    // ジャーナルに記録されていた状態
+    struct Known
+    {
+        uint64_t gen_;
+        size_t size_;
+        int64_t time_;
+        bool delete_;
+    };
+    using KnownMap = std::unordered_map<std::string, Known>;
+
+  private:
+    std::mutex mutex_;
+    uint64_t generation_{0};
+    std::string epoch_;
+    bool loaded_{false}; // ジャーナルからエポックを読んだ
+    std::map<uint64_t, FileInfoPtr> changes_;
+    std::ofstream file_;
+
+    void writeEntry(const FileInfo &finfo)
+    {
+        file_ << finfo.gen_ << '\t' << finfo.delete_ << '\t' << finfo.size_ << '\t' << finfo.time_
+              << '\t' << finfo.key_.string() << '\n';
+    }
+
+  public:
+    ChangeJournal()
+    {
+        // ジャーナルがなければ起動毎に別のエポック
+        epoch_ = std::to_string(std::chrono::system_clock::now().time_since_epoch().count()) + "-" +
+                 std::to_string(std::random_device{}());
+    }
+
+    // 前回までのジャーナル読み込み
+    KnownMap load(const FilePath &path)
+    {
+        KnownMap known;
+        std::ifstream inFile{path};
+        std::string line;
+        if (!inFile || !std::getline(inFile, line) || line.rfind("epoch\t", 0) != 0)
+        {
+            return known;
+        }
+        epoch_  = line.substr(6);
+        loaded_ = true;
+        while (std::getline(inFile, line))
+        {
+            std::istringstream fields{line};
+            Known k;
+            std::string key;
+            if (fields >> k.gen_ >> k.delete_ >> k.size_ >> k.time_ && fields.get() == '\t' &&
+                std::getline(fields, key))
+            {
+                known[key]  = k;
+                generation_ = std::max(generation_, k.gen_);
+            }
+        }
+        printVerbose("journal loaded: ", known.size(), " entries, generation=", generation_);
+        return known;
+    }
+
+    // 現在の状態でジャーナルを書き直して追記モードで開く
+    bool rewrite(const FilePath &path)
+    {
+        std::lock_guard lock{mutex_};
+        file_.open(path, std::ios::trunc);
+        if (!file_)
+        {
+            std::cerr << "journal open failed: " << path << std::endl;
+            return false;
+        }
+        file_ << "epoch\t" << epoch_ << '\n';
+        for (auto &c : changes_)
+        {
+            writeEntry(*c.second);
+        }
+        file_.flush();
+        return true;
+    }
+
+    // 既存の世代のまま登録
+    void record(const FileInfoPtr &finfo)
+    {
+        std::lock_guard lock{mutex_};
+        changes_[finfo->gen_] = finfo;
+    }
+
+    // 変更があったので新しい世代で登録(prevは差し替えられる前の情報)
+    void stamp(const std::shared_ptr<FileInfo> &finfo, const FileInfoPtr &prev = nullptr)
+    {
+        std::lock_guard lock{mutex_};
+        if (prev)
+        {
+            auto it = changes_.find(prev->gen_);
+            if (it != changes_.end() && it->second == prev)
+            {
+                changes_.erase(it);
+            }
+        }
+        finfo->gen_           = ++generation_;
+        changes_[finfo->gen_] = finfo;
+        if (file_.is_open())
+        {
+            writeEntry(*finfo);
+            file_.flush();
+        }
+    }
+
+    // 指定世代より後に変更されたもの
+    std::list<FileInfoPtr> since(uint64_t gen, const std::string &prefix)
+    {
+        std::lock_guard lock{mutex_};
+        std::list<FileInfoPtr> result;
+        for (auto it = changes_.upper_bound(gen); it != changes_.end(); ++it)
+        {
+            if (it->second->key_.string().rfind(prefix, 0) == 0)
+            {
+                result.push_back(it->second);
+            }
+        }
+        return result;
+    }
+
+    // スナップショットのエポックと世代を引き継ぐ(ジャーナルと食い違っていればfalse)
+    bool adopt(const std::string &epoch, uint64_t generation)
+    {
+        std::lock_guard lock{mutex_};
+        if (loaded_ && epoch != epoch_)
+        {
+            return false;
+        }
+        epoch_      = epoch;
+        generation_ = std::max(generation_, generation);
+        return true;
+    }
+
+    //
+    uint64_t generation()
+    {
+        std::lock_guard lock{mutex_};
+        return generation_;
+    }
+    const std::string &epoch() const { return epoch_; }
+};
+ChangeJournal journal;
+
+//
+// /dirのJSON
+// 部分木毎に作ったものを公開済みのディレクトリ情報に持たせ、共有している部分木では使い回す
+//
+
+std::shared_ptr<const std::string> dirJson(const DirInfo &dir);
+
+// ディレクトリのJSONを追加(depthは含める子の深さ、負なら全部で部分木毎のものを使う)
+void appendDirJson(std::string &out, const DirInfo &dir, int depth)
+{
+    out += '{';
+    if (depth != 0 && !dir.children_.empty())
+    {
+        out += "\"Children\":[";
+        for (auto &c : dir.children_)
+        {
+            if (c != dir.children_.front())
+            {
+                out += ',';
+            }
+            if (depth < 0)
+            {
+                out += *dirJson(*c);
+            }
+            else
+            {
+                appendDirJson(out, *c, depth - 1);
+            }
+        }
+        out += "],";
+    }
+    out += "\"Count\":";
+    out += std::to_string(dir.count_);
+    out += ",\"Name\":";
+    out += nlohmann::json(dir.path_).dump();
+    out += '}';
+}
+
+// 公開済みの部分木のJSON(なければ作って覚える、同時に作っても同じものになる)
+std::shared_ptr<const std::string> dirJson(const DirInfo &dir)
+{
+    auto json = std::atomic_load(&dir.json_);
+    if (!json)
+    {
+        std::string out;
+        appendDirJson(out, dir, -1);
+        json = std::make_shared<const std::string>(std::move(out));
+        std::atomic_store(&dir.json_, json);
+    }
+    return json;
+}
+
+// /dirの応答(ディレクトリが変わらなければ次に公開したインデックスでも使い回す)
+class DirResponse
+{
+    std::mutex mutex_;
+    std::map<Encoding, std::shared_ptr<const std::string>> encoded_; // 求められた方式のみ
+
+  public:
+    std::shared_ptr<const std::string> body_;
+    std::string etag_;
+
+    explicit DirResponse(std::string body)
+    {
+        XxHash64 xxh;
+        xxh.update(body.data(), body.size());
+        etag_ = "\"" + toHexString(xxh.digest()) + "\"";
+        body_ = std::make_shared<const std::string>(std::move(body));
+    }
+
+    // 圧縮した本体(一度圧縮したものは覚えておく、圧縮できなければnullptr)
+    std::shared_ptr<const std::string> encoded(Encoding enc)
+    {
+        std::lock_guard lock{mutex_};
+        auto &slot = encoded_[enc];
+        if (!slot)
+        {
+            std::string out;
+            if (!compressString(enc, *body_, out))
+            {
+                return nullptr;
+            }
+            slot = std::make_shared<const std::string>(std::move(out));
+        }
+        return slot;
+    }
+};
+
+// 部分木の応答
+std::shared_ptr<DirResponse> makeDirResponse(const DirInfo &dir, int depth)
+{
+    std::string body = "{\"Dir\":";
+    if (depth < 0)
+    {
+        body += *dirJson(dir);
+    }
+    else
+    {
+        appendDirJson(body, dir, depth);
+    }
+    body += '}';
+    return std::make_shared<DirResponse>(std::move(body));
+}
+
+// 公開用の複製(変更しない、編集用とは変更のない部分を共有する)
+struct IndexSnapshot
+{
+    explicit IndexSnapshot(FileTrie files) : files_(std::move(files)) {}
+    FileTrie files_;
+    DirInfo::Ptr root_;
+    mutable std::shared_ptr<DirResponse> dir_; // ルートの/dirの応答(初めて求めたとき作る)
+    uint64_t generation_{0};                   // 公開した時点の世代
+    uint64_t version_{0};                      // 公開した回数
+
+    // ルートの/dirの応答
+    std::shared_ptr<DirResponse> rootDir() const
+    {
+        auto response = std::atomic_load(&dir_);
+        if (!response)
+        {
+            response = makeDirResponse(*root_, -1);
+            std::atomic_store(&dir_, response);
+        }
+        return response;
+    }
+};
+using IndexPtr = std::shared_ptr<const IndexSnapshot>;
+IndexPtr publishedIndex;
+uint64_t publishCount = 0; // indexMutexで排他
+
+// 公開中のインデックス
+IndexPtr loadIndex() { return std::atomic_load(&publishedIndex); }
+
+// 編集結果を公開(indexMutexを持って呼ぶ)
+// 変更のあったトライの部分とディレクトリの経路以外は前回と共有する
+void publishIndex()
+{
+    auto index = std::make_shared<IndexSnapshot>(fileList.snapshot());
+    if (currentDir)
+    {
+        index->root_ = currentDir;
+        if (auto prev = loadIndex(); prev && prev->root_ == currentDir)
+        {
+            index->dir_ = std::atomic_load(&prev->dir_);
+        }
+        dirVersion++;
+    }
+    index->generation_ = journal.generation();
+    index->version_    = ++publishCount;
+    std::atomic_store(&publishedIndex, IndexPtr{std::move(index)});
+}
+
+//
+// 内容のハッシュ(バックグラウンドで求めてインデックスに反映する)
+// inode、サイズ、更新時刻が前回と同じならキャッシュした値を使う
+//
+class HashService
+{
+    struct Cached
+    {
+        uint64_t inode_{0};
+        size_t size_{0};
+        int64_t time_{0};
+        ContentHash hash_;
+    };
+    using Clock = std::chrono::steady_clock;
+
+    bool enabled_{false};
+    bool sha256_{false};
+
+    std::mutex mutex_; // 以下の排他
+    std::condition_variable cond_;
+    std::deque<std::string> queue_;
+    std::unordered_map<std::string, bool> pending_; // キー -> キャッシュを使わない
+    std::unordered_map<std::string, Cached> cache_;
+    std::ofstream cacheFile_;
+
+    // indexMutexで排他
+    Clock::time_point published_;
+    bool unpublished_{false};
+
+    //
+    void writeEntry(const std::string &key, const Cached &c)
+    {
+        auto &sha = c.hash_.sha256_;
+        cacheFile_ << c.inode_ << '\t' << c.size_ << '\t' << c.time_ << '\t' << c.hash_.hash_
+                   << '\t' << (sha.empty() ? "-" : sha) << '\t' << key << '\n';
+    }
+
+    // ファイルの属性
+    static bool statFile(const FilePath &path, Cached &c)
+    {
+#if _WIN32
+        using namespace std::chrono;
+        std::error_code ec;
+        c.inode_   = 0;
+        c.size_    = std::filesystem::file_size(path, ec);
+        auto wtime = std::filesystem::last_write_time(path, ec).time_since_epoch();
+        c.time_    = duration_cast<seconds>(wtime).count();
+        return !ec;
+#else
+        struct stat st;
+        if (::stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+        {
+            return false;
+        }
+        c.inode_ = st.st_ino;
+        c.size_  = st.st_size;
+#if __APPLE__
+        c.time_ = toFileTime(st.st_mtimespec.tv_sec, st.st_mtimespec.tv_nsec);
+#else
+        c.time_ = toFileTime(st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+#endif
+        return true;
+#endif
+    }
+
+    // 求めたハッシュをインデックスに反映
+    void apply(const std::string &key, const Cached &c)
+    {
+        std::lock_guard lock{indexMutex};
+        auto current = fileList.search(key);
+        if (!current || (*current)->delete_ || (*current)->size_ != c.size_ ||
+            (*current)->time_ != c.time_)
+        {
+            // 求めている間に変わった(変更の通知で改めて求める)
+            return;
+        }
+        auto &prev = *current;
+        if (prev->hash_ == c.hash_.hash_ && prev->sha256_ == c.hash_.sha256_)
+        {
+            return;
+        }
+        auto fresh     = std::make_shared<FileInfo>(*prev);
+        fresh->hash_   = c.hash_.hash_;
+        fresh->sha256_ = c.hash_.sha256_;
+        if (!prev->hash_.empty() && prev->hash_ != fresh->hash_)
+        {
+            // サイズも時刻も同じまま中身だけ変わった
+            printVerbose("content changed: ", key);
+        }
+        // 初めて求めたハッシュも新しい世代にしないとsince指定のクライアントに届かない
+        journal.stamp(fresh, prev);
+        fileList.insert(key, fresh);
+        unpublished_ = true;
+    }
+
+    // 手が空いたか、前回から時間がたっていれば公開
+    void publish(bool idle)
+    {
+        std::lock_guard lock{indexMutex};
+        auto now = Clock::now();
+        if (unpublished_ && (idle || now - published_ >= std::chrono::seconds{1}))
+        {
+            publishIndex();
+            unpublished_ = false;
+            published_   = now;
+        }
+    }
+
+    //
+    void process(const std::string &key, bool force)
+    {
+        FilePath path;
+        {
+            std::lock_guard lock{indexMutex};
+            auto finfo = fileList.search(key);
+            if (!finfo || (*finfo)->delete_)
+            {
+                return;
+            }
+            path = (*finfo)->path_;
+        }
+
+        Cached c;
+        if (!statFile(path, c))
+        {
+            return;
+        }
+        bool cached = false;
+        if (!force)
+        {
+            std::lock_guard lock{mutex_};
+            auto it = cache_.find(key);
+            if (it != cache_.end() && it->second.inode_ == c.inode_ &&
+                it->second.size_ == c.size_ && it->second.time_ == c.time_ &&
+                (!sha256_ || !it->second.hash_.sha256_.empty()))
+            {
+                c.hash_ = it->second.hash_;
+                cached  = true;
+            }
+        }
+        if (!cached)
+        {
+            Cached after;
+            if (!hashFile(path.string(), sha256_, c.hash_) || !statFile(path, after) ||
+                after.size_ != c.size_ || after.time_ != c.time_)
+            {
+                // 書き込み中
+                return;
+            }
+            std::lock_guard lock{mutex_};
+            cache_[key] = c;
+            if (cacheFile_.is_open())
+            {
+                writeEntry(key, c);
+            }
+        }
+        apply(key, c);
+    }
+
+    //
+    void run()
+    {
+        for (;;)
+        {
+            std::string key;
+            bool force;
+            {
+                std::unique_lock lock{mutex_};
+                cond_.wait(lock, [this] { return !queue_.empty(); });
+                key = std::move(queue_.front());
+                queue_.pop_front();
+                auto it = pending_.find(key);
+                force   = it->second;
+                pending_.erase(it);
+            }
+            try
+            {
+                process(key, force);
+            }
+            catch (std::exception &exp)
+            {
+                std::cerr << exp.what() << std::endl;
+            }
+            bool idle;
+            {
+                std::lock_guard lock{mutex_};
+                idle = queue_.empty();
+                if (idle && cacheFile_.is_open())
+                {
+                    cacheFile_.flush();
+                }
+            }
+            publish(idle);
+        }
+    }
+
+  public:
+    // キャッシュを読み込んで開始(インデックスができてから呼ぶ)
+    void start(size_t threads, bool sha256, const std::optional<FilePath> &cachePath)
+    {
+        enabled_ = true;
+        sha256_  = sha256;
+        if (cachePath)
+        {
+            std::ifstream inFile{*cachePath};
+            std::string line;
+            while (std::getline(inFile, line))
+            {
+                std::istringstream fields{line};
+                Cached c;
+                std::string sha, key;
+                if (fields >> c.inode_ >> c.size_ >> c.time_ >> c.hash_.hash_ >> sha &&
+                    fields.get() == '\t' && std::getline(fields, key))
+                {
+                    c.hash_.sha256_ = sha == "-" ? "" : sha;
+                    cache_[key]     = c;
+                }
+            }
+            inFile.close();
+
+            // 今あるファイルの分だけ書き直す
+            std::erase_if(cache_, [](const auto &c) { return !fileList.search(c.first); });
+            cacheFile_.open(*cachePath, std::ios::trunc);
+            if (!cacheFile_)
+            {
+                std::cerr << "hash cache open failed: " << *cachePath << std::endl;
+            }
+            for (auto &c : cache_)
+            {
+                writeEntry(c.first, c.second);
+            }
+            cacheFile_.flush();
+            printVerbose("hash cache: ", cache_.size(), " entries");
+        }
+        for (size_t i = 0; i < std::max<size_t>(threads, 1); i++)
+        {
+            std::thread{[this] { run(); }}.detach();
+        }
+    }
+
+    // ハッシュを求める(forceならキャッシュを使わない)
+    void request(const std::string &key, bool force = false)
+    {
+        if (!enabled_)
+        {
+            return;
+        }
+        std::lock_guard lock{mutex_};
+        auto [it, added] = pending_.emplace(key, force);
+        if (added)
+        {
+            queue_.push_back(key);
+            cond_.notify_one();
+        }
+        else
+        {
+            it->second = it->second || force;
+        }
+    }
+
+    // ハッシュが求まっていないものをすべて(indexMutexを持って呼ぶ)
+    void requestMissing()
+    {
+        if (!enabled_)
+        {
+            return;
+        }
+        auto missing = [this](const FileInfoPtr &finfo)
+        {
+            if (!finfo->delete_ && (finfo->hash_.empty() || (sha256_ && finfo->sha256_.empty())))
+            {
+                request(finfo->key_.string());
+            }
+        };
+        fileList.forEachWithPrefix("", missing);
+    }
+};
+HashService hashService;
+
+// 最新のファイル情報(変更がなければnullptr)
+std::shared_ptr<FileInfo> refreshFileInfo(const FileInfo &finfo)
+{
+    auto fresh  = std::make_shared<FileInfo>(finfo);
+    auto &fname = finfo.path_;
+    if (std::filesystem::exists(fname))
+    {
+        using namespace std::chrono;
+        auto lct       = std::filesystem::last_write_time(fname);
+        auto epl       = lct.time_since_epoch();
+        auto sec       = duration_cast<seconds>(epl);
+        fresh->time_   = sec.count();
+        fresh->size_   = std::filesystem::file_size(fname);
+        fresh->delete_ = false;
+    }
+    else
+    {
+        // 消えた…
+        fresh->size_   = 0;
+        fresh->time_   = 0;
+        fresh->delete_ = true;
+    }
+    if (fresh->size_ == finfo.size_ && fresh->time_ == finfo.time_ &&
+        fresh->delete_ == finfo.delete_)
+    {
+        return nullptr;
+    }
+    return fresh;
+}
+
+// 情報を更新して変更があれば新しい世代で差し替える(indexMutexを持って呼ぶ)
+FileInfoPtr updateFileInfo(const FileInfoPtr &finfo)
+{
+    auto key     = finfo->key_.string();
+    auto current = fileList.search(key).value_or(finfo);
+    auto fresh   = refreshFileInfo(*current);
+    if (!fresh)
+    {
+        return current;
+    }
+    fresh->hash_.clear();
+    fresh->sha256_.clear();
+    journal.stamp(fresh, current);
+    fileList.insert(key, fresh);
+    hashService.request(key);
+    return fresh;
+}
+
+//
+// 転送時の圧縮(Accept-Encodingでzstdかgzip)
+//
+constexpr size_t MinCompressSize = 1024; // これより小さいものは圧縮しない
+constexpr size_t CompressChunk   = 256 * 1024;
+
+bool compressEnabled = false;
+
+// 圧縮済みの形式は対象外
+bool isCompressible(const FilePath &path, size_t size)
+{
+    static const char *const skipExt[] = {
+        ".gz",   ".tgz",  ".zst",  ".xz",   ".bz2",  ".lz4",  ".br",    ".zip",
+        ".7z",   ".rar",  ".jar",  ".png",  ".jpg",  ".jpeg", ".gif",   ".webp",
+        ".avif", ".heic", ".ktx2", ".mp3",  ".ogg",  ".opus", ".aac",   ".m4a",
+        ".mp4",  ".m4v",  ".mov",  ".webm", ".mkv",  ".woff", ".woff2", ".basis",
+    };
+    if (size < MinCompressSize)
+    {
+        return false;
+    }
+    auto ext = path.extension().string();
+    std::transform(ext.begin(), ext.end(), ext.begin(),
+                   [](unsigned char c) { return std::tolower(c); });
+    return std::none_of(std::begin(skipExt), std::end(skipExt),
+                        [&](const char *e) { return ext == e; });
+}
+
+// 使える圧縮方式(無効、Range指定あり、クライアントが受け付けなければIdentity)
+Encoding acceptedEncoding(const httplib::Request &req)
+{
+    if (!compressEnabled || req.has_header("Range"))
+    {
+        return Encoding::Identity;
+    }
+    return chooseEncoding(req.get_header_value("Accept-Encoding"));
+}
+
+// 圧縮しながら少しずつ送る(Identityならそのまま)
+class EncodedWriter
+{
+    std::unique_ptr<Compressor> comp_;
+    std::string out_;
+
+  public:
+    EncodedWriter(Encoding enc, httplib::Response &res)
+    {
+        if (enc != Encoding::Identity)
+        {
+            comp_ = std::make_unique<Compressor>(enc);
+            res.set_header("Content-Encoding", encodingName(enc));
+            res.set_header("Vary", "Accept-Encoding");
+        }
+    }
+
+    // 圧縮する場合は相手がここまで展開できるようにflushする(lastで終端)
+    bool write(httplib::DataSink &sink, const std::string &data, bool last)
+    {
+        if (!comp_)
+        {
+            serverMetrics.streamed(data.size());
+            return sink.write(data.data(), data.size());
+        }
+        out_.clear();
+        if (!comp_->compress(data.data(), data.size(), last, out_))
+        {
+            return false;
+        }
+        serverMetrics.streamed(out_.size());
+        return sink.write(out_.data(), out_.size());
+    }
+};
+
+// 拡張子からContent-Type(主なものだけ)
+const char *contentTypeOf(const FilePath &path)
+{
+    static const std::unordered_map<std::string, const char *> types{
+        {".txt", "text/plain"},        {".html", "text/html"},
+        {".css", "text/css"},          {".js", "text/javascript"},
+        {".json", "application/json"}, {".xml", "application/xml"},
+        {".csv", "text/csv"},          {".svg", "image/svg+xml"},
+        {".wasm", "application/wasm"}, {".pdf", "application/pdf"},
+    };
+    auto it = types.find(path.extension().string());
+    return it != types.end() ? it->second : "application/octet-stream";
+}
+
+//
+// 圧縮したファイルのキャッシュ(LRUで容量を超えたら古いものから消す)
+// パス、サイズ、更新時刻、方式をキーにするので、更新されたファイルは別の項目になる
+//
+class CompressCache
+{
+    struct Entry
+    {
+        std::string name_;
+        size_t size_;
+    };
+
+    FilePath dir_;
+    size_t capacity_{0};
+
+    std::mutex mutex_; // 以下の排他
+    size_t total_{0};
+    std::list<Entry> lru_; // 先頭が最近使ったもの
+    std::unordered_map<std::string, std::list<Entry>::iterator> entries_;
+    std::unordered_set<std::string> working_;        // 圧縮中
+    std::unordered_set<std::string> incompressible_; // 圧縮しても小さくならなかった
+
+    // 容量を超えた分を消す(mutex_を持って呼ぶ)
+    void evict()
+    {
+        while (total_ > capacity_ && !lru_.empty())
+        {
+            auto &e = lru_.back();
+            std::error_code ec;
+            std::filesystem::remove(dir_ / e.name_, ec);
+            printVerbose("compress cache evict: ", e.name_);
+            total_ -= e.size_;
+            entries_.erase(e.name_);
+            lru_.pop_back();
+        }
+    }
+
+    // ファイルを圧縮して書き出す(圧縮後のサイズ、失敗したら0)
+    static size_t compressFile(const FilePath &source, Encoding enc, const FilePath &dest)
+    {
+        std::ifstream inFile{source, std::ios::binary};
+        std::ofstream outFile{dest, std::ios::binary | std::ios::trunc};
+        if (!inFile || !outFile)
+        {
+            return 0;
+        }
+        Compressor comp{enc};
+        std::vector<char> buffer(CompressChunk);
+        std::string out;
+        size_t total = 0;
+        for (;;)
+        {
+            inFile.read(buffer.data(), buffer.size());
+            auto len  = static_cast<size_t>(inFile.gcount());
+            bool last = !inFile;
+            out.clear();
+            if (!comp.compress(buffer.data(), len, last, out))
+            {
+                return 0;
+            }
+            outFile.write(out.data(), out.size());
+            total += out.size();
+            if (last)
+            {
+                break;
+            }
+        }
+        return inFile.eof() && outFile ? total : 0;
+    }
+
+  public:
+    enum class Result
+    {
+        Hit,            // resultに圧縮済みファイル
+        Incompressible, // 圧縮せずに送る
+        Busy,           // 他で圧縮中(その場で圧縮して送る)
+    };
+
+    bool enabled() const { return capacity_ > 0; }
+
+    // 前回までのキャッシュを拾う
+    bool open(const FilePath &dir, size_t capacity)
+    {
+        std::error_code ec;
+        std::filesystem::create_directories(dir, ec);
+        if (!std::filesystem::is_directory(dir))
+        {
+            std::cerr << "compress cache open failed: " << dir << std::endl;
+            return false;
+        }
+        dir_      = dir;
+        capacity_ = capacity;
+
+        std::vector<std::pair<std::filesystem::file_time_type, Entry>> found;
+        for (auto &entry : std::filesystem::directory_iterator{dir, ec})
+        {
+            auto name = entry.path().filename().string();
+            if (!entry.is_regular_file())
+            {
+                continue;
+            }
+            if (entry.path().extension() == ".tmp")
+            {
+                // 書き出し途中で止まったもの
+                std::filesystem::remove(entry.path(), ec);
+                continue;
+            }
+            found.push_back({entry.last_write_time(ec), Entry{name, entry.file_size(ec)}});
+        }
+        std::sort(found.begin(), found.end(),
+                  [](auto &a, auto &b) { return a.first > b.first; });
+        std::lock_guard lock{mutex_};
+        for (auto &f : found)
+        {
+            total_ += f.second.size_;
+            lru_.push_back(f.second);
+            entries_[lru_.back().name_] = std::prev(lru_.end());
+        }
+        evict();
+        printVerbose("compress cache: ", lru_.size(), " entries, ", total_, " bytes");
+        return true;
+    }
+
+    // 圧縮済みファイルを取得(なければここで圧縮する)
+    Result get(const std::string &key, const FilePath &source, size_t size, int64_t mtime,
+               Encoding enc, FilePath &result)
+    {
+        std::ostringstream id;
+        id << key << '\n' << size << '\n' << mtime << '\n' << encodingName(enc);
+        XxHash64 xxh;
+        auto idStr = id.str();
+        xxh.update(idStr.data(), idStr.size());
+        auto name = toHexString(xxh.digest()) + (enc == Encoding::Zstd ? ".zst" : ".gz");
+        {
+            std::lock_guard lock{mutex_};
+            if (auto it = entries_.find(name); it != entries_.end())
+            {
+                lru_.splice(lru_.begin(), lru_, it->second);
+                result = dir_ / name;
+                return Result::Hit;
+            }
+            if (incompressible_.count(name))
+            {
+                return Result::Incompressible;
+            }
+            if (!working_.insert(name).second)
+            {
+                return Result::Busy;
+            }
+        }
+
+        auto tmpPath = dir_ / (name + ".tmp");
+        auto csize   = compressFile(source, enc, tmpPath);
+        std::error_code ec;
+        bool effective = csize > 0 && csize < size - size / 10;
+        if (effective)
+        {
+            std::filesystem::rename(tmpPath, dir_ / name, ec);
+        }
+        if (!effective || ec)
+        {
+            std::filesystem::remove(tmpPath, ec);
+        }
+
+        std::lock_guard lock{mutex_};
+        working_.erase(name);
+        if (!effective)
+        {
+            // 1割も縮まないものは覚えておいてそのまま送る
+            if (incompressible_.size() >= 65536)
+            {
+                incompressible_.clear();
+            }
+            if (csize > 0)
+            {
+                incompressible_.insert(name);
+            }
+            return Result::Incompressible;
+        }
+        if (ec)
+        {
+            return Result::Busy;
+        }
+        lru_.push_front(Entry{name, csize});
+        entries_[name] = lru_.begin();
+        total_ += csize;
+        evict();
+        if (entries_.count(name) == 0)
+        {
+            // 容量より大きかった
+            return Result::Busy;
+        }
+        printVerbose("compressed: ", key, " ", size, " -> ", csize);
+        result = dir_ / name;
+        return Result::Hit;
+    }
+};
+CompressCache compressCache;
+
+// 圧縮して返す(圧縮が効かないものはfalse)
+bool repliesCompressedFile(const FilePath &relPath, const FilePath &fname, size_t size,
+                           int64_t mtime, Encoding enc, httplib::Response &res)
+{
+    auto type = contentTypeOf(fname);
+    std::error_code ec;
+    if (compressCache.enabled())
+    {
+        FilePath cached;
+        auto r = compressCache.get(relPath.generic_string(), fname, size, mtime, enc, cached);
+        if (r == CompressCache::Result::Incompressible)
+        {
+            return false;
+        }
+        auto inFile  = std::make_shared<std::ifstream>();
+        size_t csize = 0;
+        if (r == CompressCache::Result::Hit)
+        {
+            inFile->open(cached, std::ios::binary);
+            csize = std::filesystem::file_size(cached, ec);
+        }
+        if (inFile->is_open() && *inFile && !ec)
+        {
+            // 開いてしまえば追い出されても読める(Windowsでは削除に失敗して残る)
+            res.set_header("Content-Encoding", encodingName(enc));
+            res.set_header("Vary", "Accept-Encoding");
+            res.set_content_provider(
+                csize, type,
+                [inFile](size_t offset, size_t length, httplib::DataSink &sink)
+                {
+                    std::vector<char> buffer(std::min(length, CompressChunk));
+                    inFile->seekg(offset);
+                    inFile->read(buffer.data(), buffer.size());
+                    auto len = static_cast<size_t>(inFile->gcount());
+                    return len > 0 && sink.write(buffer.data(), len);
+                });
+            return true;
+        }
+    }
+
+    // その場で圧縮しながら送る
+    struct StreamState
+    {
+        std::ifstream inFile_;
+        Compressor comp_;
+        std::vector<char> buffer_;
+        std::string out_;
+        StreamState(const FilePath &path, Encoding enc)
+            : inFile_(path, std::ios::binary), comp_(enc), buffer_(CompressChunk)
+        {
+        }
+    };
+    auto state = std::make_shared<StreamState>(fname, enc);
+    if (!state->inFile_)
+    {
+        return false;
+    }
+    res.set_header("Content-Encoding", encodingName(enc));
+    res.set_header("Vary", "Accept-Encoding");
+    res.set_chunked_content_provider(
+        type,
+        [state](size_t /*offset*/, httplib::DataSink &sink)
+        {
+            auto &inFile = state->inFile_;
+            inFile.read(state->buffer_.data(), state->buffer_.size());
+            auto len  = static_cast<size_t>(inFile.gcount());
+            bool last = !inFile;
+            state->out_.clear();
+            if (!state->comp_.compress(state->buffer_.data(), len, last, state->out_))
+            {
+                return false;
+            }
+            serverMetrics.streamed(state->out_.size());
+            if (!sink.write(state->out_.data(), state->out_.size()))
+            {
+                return false;
+            }
+            if (last)
+            {
+                sink.done();
+            }
+            return true;
+        });
+    return true;
+}
+
+//
+// ファイル配信
+// マップしたページキャッシュから直接ソケットに書き出す(ユーザー空間のバッファを経由しない)
+// 平文のときのみ使う。送信中にファイルが切り詰められてもsend()がEFAULTになって切断されるだけだが、
+// SSLでは暗号化でページに触れるのでSIGBUSになりうる
+//
+bool mappedFiles = false;
+
+constexpr size_t MappedWriteSize = 4 * 1024 * 1024; // 1回に書き出す上限
+
+// マップしたファイル(送り終わるまで保持する)
+class MappedFile
+{
+    const char *data_{nullptr};
+    size_t size_{0};
+
+  public:
+    MappedFile() = default;
+    ~MappedFile()
+    {
+#if !_WIN32
+        if (data_)
+        {
+            ::munmap(const_cast<char *>(data_), size_);
+        }
+#endif
+    }
+    MappedFile(const MappedFile &)            = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    // 開けなければnullptr
+    static std::shared_ptr<MappedFile> open(const FilePath &path)
+    {
+#if _WIN32
+        return nullptr;
+#else
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            return nullptr;
+        }
+        std::shared_ptr<MappedFile> mapped;
+        struct stat st;
+        if (::fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+        {
+            auto len = static_cast<size_t>(st.st_size);
+            void *addr =
+                len > 0 ? ::mmap(nullptr, len, PROT_READ, MAP_SHARED, fd, 0) : nullptr;
+            if (addr != MAP_FAILED)
+            {
+                if (addr)
+                {
+                    ::madvise(addr, len, MADV_SEQUENTIAL);
+                }
+                mapped        = std::make_shared<MappedFile>();
+                mapped->data_ = static_cast<const char *>(addr);
+                mapped->size_ = len;
+            }
+        }
+        ::close(fd);
+        return mapped;
+#endif
+    }
+
+    const char *data() const { return data_; }
+    size_t size() const { return size_; }
+};
+
+// マウントポイント以下の相対パス(外を指していればnullopt)
+std::optional<FilePath> mountedPath(const std::string &reqPath, const std::string &mountPoint)
+{
+    if (reqPath.size() <= mountPoint.size() + 1 ||
+        reqPath.compare(0, mountPoint.size(), mountPoint) != 0 || reqPath[mountPoint.size()] != '/')
+    {
+        return std::nullopt;
+    }
+    FilePath relPath{reqPath.substr(mountPoint.size() + 1)};
+    if (relPath.empty() || relPath.has_root_path())
+    {
+        return std::nullopt;
+    }
+    for (auto &part : relPath)
+    {
+        if (part == "..")
+        {
+            return std::nullopt;
+        }
+    }
+    return relPath;
+}
+
+// ファイルの版(サイズと更新時刻から作る、/blocksのETagとIf-Rangeで使う)
+std::string fileETag(uintmax_t size, int64_t mtime)
+{
+    return "\"" + toHexString(size) + "-" + toHexString(static_cast<uint64_t>(mtime)) + "\"";
+}
+
+// マウントポイントより先に呼ばれ、扱わないもの(ディレクトリなど)は通常の配信に任せる
+// Rangeはhttplibがcontent providerの範囲に変換する
+// If-Range(ETagのみ)が今の版と違えば、古い範囲と混ぜると壊れるので412で断って取り直させる
+httplib::Server::HandlerResponse repliesFile(const httplib::Request &req, httplib::Response &res,
+                                             const std::string &mountPoint, const FilePath &baseDir)
+{
+    using HandlerResponse = httplib::Server::HandlerResponse;
+    if (req.method != "GET" && req.method != "HEAD")
+    {
+        return HandlerResponse::Unhandled;
+    }
+    auto relPath = mountedPath(req.path, mountPoint);
+    if (!relPath)
+    {
+        return HandlerResponse::Unhandled;
+    }
+    auto fname = baseDir / *relPath;
+    std::error_code ec;
+    if (!std::filesystem::is_regular_file(fname, ec))
+    {
+        return HandlerResponse::Unhandled;
+    }
+    auto size  = std::filesystem::file_size(fname, ec);
+    auto mtime = std::filesystem::last_write_time(fname, ec).time_since_epoch().count();
+    if (ec)
+    {
+        return HandlerResponse::Unhandled;
+    }
+    auto etag    = fileETag(size, mtime);
+    auto ifRange = req.get_header_value("If-Range");
+    if (req.has_header("Range") && ifRange.starts_with('"') && ifRange != etag)
+    {
+        res.status = 412;
+        return HandlerResponse::Handled;
+    }
+
+    auto enc = acceptedEncoding(req);
+    if (req.method == "GET" && enc != Encoding::Identity && isCompressible(fname, size) &&
+        repliesCompressedFile(*relPath, fname, size, mtime, enc, res))
+    {
+        return HandlerResponse::Handled;
+    }
+    if (!mappedFiles)
+    {
+        return HandlerResponse::Unhandled;
+    }
+    auto mapped = MappedFile::open(fname);
+    if (!mapped)
+    {
+        return HandlerResponse::Unhandled;
+    }
+    if (mapped->size() == 0)
+    {
+        res.set_content("", contentTypeOf(fname));
+        return HandlerResponse::Handled;
+    }
+    res.set_header("ETag", etag);
+    res.set_content_provider(mapped->size(), contentTypeOf(fname),
+                             [mapped](size_t offset, size_t length, httplib::DataSink &sink)
+                             {
+                                 auto len = std::min(length, MappedWriteSize);
+                                 return offset + len <= mapped->size() &&
+                                        sink.write(mapped->data() + offset, len);
+                             });
+    return HandlerResponse::Handled;
+}
+
+// リストの出どころ(スナップショットのカーソルか変更履歴)
+// スナップショットを持っている間はカーソルが無効にならない
+struct ListSource
+{
+    IndexPtr index_;
+    FileCursor cursor_;
+    std::list<FileInfoPtr> changes_;
+    std::list<FileInfoPtr>::iterator it_;
+    bool fromChanges_{false};
+
+    // 次の要素(終わりならnullptr)
+    const FileInfoPtr *next()
+    {
+        if (!fromChanges_)
+        {
+            return cursor_.next();
+        }
+        return it_ != changes_.end() ? &*it_++ : nullptr;
+    }
+};
+
+//
+// /listの絞り込みとページ分け
+// limitを指定すると1ページ分を返し、続きがあればX-Fsrv-Next(JSONではNext)にトークンを付ける
+// トークンは最後に辿った位置(キー、変更履歴なら世代)なので、インデックスが更新されても続きから辿れる
+//
+constexpr size_t ListMaxLimit  = 100000;  // 1ページの上限
+constexpr size_t ListScanLimit = 1000000; // 1ページで辿る上限(見つからなくてもここで一度返す)
+
+// *は/を含む任意の文字列、?は任意の1文字
+bool globMatch(std::string_view pattern, std::string_view text)
+{
+    size_t p     = 0;
+    size_t t     = 0;
+    size_t starP = std::string_view::npos; // 直前の*
+    size_t starT = 0;
+    while (t < text.size())
+    {
+        if (p < pattern.size() && (pattern[p] == '?' || pattern[p] == text[t]))
+        {
+            p++;
+            t++;
+        }
+        else if (p < pattern.size() && pattern[p] == '*')
+        {
+            starP = p++;
+            starT = t;
+        }
+        else if (starP != std::string_view::npos)
+        {
+            // 直前の*でもう1文字読み飛ばしてやり直す
+            p = starP + 1;
+            t = ++starT;
+        }
+        else
+        {
+            return false;
+        }
+    }
+    while (p < pattern.size() && pattern[p] == '*')
+    {
+        p++;
+    }
+    return p == pattern.size();
+}
+
+// 絞り込みの条件(削除されたものはサイズと更新時刻の条件を問わない)
+struct ListFilter
+{
+    std::optional<int64_t> minTime_;
+    std::optional<int64_t> maxTime_;
+    std::optional<int64_t> minSize_;
+    std::optional<int64_t> maxSize_;
+    std::string suffix_;
+    std::string glob_;
+    bool enabled_{false};
+
+    bool match(const FileInfo &f) const
+    {
+        if (!enabled_)
+        {
+            return true;
+        }
+        auto key = f.key_.string();
+        if (!key.ends_with(suffix_) || (!glob_.empty() && !globMatch(glob_, key)))
+        {
+            return false;
+        }
+        if (f.delete_)
+        {
+            return true;
+        }
+        auto size = static_cast<int64_t>(f.size_);
+        return (!minTime_ || f.time_ >= *minTime_) && (!maxTime_ || f.time_ <= *maxTime_) &&
+               (!minSize_ || size >= *minSize_) && (!maxSize_ || size <= *maxSize_);
+    }
+};
+
+// 整数の引数(なければそのまま、不正ならfalse)
+bool integerParam(const httplib::Request &req, const char *name, std::optional<int64_t> &value)
+{
+    if (!req.has_param(name))
+    {
+        return true;
+    }
+    auto str  = req.get_param_value(name);
+    char *end = nullptr;
+    errno     = 0;
+    auto v    = std::strtoll(str.c_str(), &end, 10);
+    if (str.empty() || *end != '\0' || errno != 0)
+    {
+        return false;
+    }
+    value = v;
+    return true;
+}
+
+// リクエストから絞り込みの条件(不正ならfalse)
+bool parseListFilter(const httplib::Request &req, ListFilter &filter)
+{
+    if (!integerParam(req, "min_time", filter.minTime_) ||
+        !integerParam(req, "max_time", filter.maxTime_) ||
+        !integerParam(req, "min_size", filter.minSize_) ||
+        !integerParam(req, "max_size", filter.maxSize_))
+    {
+        return false;
+    }
+    filter.suffix_  = req.get_param_value("suffix");
+    filter.glob_    = req.get_param_value("glob");
+    filter.enabled_ = filter.minTime_ || filter.maxTime_ || filter.minSize_ || filter.maxSize_ ||
+                      !filter.suffix_.empty() || !filter.glob_.empty();
+    return true;
+}
+
+// 続きの位置をトークンに(種類の1文字と値を16進にする)
+std::string makeListToken(char kind, const std::string &value)
+{
+    auto raw = kind + value;
+    return toHexString(reinterpret_cast<const uint8_t *>(raw.data()), raw.size());
+}
+
+// トークンを種類と値に(不正ならnullopt)
+std::optional<std::pair<char, std::string>> parseListToken(const std::string &token)
+{
+    auto nibble = [](char c) -> int
+    {
+        if (c >= '0' && c <= '9')
+        {
+            return c - '0';
+        }
+        if (c >= 'a' && c <= 'f')
+        {
+            return c - 'a' + 10;
+        }
+        return -1;
+    };
+    if (token.empty() || token.size() % 2 != 0)
+    {
+        return std::nullopt;
+    }
+    std::string raw;
+    for (size_t i = 0; i < token.size(); i += 2)
+    {
+        auto hi = nibble(token[i]);
+        auto lo = nibble(token[i + 1]);
+        if (hi < 0 || lo < 0)
+        {
+            return std::nullopt;
+        }
+        raw += static_cast<char>(hi << 4 | lo);
+    }
+    return std::make_pair(raw[0], raw.substr(1));
+}
+
+// 1ページ分を集める(続きがあればそのトークン、updateならindexMutexを持って呼ぶ)
+std::optional<std::string> collectListPage(ListSource &source, const ListFilter &filter,
+                                           size_t limit, bool update, std::list<FileInfoPtr> &page)
+{
+    auto token = [&](const FileInfoPtr &finfo)
+    {
+        return source.fromChanges_ ? makeListToken('g', std::to_string(finfo->gen_))
+                                   : makeListToken('k', finfo->key_.string());
+    };
+    FileInfoPtr lastVisited;
+    FileInfoPtr lastReturned;
+    size_t visited = 0;
+    while (auto *n = source.next())
+    {
+        if (visited++ == ListScanLimit)
+        {
+            // 辿りすぎたので最後に見たところまでで返す
+            return token(lastVisited);
+        }
+        auto finfo = update ? updateFileInfo(*n) : *n;
+        if (!filter.match(*finfo))
+        {
+            lastVisited = std::move(finfo);
+            continue;
+        }
+        if (page.size() == limit)
+        {
+            return token(lastReturned);
+        }
+        page.push_back(finfo);
+        lastVisited  = finfo;
+        lastReturned = std::move(finfo);
+    }
+    return std::nullopt;
+}
+
+//
+void repliesFileList(const httplib::Request &req, httplib::Response &res)
+{
+    std::string prefixDir = "";
+    if (req.has_param("prefix"))
+    {
+        prefixDir = req.get_param_value("prefix");
+    }
+    bool update = false;
+    if (req.has_param("update"))
+    {
+        auto upstr = req.get_param_value("update");
+        if (upstr == "1" || upstr == "true" || upstr == "TRUE" || upstr == "ON")
+        {
+            update = true;
+        }
+    }
+    // 同じエポックで世代が指定されていればそれ以降の変更のみ
+    std::optional<uint64_t> since;
+    if (req.has_param("since") && req.get_param_value("epoch") == journal.epoch())
+    {
+        since = std::strtoull(req.get_param_value("since").c_str(), nullptr, 10);
+    }
+
+    // 監視中は常に最新
+    // 監視していなければ(--watch=false、Linux以外)プレフィックス以下を全部statし直すので、
+    // 変更がなくても時間はファイル数に比例する(ディレクトリの更新時刻では中身の変更はわからない)
+    update = update && !liveIndex;
+
+    // 絞り込みとページ分け
+    ListFilter filter;
+    std::optional<int64_t> limit;
+    if (!parseListFilter(req, filter) || !integerParam(req, "limit", limit) ||
+        (limit && *limit <= 0))
+    {
+        res.status = 400;
+        return;
+    }
+    std::optional<std::pair<char, std::string>> token;
+    if (req.has_param("cursor"))
+    {
+        token = parseListToken(req.get_param_value("cursor"));
+        if (!token || token->first != (since ? 'g' : 'k') ||
+            (!since && !token->second.starts_with(prefixDir)))
+        {
+            res.status = 400;
+            return;
+        }
+    }
+
+    // 世代指定なら変更履歴から
+    std::list<FileInfoPtr> changes;
+    if (since)
+    {
+        if (update)
+        {
+            std::lock_guard lock{indexMutex};
+            loadIndex()->files_.forEachWithPrefix(prefixDir, updateFileInfo);
+            publishIndex();
+            update = false;
+        }
+        auto from = *since;
+        if (token)
+        {
+            from = std::max<uint64_t>(from, std::strtoull(token->second.c_str(), nullptr, 10));
+        }
+        changes = journal.since(from, prefixDir);
+    }
+    auto generation = journal.generation();
+    res.set_header("X-Fsrv-Epoch", journal.epoch());
+    res.set_header("X-Fsrv-Generation", std::to_string(generation));
+
+    // ファイルリストを返す
+    auto source = std::make_shared<ListSource>();
+    if (since)
+    {
+        source->changes_     = std::move(changes);
+        source->it_          = source->changes_.begin();
+        source->fromChanges_ = true;
+    }
+    else
+    {
+        source->index_  = loadIndex();
+        source->cursor_ = token ? source->index_->files_.cursorAfter(prefixDir, token->second)
+                                : source->index_->files_.cursor(prefixDir);
+    }
+
+    // ページ分けするなら先に集めて、続きがあるかどうかをヘッダで返す
+    std::optional<std::string> next;
+    if (limit)
+    {
+        std::list<FileInfoPtr> page;
+        {
+            std::unique_lock lock{indexMutex, std::defer_lock};
+            if (update)
+            {
+                lock.lock();
+            }
+            auto count = std::min(static_cast<size_t>(*limit), ListMaxLimit);
+            next       = collectListPage(*source, filter, count, update, page);
+            if (update)
+            {
+                publishIndex();
+            }
+        }
+        if (next)
+        {
+            res.set_header("X-Fsrv-Next", *next);
+        }
+        source->changes_     = std::move(page);
+        source->it_          = source->changes_.begin();
+        source->fromChanges_ = true;
+        update               = false;
+    }
+
+    auto enc = acceptedEncoding(req);
+    if (req.get_param_value("format") == "bin")
+    {
+        // バイナリ形式で少しずつ送る
+        struct StreamState
+        {
+            ListEncoder encoder_;
+            std::string buffer_;
+            EncodedWriter writer_;
+        };
+        auto state = std::make_shared<StreamState>(StreamState{{}, {}, {enc, res}});
+        res.set_chunked_content_provider(
+            ListContentType,
+            [source, state, update, filter](size_t /*offset*/, httplib::DataSink &sink)
+            {
+                constexpr size_t BatchCount = 256;
+                state->buffer_.clear();
+                std::unique_lock lock{indexMutex, std::defer_lock};
+                if (update)
+                {
+                    lock.lock();
+                }
+                const FileInfoPtr *n = nullptr;
+                for (size_t i = 0; i < BatchCount && (n = source->next()); i++)
+                {
+                    auto finfo = update ? updateFileInfo(*n) : *n;
+                    if (!filter.match(*finfo))
+                    {
+                        continue;
+                    }
+                    auto &f = *finfo;
+                    state->encoder_.encode(state->buffer_, {f.key_.string(), f.size_, f.time_,
+                                                            f.delete_, f.hash_, f.sha256_});
+                }
+                if (update && !n)
+                {
+                    publishIndex();
+                }
+                if (lock.owns_lock())
+                {
+                    lock.unlock();
+                }
+                if (!n)
+                {
+                    state->encoder_.finish(state->buffer_);
+                    if (state->writer_.write(sink, state->buffer_, true))
+                    {
+                        sink.done();
+                    }
+                    return true;
+                }
+                return state->writer_.write(sink, state->buffer_, false);
+            });
+        return;
+    }
+
+    nlohmann::json jsonObj = nlohmann::json::array();
+    int findex             = 0;
+    std::unique_lock lock{indexMutex, std::defer_lock};
+    if (update)
+    {
+        lock.lock();
+    }
+    while (auto *n = source->next())
+    {
+        // 更新する場合は情報を取得
+        auto finfo = update ? updateFileInfo(*n) : *n;
+        if (!filter.match(*finfo))
+        {
+            continue;
+        }
+        auto &f = *finfo;
+        nlohmann::json entry;
+        entry["Path"]   = f.key_.string();
+        entry["Size"]   = f.size_;
+        entry["Time"]   = f.time_;
+        entry["Delete"] = f.delete_;
+        if (!f.hash_.empty())
+        {
+            entry["Hash"] = f.hash_;
+        }
+        if (!f.sha256_.empty())
+        {
+            entry["Sha256"] = f.sha256_;
+        }
+        jsonObj[findex++] = entry;
+    }
+    if (update)
+    {
+        publishIndex();
+        lock.unlock();
+    }
+    nlohmann::json jsonTop;
+    jsonTop["Files"]      = jsonObj;
+    jsonTop["Epoch"]      = journal.epoch();
+    jsonTop["Generation"] = generation;
+    if (next)
+    {
+        jsonTop["Next"] = *next;
+    }
+
+    auto body = jsonTop.dump();
+    std::string compressed;
+    if (enc != Encoding::Identity && body.size() >= MinCompressSize &&
+        compressString(enc, body, compressed))
+    {
+        res.set_header("Content-Encoding", encodingName(enc));
+        res.set_header("Vary", "Accept-Encoding");
+        body = std::move(compressed);
+    }
+    res.set_content(body, "application/json");
+}
+
+//
+// ブロック毎のチェックサム(差分同期用)
+//
+void repliesBlockList(const httplib::Request &req, httplib::Response &res)
+{
+    if (!req.has_param("path"))
+    {
+        res.status = 400;
+        return;
+    }
+    auto finfo = loadIndex()->files_.search(req.get_param_value("path"));
+    if (!finfo || (*finfo)->delete_)
+    {
+        res.status = 404;
+        return;
+    }
+    size_t blockSize = DefaultBlockSize;
+    if (req.has_param("block"))
+    {
+        auto bsize = std::strtoull(req.get_param_value("block").c_str(), nullptr, 10);
+        blockSize  = std::clamp<size_t>(bsize, MinBlockSize, MaxBlockSize);
+    }
+
+    auto &fname = (*finfo)->path_;
+    std::ifstream inFile{fname, std::ios::binary};
+    if (!inFile)
+    {
+        res.status = 404;
+        return;
+    }
+    // 読んでいる間に変わったら組み立てに使えないので409
+    auto version = [&]
+    {
+        std::error_code ec;
+        auto size  = std::filesystem::file_size(fname, ec);
+        auto mtime = std::filesystem::last_write_time(fname, ec).time_since_epoch();
+        return std::make_pair(ec ? std::string{} : fileETag(size, mtime.count()), mtime);
+    };
+    auto before = version();
+
+    nlohmann::json weakList   = nlohmann::json::array();
+    nlohmann::json strongList = nlohmann::json::array();
+    std::vector<uint8_t> buffer(blockSize);
+    size_t total    = 0;
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    EVP_DigestInit_ex(ctx, EVP_sha256(), nullptr);
+    while (inFile)
+    {
+        inFile.read(reinterpret_cast<char *>(buffer.data()), blockSize);
+        auto len = static_cast<size_t>(inFile.gcount());
+        if (len == 0)
+        {
+            break;
+        }
+        weakList.push_back(RollingChecksum{buffer.data(), len}.value());
+        strongList.push_back(strongChecksum(buffer.data(), len));
+        EVP_DigestUpdate(ctx, buffer.data(), len);
+        total += len;
+    }
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int mdLen = 0;
+    EVP_DigestFinal_ex(ctx, md, &mdLen);
+    EVP_MD_CTX_free(ctx);
+    if (before.first.empty() || version() != before)
+    {
+        res.status = 409;
+        return;
+    }
+
+    using namespace std::chrono;
+    nlohmann::json jsonTop;
+    jsonTop["Path"]      = (*finfo)->key_.string();
+    jsonTop["Size"]      = total;
+    jsonTop["Time"]      = duration_cast<seconds>(before.second).count();
+    jsonTop["ETag"]      = before.first;
+    jsonTop["Digest"]    = toHexString(md, mdLen); // 全体のSHA-256
+    jsonTop["BlockSize"] = blockSize;
+    jsonTop["Weak"]      = weakList;
+    jsonTop["Strong"]    = strongList;
+
+    res.set_content(jsonTop.dump(), "application/json");
+}
+
+//
+// 小さなファイルをまとめて返す(本文は{"Paths": [キー, ...]})
+//
+constexpr size_t BatchMaxFiles    = 4096;             // 1回に受け付ける数
+constexpr size_t BatchMaxFileSize = 16 * 1024 * 1024; // これより大きいものは個別に取得させる
+constexpr size_t BatchWriteSize   = 1024 * 1024;      // 1回に書き出す目安
+
+void repliesBatch(const httplib::Request &req, httplib::Response &res)
+{
+    auto body = nlohmann::json::parse(req.body, nullptr, false);
+    if (body.is_discarded() || !body.contains("Paths") || !body["Paths"].is_array() ||
+        body["Paths"].size() > BatchMaxFiles)
+    {
+        res.status = 400;
+        return;
+    }
+
+    struct StreamState
+    {
+        IndexPtr index_;
+        std::vector<std::string> paths_;
+        size_t next_{0};
+        std::string buffer_;
+        EncodedWriter writer_;
+    };
+    auto state = std::make_shared<StreamState>(
+        StreamState{loadIndex(), {}, 0, {}, {acceptedEncoding(req), res}});
+    for (auto &path : body["Paths"])
+    {
+        if (!path.is_string())
+        {
+            res.status = 400;
+            return;
+        }
+        state->paths_.push_back(path.get<std::string>());
+    }
+
+    res.set_chunked_content_provider(
+        BatchContentType,
+        [state](size_t /*offset*/, httplib::DataSink &sink)
+        {
+            auto &buffer = state->buffer_;
+            buffer.clear();
+            while (state->next_ < state->paths_.size() && buffer.size() < BatchWriteSize)
+            {
+                BatchEntry entry{state->paths_[state->next_++]};
+                auto finfo = state->index_->files_.search(entry.path_);
+                if (!finfo || (*finfo)->delete_)
+                {
+                    entry.flags_ = BatchFlagMissing;
+                    encodeBatchHeader(buffer, entry);
+                    continue;
+                }
+
+                // リストを返した後に変わっているかもしれないので今の内容を送る
+                std::error_code ec;
+                auto &fname = (*finfo)->path_;
+                auto size   = std::filesystem::file_size(fname, ec);
+                std::ifstream inFile{fname, std::ios::binary};
+                if (ec || !inFile)
+                {
+                    entry.flags_ = BatchFlagMissing;
+                    encodeBatchHeader(buffer, entry);
+                    continue;
+                }
+                if (size > BatchMaxFileSize)
+                {
+                    entry.flags_ = BatchFlagSkipped;
+                    encodeBatchHeader(buffer, entry);
+                    continue;
+                }
+                entry.size_ = size;
+                encodeBatchHeader(buffer, entry);
+                auto offset = buffer.size();
+                buffer.resize(offset + size);
+                inFile.read(buffer.data() + offset, size);
+                if (static_cast<size_t>(inFile.gcount()) != size)
+                {
+                    // 読んでいる間に縮んだ(ヘッダのサイズと合わせられないので打ち切る)
+                    printVerbose("batch read failed: ", entry.path_);
+                    return false;
+                }
+            }
+            bool last = state->next_ >= state->paths_.size();
+            if (last)
+            {
+                finishBatch(buffer);
+            }
+            if (!state->writer_.write(sink, buffer, last))
+            {
+                return false;
+            }
+            if (last)
+            {
+                sink.done();
+            }
+            return true;
+        });
+}
+
+//
+// ディレクトリ情報
+// 全体は公開したインデックス毎に一度だけ作り、pathやdepthの指定があればその部分を返す
+//
+
+// ルートからの相対パスのディレクトリ(なければnullptr)
+const DirInfo *findDir(const DirInfo &root, const std::string &path)
+{
+    const DirInfo *dir = &root;
+    for (auto &name : FilePath{path}.relative_path())
+    {
+        if (name.empty() || name == ".")
+        {
+            continue;
+        }
+        auto it = std::find_if(dir->children_.begin(), dir->children_.end(),
+                               [&](const DirInfo::Ptr &c) { return c->path_ == name; });
+        if (it == dir->children_.end())
+        {
+            return nullptr;
+        }
+        dir = it->get();
+    }
+    return dir;
+}
+
+//
+void repliesDirList(const httplib::Request &req, httplib::Response &res)
+{
+    auto index = loadIndex();
+    if (!index->root_)
+    {
+        return;
+    }
+
+    std::optional<int64_t> depth;
+    if (!integerParam(req, "depth", depth) || (depth && *depth < 0))
+    {
+        res.status = 400;
+        return;
+    }
+    std::shared_ptr<DirResponse> response;
+    auto path = req.get_param_value("path");
+    if (path.empty() && !depth)
+    {
+        response = index->rootDir();
+    }
+    else
+    {
+        auto *dir = findDir(*index->root_, path);
+        if (!dir)
+        {
+            res.status = 404;
+            return;
+        }
+        auto levels = depth ? static_cast<int>(std::min<int64_t>(*depth, INT_MAX)) : -1;
+        response    = makeDirResponse(*dir, levels);
+    }
+
+    res.set_header("ETag", response->etag_);
+    if (compressEnabled)
+    {
+        res.set_header("Vary", "Accept-Encoding");
+    }
+    auto match = req.get_header_value("If-None-Match");
+    if (match == "*" || match.find(response->etag_) != std::string::npos)
+    {
+        res.status = 304;
+        return;
+    }
+
+    // 圧縮したものも応答と一緒に使い回す
+    auto body = response->body_;
+    auto enc  = acceptedEncoding(req);
+    if (enc != Encoding::Identity && body->size() >= MinCompressSize)
+    {
+        if (auto encoded = response->encoded(enc))
+        {
+            res.set_header("Content-Encoding", encodingName(enc));
+            body = std::move(encoded);
+        }
+    }
+    res.set_content_provider(body->size(), "application/json",
+                             [body](size_t offset, size_t length, httplib::DataSink &sink)
+                             { return sink.write(body->data() + offset, length); });
+}
+
+//
+// 計測値(Prometheusのテキスト形式)
+//
+void repliesMetrics(const httplib::Request & /*req*/, httplib::Response &res)
+{
+    std::ostringstream out;
+    serverMetrics.format(out);
+
+    auto metric = [&](const char *name, const char *type, const char *help, auto value)
+    {
+        out << "# HELP " << name << " " << help << "\n# TYPE " << name << " " << type << "\n"
+            << name << " " << value << "\n";
+    };
+    auto index = loadIndex();
+
+    // トライのメモリは全ノードを辿るので公開された版毎に1回だけ求める
+    static std::mutex memoryMutex;
+    static uint64_t memoryVersion = 0;
+    static size_t memoryBytes     = 0;
+    {
+        std::lock_guard lock{memoryMutex};
+        if (memoryVersion != index->version_)
+        {
+            memoryBytes   = index->files_.memoryUsage();
+            memoryVersion = index->version_;
+        }
+        metric("fsrv_trie_memory_bytes", "gauge",
+               "Approximate memory used by the published file trie.", memoryBytes);
+    }
+    metric("fsrv_index_files", "gauge", "Files in the published index (including deleted).",
+           index->files_.size());
+    metric("fsrv_index_generation", "gauge", "Generation of the published index.",
+           index->generation_);
+    metric("fsrv_index_publishes_total", "counter", "Times the index has been published.",
+           index->version_);
+    metric("fsrv_scan_duration_seconds", "gauge", "Duration of the last directory scan.",
+           static_cast<double>(serverMetrics.scanMicros_.load()) / 1e6);
+    metric("fsrv_scans_total", "counter", "Directory scans run since startup.",
+           serverMetrics.scans_.load());
+    metric("fsrv_active_connections", "gauge", "Connections being served.",
+           serverMetrics.activeConnections_.load());
+    metric("fsrv_queued_connections", "gauge", "Connections waiting for a worker thread.",
+           serverMetrics.queuedConnections_.load());
+
+    res.set_content(out.str(), "text/plain; version=0.0.4");
+}
+
+//
+// ディレクトリ走査
+//
+
+// ファイルのキー
+FilePath makeFileKey(const FilePath &path, const FilePath &rootPath)
+{
+    auto keyName = path.lexically_relative(rootPath);
+#if _WIN32
+    return translateToPosix(keyName);
+#else
+    return keyName;
+#endif
+}
+
+// ファイル情報作成
+std::shared_ptr<FileInfo> makeFileInfo(const std::filesystem::directory_entry &entry,
+                                       const FilePath &rootPath)
+{
+    using namespace std::chrono;
+    auto wtime = entry.last_write_time().time_since_epoch();
+    auto sec   = duration_cast<seconds>(wtime);
+    auto fptr  = std::make_shared<FileInfo>();
+#if _WIN32
+    fptr->path_ = translateToPosix(entry.path());
+#else
+    fptr->path_ = entry.path();
+#endif
+    fptr->key_    = makeFileKey(entry.path(), rootPath);
+    fptr->time_   = sec.count();
+    fptr->size_   = entry.file_size();
+    fptr->delete_ = false;
+    fptr->gen_    = 0;
+    return fptr;
+}
+
+// 受信中のアップロード(インデックスに載せない)
+constexpr std::string_view UploadSuffix = ".fsrv-upload";
+bool isUploadTemp(std::string_view name) { return name.ends_with(UploadSuffix); }
+
+// ディレクトリ内の項目(通常ファイルとディレクトリのみ)
+struct DirEntry
+{
+    std::string name_;
+    bool isDir_;
+    size_t size_;
+    int64_t time_;
+};
+
+#if __linux__
+// ファイルの属性
+struct EntryStat
+{
+    mode_t mode_;
+    size_t size_;
+    int64_t time_;
+};
+
+// ディレクトリ内の項目の属性(followならシンボリックリンクを辿る)
+bool statEntry(int dfd, const char *name, bool follow, EntryStat &st)
+{
+    int flags = follow ? 0 : AT_SYMLINK_NOFOLLOW;
+#ifdef STATX_BASIC_STATS
+    struct statx sx;
+    if (::statx(dfd, name, flags | AT_STATX_SYNC_AS_STAT, STATX_TYPE | STATX_SIZE | STATX_MTIME,
+                &sx) != 0)
+    {
+        return false;
+    }
+    st.mode_ = sx.stx_mode;
+    st.size_ = sx.stx_size;
+    st.time_ = toFileTime(sx.stx_mtime.tv_sec, sx.stx_mtime.tv_nsec);
+#else
+    struct stat sb;
+    if (::fstatat(dfd, name, &sb, flags) != 0)
+    {
+        return false;
+    }
+    st.mode_ = sb.st_mode;
+    st.size_ = static_cast<size_t>(sb.st_size);
+    st.time_ = toFileTime(sb.st_mtim.tv_sec, sb.st_mtim.tv_nsec);
+#endif
+    return true;
+}
+
+// getdents64でまとめて読み、ファイルだけstatxで属性を取る
+// d_typeを埋めないファイルシステム(ftypeなしのXFS、NFSなど)ではリンクを辿らずに種類を調べる
+template <class Callback> void listDirectory(const FilePath &dir, Callback &&callback)
+{
+    int dfd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dfd < 0)
+    {
+        std::cerr << "open failed: " << dir << std::endl;
+        return;
+    }
+    alignas(dirent64) char buffer[64 * 1024];
+    for (;;)
+    {
+        auto len = ::syscall(SYS_getdents64, dfd, buffer, sizeof(buffer));
+        if (len <= 0)
+        {
+            if (len < 0)
+            {
+                std::cerr << "getdents64 failed: " << dir << std::endl;
+            }
+            break;
+        }
+        for (long pos = 0; pos < len;)
+        {
+            auto *d = reinterpret_cast<dirent64 *>(buffer + pos);
+            pos += d->d_reclen;
+            if (std::strcmp(d->d_name, ".") == 0 || std::strcmp(d->d_name, "..") == 0 ||
+                isUploadTemp(d->d_name))
+            {
+                continue;
+            }
+            EntryStat st;
+            bool link = d->d_type == DT_LNK;
+            if (d->d_type == DT_UNKNOWN)
+            {
+                if (!statEntry(dfd, d->d_name, false, st))
+                {
+                    continue;
+                }
+                if (S_ISDIR(st.mode_))
+                {
+                    callback(DirEntry{d->d_name, true, 0, 0});
+                    continue;
+                }
+                if (S_ISREG(st.mode_))
+                {
+                    callback(DirEntry{d->d_name, false, st.size_, st.time_});
+                    continue;
+                }
+                link = S_ISLNK(st.mode_);
+            }
+            else if (d->d_type == DT_DIR)
+            {
+                callback(DirEntry{d->d_name, true, 0, 0});
+                continue;
+            }
+            if (!link && d->d_type != DT_REG)
+            {
+                continue;
+            }
+            // ファイルへのシンボリックリンクは辿る(ディレクトリはループしうるので辿らない)
+            if (statEntry(dfd, d->d_name, link, st) && S_ISREG(st.mode_))
+            {
+                callback(DirEntry{d->d_name, false, st.size_, st.time_});
+            }
+        }
+    }
+    ::close(dfd);
+}
+#else
+//
+template <class Callback> void listDirectory(const FilePath &dir, Callback &&callback)
+{
+    using namespace std::chrono;
+    try
+    {
+        for (const auto &entry : std::filesystem::directory_iterator(dir))
+        {
+            if (entry.is_directory() && !entry.is_symlink())
+            {
+                callback(DirEntry{entry.path().filename().string(), true, 0, 0});
+            }
+            else if (entry.is_regular_file() && !isUploadTemp(entry.path().filename().string()))
+            {
+                auto wtime = entry.last_write_time().time_since_epoch();
+                callback(DirEntry{entry.path().filename().string(), false, entry.file_size(),
+                                  duration_cast<seconds>(wtime).count()});
+            }
+        }
+    }
+    catch (std::exception &exp)
+    {
+        std::cerr << exp.what() << std::endl;
+    }
+}
+#endif
+
+//
+// ディレクトリの並列走査
+// ディレクトリ毎のタスクをスレッド毎のキューに積み、手の空いたスレッドは他のキューから盗む
+// 見つけたファイルはまとめて受け渡し、呼び出し元のスレッドが走査と並行してトライに登録する
+//
+using DirHook = std::function<void(const FilePath &)>; // 走査するディレクトリ毎に読む前に呼ぶ
+
+class DirectoryScanner
+{
+    using Batch                       = std::vector<std::shared_ptr<FileInfo>>;
+    static constexpr size_t BatchSize = 4096;
+
+    struct Task
+    {
+        FilePath path_;
+        DirInfo::Ptr dir_;
+    };
+    struct Worker
+    {
+        std::mutex mutex_;
+        std::deque<Task> tasks_;
+        Batch batch_;
+    };
+
+    FilePath rootPath_;
+    DirHook hook_; // 監視の追加(読む前に監視すれば走査中の変更も取りこぼさない)
+    std::vector<std::unique_ptr<Worker>> workers_;
+    std::atomic<size_t> pending_{0}; // 終わっていないタスク数
+    std::atomic<size_t> dirCount_{0};
+
+    std::mutex mutex_; // 以下の排他
+    std::condition_variable cond_;
+    std::vector<Batch> batches_; // 登録待ちのファイル
+    std::vector<std::pair<std::string, DirInfo::Ptr>> dirs_;
+    size_t running_{0};
+
+    //
+    void pushTask(size_t id, Task task)
+    {
+        pending_++;
+        std::lock_guard lock{workers_[id]->mutex_};
+        workers_[id]->tasks_.push_back(std::move(task));
+    }
+
+    // 自分のキューは後ろから、他のキューは前から取る
+    bool popTask(size_t id, Task &task)
+    {
+        for (size_t i = 0; i < workers_.size(); i++)
+        {
+            auto &w = *workers_[(id + i) % workers_.size()];
+            std::lock_guard lock{w.mutex_};
+            if (w.tasks_.empty())
+            {
+                continue;
+            }
+            if (i == 0)
+            {
+                task = std::move(w.tasks_.back());
+                w.tasks_.pop_back();
+            }
+            else
+            {
+                task = std::move(w.tasks_.front());
+                w.tasks_.pop_front();
+            }
+            return true;
+        }
+        return false;
+    }
+
+    //
+    void flush(size_t id)
+    {
+        auto &batch = workers_[id]->batch_;
+        if (batch.empty())
+        {
+            return;
+        }
+        {
+            std::lock_guard lock{mutex_};
+            batches_.push_back(std::move(batch));
+        }
+        batch.clear();
+        cond_.notify_one();
+    }
+
+    // ディレクトリ1つ分(子ディレクトリの情報はここで作ってからタスクにする)
+    void scanDir(size_t id, const Task &task)
+    {
+        printVerbose("check dir: ", task.path_);
+        dirCount_++;
+        if (hook_)
+        {
+            hook_(task.path_);
+        }
+        auto &batch = workers_[id]->batch_;
+        listDirectory(task.path_,
+                      [&](const DirEntry &entry)
+                      {
+                          auto path = task.path_ / entry.name_;
+                          if (entry.isDir_)
+                          {
+                              if (!recursiveMode)
+                              {
+                                  return;
+                              }
+                              auto dptr    = std::make_shared<DirInfo>();
+                              dptr->path_  = entry.name_;
+                              dptr->count_ = 0;
+                              task.dir_->children_.push_back(dptr);
+                              {
+                                  std::lock_guard lock{mutex_};
+                                  dirs_.emplace_back(path.string(), dptr);
+                              }
+                              pushTask(id, {std::move(path), dptr});
+                              return;
+                          }
+                          auto fptr     = std::make_shared<FileInfo>();
+                          fptr->key_    = makeFileKey(path, rootPath_);
+                          fptr->path_   = std::move(path);
+                          fptr->time_   = entry.time_;
+                          fptr->size_   = entry.size_;
+                          fptr->delete_ = false;
+                          fptr->gen_    = 0;
+                          task.dir_->count_++;
+                          printVerbose("File: ", fptr->path_, "(", fptr->time_, ")");
+                          batch.push_back(std::move(fptr));
+                          if (batch.size() >= BatchSize)
+                          {
+                              flush(id);
+                          }
+                      });
+    }
+
+    //
+    void run(size_t id)
+    {
+        Task task;
+        while (pending_ > 0)
+        {
+            if (!popTask(id, task))
+            {
+                std::this_thread::yield();
+                continue;
+            }
+            scanDir(id, task);
+            pending_--;
+        }
+        flush(id);
+        std::lock_guard lock{mutex_};
+        running_--;
+        cond_.notify_one();
+    }
+
+  public:
+    // 走査してファイルとディレクトリを登録(ルートのディレクトリ情報を返す)
+    DirInfo::Ptr scan(const FilePath &targetDir, const FilePath &rootPath, size_t threads,
+                      FileTrie &files, DirMap &dirMap, DirHook hook = nullptr)
+    {
+        rootPath_ = rootPath;
+        hook_     = std::move(hook);
+        threads   = std::max<size_t>(threads, 1);
+        for (size_t i = 0; i < threads; i++)
+        {
+            workers_.push_back(std::make_unique<Worker>());
+        }
+
+        auto root    = std::make_shared<DirInfo>();
+        root->path_  = targetDir.filename();
+        root->count_ = 0;
+
+        dirMap[targetDir.string()] = root;
+        pushTask(0, {targetDir, root});
+
+        running_ = threads;
+        std::vector<std::thread> pool;
+        for (size_t i = 0; i < threads; i++)
+        {
+            pool.emplace_back([this, i] { run(i); });
+        }
+
+        // 走査と並行して登録
+        std::unique_lock lock{mutex_};
+        for (;;)
+        {
+            cond_.wait(lock, [this] { return !batches_.empty() || running_ == 0; });
+            auto batches = std::move(batches_);
+            auto dirs    = std::move(dirs_);
+            batches_.clear();
+            dirs_.clear();
+            bool finished = running_ == 0;
+            lock.unlock();
+            for (auto &batch : batches)
+            {
+                for (auto &fptr : batch)
+                {
+                    auto key = fptr->key_.string();
+                    files.insert(key, std::move(fptr));
+                }
+            }
+            for (auto &d : dirs)
+            {
+                dirMap[d.first] = d.second;
+            }
+            if (finished)
+            {
+                break;
+            }
+            lock.lock();
+        }
+        for (auto &t : pool)
+        {
+            t.join();
+        }
+        return root;
+    }
+
+    //
+    size_t dirCount() const { return dirCount_; }
+};
+
+//
+bool checkDirectory(FilePath targetDir, const FilePath rootPath, size_t threads,
+                    const DirHook &hook)
+{
+    if (!std::filesystem::exists(targetDir))
+    {
+        // 無いよ
+        std::cerr << "not exist: " << targetDir << std::endl;
+        return false;
+    }
+    if (!std::filesystem::is_directory(targetDir))
+    {
+        // ディレクトリじゃない
+        std::cerr << "not directory: " << targetDir << std::endl;
+        return false;
+    }
+    printVerbose("First Directory: ", targetDir);
+
+    auto startTime = std::chrono::steady_clock::now();
+    DirectoryScanner scanner;
+    currentDir   = scanner.scan(targetDir, rootPath, threads, fileList, dirIndex, hook);
+    auto elapsed = std::chrono::steady_clock::now() - startTime;
+    serverMetrics.recordScan(elapsed);
+    printVerbose("scan: ", fileList.size(), " files, ", scanner.dirCount(), " dirs, ",
+                 std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count(),
+                 " ms (", threads, " threads)");
+    return true;
+}
+
+//
+// 走査結果とジャーナルを突き合わせて世代を決める
+//
+void reconcileJournal(ChangeJournal::KnownMap known, const FilePath &rootPath)
+{
+    // 辿っている最中には差し替えないので先に集める
+    std::vector<FileInfoPtr> scanned;
+    fileList.forEachWithPrefix("", [&](const FileInfoPtr &finfo) { scanned.push_back(finfo); });
+    for (auto &finfo : scanned)
+    {
+        auto key  = finfo->key_.string();
+        auto fptr = std::make_shared<FileInfo>(*finfo);
+        auto it   = known.find(key);
+        if (it != known.end() && !it->second.delete_ && it->second.size_ == fptr->size_ &&
+            it->second.time_ == fptr->time_)
+        {
+            // 前回から変わっていない
+            fptr->gen_ = it->second.gen_;
+            journal.record(fptr);
+        }
+        else
+        {
+            journal.stamp(fptr);
+        }
+        if (it != known.end())
+        {
+            known.erase(it);
+        }
+        fileList.insert(key, fptr);
+    }
+
+    // 停止中に消えたものは削除として残す
+    for (auto &k : known)
+    {
+        auto fptr     = std::make_shared<FileInfo>();
+        fptr->key_    = k.first;
+        fptr->path_   = rootPath / k.first;
+        fptr->time_   = 0;
+        fptr->size_   = 0;
+        fptr->delete_ = true;
+        fptr->gen_    = k.second.gen_;
+        if (k.second.delete_)
+        {
+            journal.record(fptr);
+        }
+        else
+        {
+            journal.stamp(fptr);
+        }
+        fileList.insert(k.first, fptr);
+    }
+}
+
+//
+// インデックスの編集(走査後の変更、indexMutexを持って呼ぶ)
+//
+
+// 変更するディレクトリ(公開済みならルートまでの経路を複製して差し替える、なければnullptr)
+DirInfo *editDir(const FilePath &dir)
+{
+    auto it = dirIndex.find(dir.string());
+    if (it == dirIndex.end())
+    {
+        return nullptr;
+    }
+    auto &dptr = it->second;
+    if (dptr->owner_ == dirVersion)
+    {
+        return dptr.get();
+    }
+    auto copy       = std::make_shared<DirInfo>();
+    copy->path_     = dptr->path_;
+    copy->count_    = dptr->count_;
+    copy->children_ = dptr->children_;
+    copy->owner_    = dirVersion;
+    if (dptr == currentDir)
+    {
+        currentDir = copy;
+    }
+    else
+    {
+        auto *parent = dir != dir.parent_path() ? editDir(dir.parent_path()) : nullptr;
+        if (!parent)
+        {
+            return nullptr;
+        }
+        std::replace(parent->children_.begin(), parent->children_.end(), dptr, copy);
+    }
+    dptr = std::move(copy);
+    return dptr.get();
+}
+
+// ディレクトリのファイル数
+void countFile(const FilePath &path, int diff)
+{
+    if (auto *dir = editDir(path.parent_path()))
+    {
+        dir->count_ += diff;
+    }
+}
+
+// ファイルの作成、変更、削除を反映(writtenなら書き込みがあった)
+void indexFile(const FilePath &path, const FilePath &rootPath, bool written = false)
+{
+    if (isUploadTemp(path.filename().string()))
+    {
+        return;
+    }
+    auto key = makeFileKey(path, rootPath).string();
+    if (auto found = fileList.search(key))
+    {
+        bool wasDeleted = (*found)->delete_;
+        auto finfo      = updateFileInfo(*found);
+        if (finfo != *found)
+        {
+            printVerbose(finfo->delete_ ? "removed: " : "updated: ", key);
+        }
+        if (wasDeleted != finfo->delete_)
+        {
+            countFile(path, finfo->delete_ ? -1 : 1);
+        }
+        if (written && finfo == *found && !finfo->delete_)
+        {
+            // サイズも時刻も変わらない書き込みもあるので中身を確かめる
+            hashService.request(key, true);
+        }
+        return;
+    }
+
+    std::error_code ec;
+    std::filesystem::directory_entry entry{path, ec};
+    if (ec || !entry.is_regular_file(ec))
+    {
+        return;
+    }
+    auto fptr = makeFileInfo(entry, rootPath);
+    journal.stamp(fptr);
+    fileList.insert(key, fptr);
+    hashService.request(key);
+    countFile(path, 1);
+    printVerbose("new file: ", key);
+}
+
+// ディレクトリを追加(追加したらtrue)
+bool indexDir(const FilePath &path)
+{
+    if (!recursiveMode || dirIndex.count(path.string()))
+    {
+        return false;
+    }
+    auto *parent = editDir(path.parent_path());
+    if (!parent)
+    {
+        return false;
+    }
+    auto dptr    = std::make_shared<DirInfo>();
+    dptr->path_  = path.filename();
+    dptr->count_ = 0;
+    dptr->owner_ = dirVersion;
+    parent->children_.push_back(dptr);
+    dirIndex[path.string()] = dptr;
+    return true;
+}
+
+//
+// アップロード(PUT/POST /files/...、--writableのときのみ)
+// 同じディレクトリの一時ファイルに受信してから置き換える
+// X-Fsrv-Baseでクライアントが最後に見た状態(サイズ:更新時刻、なかったならnone、*なら確かめない)を
+// 受け取り、今の状態と違えば409で断る
+//
+bool writableMode = false;
+std::mutex uploadMutex;               // 確認から置き換えまでの排他
+std::atomic<uint64_t> uploadCount{0}; // 一時ファイルの名前用
+
+using FileState = std::optional<std::pair<size_t, int64_t>>; // サイズと更新時刻(なければ空)
+
+// 今の状態
+FileState currentFileState(const FilePath &fname)
+{
+    std::error_code ec;
+    if (!std::filesystem::is_regular_file(fname, ec))
+    {
+        return std::nullopt;
+    }
+    auto size  = std::filesystem::file_size(fname, ec);
+    auto mtime = std::filesystem::last_write_time(fname, ec).time_since_epoch();
+    if (ec)
+    {
+        return std::nullopt;
+    }
+    using namespace std::chrono;
+    return std::pair{static_cast<size_t>(size), duration_cast<seconds>(mtime).count()};
+}
+
+// クライアントが最後に見た状態と同じか
+bool matchesBase(const std::string &base, const FileState &state)
+{
+    if (base == "*")
+    {
+        return true;
+    }
+    if (base == "none")
+    {
+        return !state;
+    }
+    auto colon = base.find(':');
+    if (colon == std::string::npos || !state)
+    {
+        return false;
+    }
+    return std::strtoull(base.c_str(), nullptr, 10) == state->first &&
+           std::strtoll(base.c_str() + colon + 1, nullptr, 10) == state->second;
+}
+
+// 状態を返す(成功したときも断ったときも)
+void replyFileState(httplib::Response &res, const FilePath &key, const FileState &state)
+{
+    nlohmann::json value;
+    value["Path"]   = key.string();
+    value["Size"]   = state ? state->first : 0;
+    value["Time"]   = state ? state->second : 0;
+    value["Delete"] = !state;
+    res.set_content(value.dump(), "application/json");
+}
+
+// 一時ファイルを永続化
+bool syncUploadFile(const FilePath &path)
+{
+#if _WIN32
+    return true;
+#else
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return false;
+    }
+    bool ok = ::fsync(fd) == 0;
+    ::close(fd);
+    return ok;
+#endif
+}
+
+//
+void repliesUpload(const httplib::Request &req, httplib::Response &res,
+                   const httplib::ContentReader &reader, const std::string &mountPoint,
+                   const FilePath &baseDir, const FilePath &rootPath)
+{
+    auto mounted = mountedPath(req.path, mountPoint);
+    auto relPath = mounted ? mounted->lexically_normal() : FilePath{};
+    if (!relPath.has_filename() || relPath == "." || isUploadTemp(relPath.filename().string()) ||
+        !req.has_header("X-Fsrv-Base"))
+    {
+        res.status = 400;
+        return;
+    }
+    if (!recursiveMode && relPath.has_parent_path())
+    {
+        // 走査していないディレクトリには置かない
+        res.status = 403;
+        return;
+    }
+    auto fname = baseDir / relPath;
+    auto key   = makeFileKey(fname, rootPath);
+    auto base  = req.get_header_value("X-Fsrv-Base");
+    if (!matchesBase(base, currentFileState(fname)))
+    {
+        // 受信する前に断る
+        printVerbose("upload conflict: ", key);
+        res.status = 409;
+        replyFileState(res, key, currentFileState(fname));
+        return;
+    }
+
+    // 一時ファイルに受信
+    std::error_code ec;
+    std::filesystem::create_directories(fname.parent_path(), ec);
+    auto tmpPath = fname;
+    tmpPath += "." + std::to_string(uploadCount++) + std::string{UploadSuffix};
+    std::ofstream outFile{tmpPath, std::ios::binary | std::ios::trunc};
+    size_t received = 0;
+    bool ok         = static_cast<bool>(outFile);
+    reader(
+        [&](const char *data, size_t len)
+        {
+            outFile.write(data, static_cast<std::streamsize>(len));
+            received += len;
+            ok = ok && static_cast<bool>(outFile);
+            return ok;
+        });
+    outFile.close();
+    if (req.has_header("Content-Length"))
+    {
+        ok = ok && received == std::strtoull(req.get_header_value("Content-Length").c_str(),
+                                             nullptr, 10);
+    }
+    if (!ok || outFile.fail() || !syncUploadFile(tmpPath))
+    {
+        std::filesystem::remove(tmpPath, ec);
+        res.status = 500;
+        return;
+    }
+
+    // 受信中に変わっていないか確かめてから置き換える
+    std::lock_guard lock{uploadMutex};
+    auto state = currentFileState(fname);
+    if (!matchesBase(base, state))
+    {
+        std::filesystem::remove(tmpPath, ec);
+        printVerbose("upload conflict: ", key);
+        res.status = 409;
+        replyFileState(res, key, state);
+        return;
+    }
+    std::filesystem::rename(tmpPath, fname, ec);
+    if (ec)
+    {
+        std::cerr << "rename failed: " << fname << " (" << ec.message() << ")" << std::endl;
+        std::filesystem::remove(tmpPath, ec);
+        res.status = 500;
+        return;
+    }
+    printVerbose("uploaded: ", key, " (", received, " bytes)");
+
+    // 監視中なら監視に任せる
+    if (!liveIndex)
+    {
+        std::lock_guard indexLock{indexMutex};
+        auto dir = baseDir;
+        for (auto &part : relPath.parent_path())
+        {
+            dir /= part;
+            indexDir(dir);
+        }
+        indexFile(fname, rootPath, true);
+        publishIndex();
+    }
+    res.status = state ? 200 : 201;
+    replyFileState(res, key, currentFileState(fname));
+}
+
+//
+// インデックスのスナップショット(再起動時に走査を待たずに使う)
+//
+// [マジック][ルートの絶対パス][エポック][varint 世代][varint ファイル数]
+// ファイル: [varint 前のキーとの共通部分の長さ][varint 残りの長さ][残りのキー]
+//           [varint サイズ][varint 更新時刻(zigzag)][varint フラグ][ハッシュ][varint 世代]
+//           (フラグとハッシュはファイルリストのバイナリ形式と同じ)
+// ディレクトリ(前順): [名前][varint ファイル数][varint 子の数]
+// 文字列は[varint 長さ][本体]
+//
+constexpr char SnapshotMagic[] = "FSRVSNP2";
+
+//
+void putString(std::string &out, const std::string &str)
+{
+    putVarint(out, str.size());
+    out += str;
+}
+bool getString(const char *&p, const char *end, std::string &str)
+{
+    uint64_t len;
+    if (!getVarint(p, end, len) || len > static_cast<uint64_t>(end - p))
+    {
+        return false;
+    }
+    str.assign(p, len);
+    p += len;
+    return true;
+}
+
+// ルートの絶対パス(スナップショットが同じディレクトリのものか確認する)
+std::string snapshotRoot(const FilePath &targetDir)
+{
+    return std::filesystem::absolute(targetDir).lexically_normal().string();
+}
+
+//
+void encodeDir(std::string &out, const DirInfo &dir)
+{
+    putString(out, dir.path_.string());
+    putVarint(out, dir.count_);
+    putVarint(out, dir.children_.size());
+    for (auto &c : dir.children_)
+    {
+        encodeDir(out, *c);
+    }
+}
+
+//
+DirInfo::Ptr decodeDir(const char *&p, const char *end, const FilePath &parent, DirMap &dirMap,
+                       int depth = 0)
+{
+    std::string name;
+    uint64_t count, children;
+    if (depth > 1024 || !getString(p, end, name) || !getVarint(p, end, count) ||
+        !getVarint(p, end, children))
+    {
+        return nullptr;
+    }
+    auto path    = parent / name;
+    auto dptr    = std::make_shared<DirInfo>();
+    dptr->path_  = name;
+    dptr->count_ = static_cast<uint32_t>(count);
+
+    dirMap[path.string()] = dptr;
+    for (uint64_t i = 0; i < children; i++)
+    {
+        auto child = decodeDir(p, end, path, dirMap, depth + 1);
+        if (!child)
+        {
+            return nullptr;
+        }
+        dptr->children_.push_back(std::move(child));
+    }
+    return dptr;
+}
+
+// 公開中のインデックスを保存(一時ファイルに書いてから置き換える)
+bool saveSnapshot(const FilePath &path, const FilePath &targetDir, const IndexSnapshot &index)
+{
+    auto tmpPath = path;
+    tmpPath += ".tmp";
+    std::ofstream outFile{tmpPath, std::ios::binary | std::ios::trunc};
+    if (!outFile)
+    {
+        std::cerr << "snapshot open failed: " << tmpPath << std::endl;
+        return false;
+    }
+
+    std::string buffer{SnapshotMagic, sizeof(SnapshotMagic) - 1};
+    putString(buffer, snapshotRoot(targetDir));
+    putString(buffer, journal.epoch());
+    putVarint(buffer, index.generation_);
+    putVarint(buffer, index.files_.size());
+
+    std::string prevKey;
+    auto encodeFile = [&](const FileInfoPtr &finfo)
+    {
+        auto key      = finfo->key_.string();
+        size_t shared = 0;
+        auto maxLen   = std::min(prevKey.size(), key.size());
+        while (shared < maxLen && prevKey[shared] == key[shared])
+        {
+            shared++;
+        }
+        putVarint(buffer, shared);
+        putVarint(buffer, key.size() - shared);
+        buffer.append(key, shared);
+        putVarint(buffer, finfo->size_);
+        putVarint(buffer, zigzagEncode(finfo->time_));
+        auto flags =
+            (finfo->delete_ ? ListFlagDelete : 0) | digestFlags(finfo->hash_, finfo->sha256_);
+        putVarint(buffer, flags);
+        putDigests(buffer, flags, finfo->hash_, finfo->sha256_);
+        putVarint(buffer, finfo->gen_);
+        prevKey = std::move(key);
+        if (buffer.size() >= 1024 * 1024)
+        {
+            outFile.write(buffer.data(), buffer.size());
+            buffer.clear();
+        }
+    };
+    index.files_.forEachWithPrefix("", encodeFile);
+    if (index.root_)
+    {
+        encodeDir(buffer, *index.root_);
+    }
+    outFile.write(buffer.data(), buffer.size());
+    outFile.close();
+    if (!outFile)
+    {
+        std::cerr << "snapshot write failed: " << tmpPath << std::endl;
+        return false;
+    }
+    std::error_code ec;
+    std::filesystem::rename(tmpPath, path, ec);
+    if (ec)
+    {
+        std::cerr << "snapshot rename failed: " << path << std::endl;
+        return false;
+    }
+    printVerbose("snapshot saved: ", index.files_.size(), " files, generation=",
+                 index.generation_);
+    return true;
+}
 
-namespace
+// スナップショットの中身を解釈してインデックスにする
+bool decodeSnapshot(const char *p, const char *end, const FilePath &targetDir,
+                    const FilePath &rootPath)
 {
-using FilePath = std::filesystem::path;
+    constexpr size_t magicLen = sizeof(SnapshotMagic) - 1;
+    if (static_cast<size_t>(end - p) < magicLen || std::memcmp(p, SnapshotMagic, magicLen) != 0)
+    {
+        return false;
+    }
+    p += magicLen;
 
-bool verboseMode   = false; // 詳細モード
-bool recursiveMode = false; // 再帰検索モード
+    std::string root, epoch;
+    uint64_t generation, count;
+    if (!getString(p, end, root) || !getString(p, end, epoch) ||
+        !getVarint(p, end, generation) || !getVarint(p, end, count))
+    {
+        return false;
+    }
+    if (root != snapshotRoot(targetDir))
+    {
+        std::cerr << "snapshot is for another directory: " << root << std::endl;
+        return false;
+    }
 
-#if _WIN32
-// wchar -> string
-std::string wcs2mbs(const FilePath &src)
-{
-    auto *srcPtr = src.c_str();
-    char buff[1024];
-    wcstombs(buff, srcPtr, sizeof(buff));
-    return buff;
+    std::vector<std::shared_ptr<FileInfo>> files;
+    std::string key;
+    for (uint64_t i = 0; i < count; i++)
+    {
+        uint64_t shared, suffixLen, size, time, flags, gen;
+        if (!getVarint(p, end, shared) || !getVarint(p, end, suffixLen) || shared > key.size() ||
+            suffixLen > static_cast<uint64_t>(end - p))
+        {
+            return false;
+        }
+        key.resize(shared);
+        key.append(p, suffixLen);
+        p += suffixLen;
+        auto fptr = std::make_shared<FileInfo>();
+        if (!getVarint(p, end, size) || !getVarint(p, end, time) || !getVarint(p, end, flags) ||
+            !getDigests(p, end, flags, fptr->hash_, fptr->sha256_) || !getVarint(p, end, gen))
+        {
+            return false;
+        }
+        fptr->key_    = key;
+        fptr->path_   = rootPath / key;
+        fptr->time_   = zigzagDecode(time);
+        fptr->size_   = size;
+        fptr->delete_ = (flags & ListFlagDelete) != 0;
+        fptr->gen_    = gen;
+        files.push_back(std::move(fptr));
+    }
+    DirMap dirs;
+    auto dir = decodeDir(p, end, targetDir.parent_path(), dirs);
+    if (!dir || p != end || !journal.adopt(epoch, generation))
+    {
+        return false;
+    }
+
+    for (auto &fptr : files)
+    {
+        journal.record(fptr);
+        auto fkey = fptr->key_.string();
+        fileList.insert(fkey, std::move(fptr));
+    }
+    currentDir = dir;
+    dirIndex   = std::move(dirs);
+    return true;
 }
 
-// Windowsパス変換
-FilePath translateToPosix(const FilePath src)
+// スナップショットから起動(使えなければfalse)
+bool loadSnapshot(const FilePath &path, const FilePath &targetDir, const FilePath &rootPath)
 {
-    auto chgStr = src.string();
-    for (auto &ch : chgStr)
+    bool loaded = false;
+#if _WIN32
+    std::ifstream inFile{path, std::ios::binary};
+    if (!inFile)
     {
-        if (ch == '\\')
+        return false;
+    }
+    std::string data{std::istreambuf_iterator<char>{inFile}, std::istreambuf_iterator<char>{}};
+    loaded = decodeSnapshot(data.data(), data.data() + data.size(), targetDir, rootPath);
+#else
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return false;
+    }
+    struct stat st;
+    if (::fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+        auto len   = static_cast<size_t>(st.st_size);
+        void *addr = ::mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr != MAP_FAILED)
         {
-            ch = '/';
+            ::madvise(addr, len, MADV_SEQUENTIAL);
+            auto *data = static_cast<const char *>(addr);
+            loaded     = decodeSnapshot(data, data + len, targetDir, rootPath);
+            ::munmap(addr, len);
         }
     }
-    return chgStr;
-}
+    ::close(fd);
 #endif
-
-// デバッグ表示
-template <class Msg> void printVerbose(Msg msg)
-{
-    if (verboseMode)
+    if (!loaded)
     {
-        std::cout << msg << std::endl;
+        std::cerr << "snapshot ignored: " << path << std::endl;
+        return false;
     }
+    printVerbose("snapshot loaded: ", fileList.size(), " files, generation=",
+                 journal.generation());
+    return true;
 }
-template <class Msg, class... Args> void printVerbose(Msg msg, Args... args)
+
+//
+// スナップショットで起動した後、実際のディレクトリと突き合わせる
+//
+void rescanIndex(const FilePath &targetDir, const FilePath &rootPath, size_t threads,
+                 const DirHook &hook)
 {
-    if (verboseMode)
+    auto startTime = std::chrono::steady_clock::now();
+    FileTrie files;
+    DirMap dirs;
+    DirectoryScanner scanner;
+    auto root = scanner.scan(targetDir, rootPath, threads, files, dirs, hook);
+
+    std::lock_guard lock{indexMutex};
+    size_t changed = 0;
+    auto update    = [&](const FileInfoPtr &scanned)
+    {
+        auto key     = scanned->key_.string();
+        auto current = fileList.search(key);
+        if (current && !(*current)->delete_ && (*current)->size_ == scanned->size_ &&
+            (*current)->time_ == scanned->time_)
+        {
+            return;
+        }
+        auto fptr = std::make_shared<FileInfo>(*scanned);
+        journal.stamp(fptr, current.value_or(nullptr));
+        fileList.insert(key, fptr);
+        changed++;
+    };
+    files.forEachWithPrefix("", update);
+
+    // 見つからなかったものは削除(辿り終えてから差し替える)
+    std::vector<FileInfoPtr> removed;
+    auto remove = [&](const FileInfoPtr &finfo)
+    {
+        if (!finfo->delete_ && !files.search(finfo->key_.string()))
+        {
+            removed.push_back(finfo);
+        }
+    };
+    fileList.forEachWithPrefix("", remove);
+    for (auto &finfo : removed)
     {
-        std::cout << msg;
-        printVerbose(args...);
+        auto fptr     = std::make_shared<FileInfo>(*finfo);
+        fptr->size_   = 0;
+        fptr->time_   = 0;
+        fptr->delete_ = true;
+        fptr->hash_.clear();
+        fptr->sha256_.clear();
+        journal.stamp(fptr, finfo);
+        fileList.insert(fptr->key_.string(), fptr);
+        changed++;
     }
+
+    currentDir = root;
+    dirIndex   = std::move(dirs);
+    publishIndex();
+
+    auto elapsed = std::chrono::steady_clock::now() - startTime;
+    serverMetrics.recordScan(elapsed);
+    printVerbose("rescan: ", changed, " changes, ",
+                 std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count(), " ms");
 }
 
-//
-// エラーハンドラ
-//
-void errorHandler(const httplib::Request & /*req*/, httplib::Response &res)
+// 変更があれば定期的にスナップショットを保存
+void snapshotLoop(FilePath path, FilePath targetDir, int interval, std::optional<uint64_t> saved)
 {
-    const char *fmt = "<p>Error Status: <span style='color:red;'>%d</span></p>";
-    char buf[BUFSIZ];
-    snprintf(buf, sizeof(buf), fmt, res.status);
-    res.set_content(buf, "text/html");
+    for (;;)
+    {
+        auto index = loadIndex();
+        if (!saved || *saved != index->version_)
+        {
+            if (saveSnapshot(path, targetDir, *index))
+            {
+                saved = index->version_;
+            }
+        }
+        std::this_thread::sleep_for(std::chrono::seconds{interval});
+    }
 }
 
+#if __linux__
 //
-// ファイル情報
+// ディレクトリ監視(inotify)でインデックスを最新に保つ
 //
-struct FileInfo
+class DirectoryWatcher
 {
-    FilePath key_;
-    FilePath path_;
-    int64_t time_;
-    size_t size_;
-    bool delete_;
-};
-using FileInfoPtr = std::shared_ptr<FileInfo>;
-Trie<std::string, FileInfoPtr> fileList;
+    static constexpr uint32_t WatchMask =
+        IN_CREATE | IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO;
+    static constexpr int PublishDelay = 100; // 公開を待つ時間(ms)
 
-//
-void repliesFileList(const httplib::Request &req, httplib::Response &res)
-{
-    std::string prefixDir = "";
-    if (req.has_param("prefix"))
-    {
-        prefixDir = req.get_param_value("prefix");
-    }
-    bool update = false;
-    if (req.has_param("update"))
+    int fd_{-1};
+    FilePath rootPath_;
+    std::mutex watchMutex_; // 走査のスレッドからも追加するので以下の排他
+    std::unordered_map<int, FilePath> watches_;     // wd -> ディレクトリ
+    std::unordered_map<std::string, int> watchIds_; // ディレクトリ -> wd
+
+    //
+    void addWatch(const FilePath &dir)
     {
-        auto upstr = req.get_param_value("update");
-        if (upstr == "1" || upstr == "true" || upstr == "TRUE" || upstr == "ON")
+        std::lock_guard lock{watchMutex_};
+        int wd = ::inotify_add_watch(fd_, dir.c_str(), WatchMask);
+        if (wd < 0)
         {
-            update = true;
+            std::cerr << "inotify_add_watch failed: " << dir << std::endl;
+            return;
         }
+        watches_[wd]            = dir;
+        watchIds_[dir.string()] = wd;
     }
 
-    // ファイルリストを返す
-    auto allList = fileList.searchByPrefix(prefixDir);
-    nlohmann::json jsonObj;
-    int findex = 0;
-    for (auto &n : allList)
-    {
-        auto fname = n->path_.string();
-        auto fkey  = n->key_.string();
-        auto fsize = n->size_;
-        auto ftime = n->time_;
-        bool fdel  = n->delete_;
-        if (update)
+    // ディレクトリ以下の監視をやめる
+    void removeWatches(const FilePath &dir)
+    {
+        std::lock_guard lock{watchMutex_};
+        auto dirName = dir.string();
+        auto prefix  = dirName + "/";
+        for (auto it = watchIds_.begin(); it != watchIds_.end();)
         {
-            // 更新する場合は情報を取得
-            if (std::filesystem::exists(fname))
+            if (it->first == dirName || it->first.rfind(prefix, 0) == 0)
             {
-                using namespace std::chrono;
-                auto lct = std::filesystem::last_write_time(fname);
-                auto epl = lct.time_since_epoch();
-                auto sec = duration_cast<seconds>(epl);
-                ftime    = sec.count();
-                fsize    = std::filesystem::file_size(fname);
-                fdel     = false;
+                ::inotify_rm_watch(fd_, it->second);
+                watches_.erase(it->second);
+                it = watchIds_.erase(it);
             }
             else
             {
-                // 消えた…
-                fsize = 0;
-                ftime = 0;
-                fdel  = true;
+                ++it;
             }
-            n->size_   = fsize;
-            n->time_   = ftime;
-            n->delete_ = fdel;
         }
-
-        nlohmann::json entry;
-        entry["Path"]     = fkey;
-        entry["Size"]     = fsize;
-        entry["Time"]     = ftime;
-        entry["Delete"]   = fdel;
-        jsonObj[findex++] = entry;
     }
-    nlohmann::json jsonTop;
-    jsonTop["Files"] = jsonObj;
-
-    res.set_content(jsonTop.dump(), "application/json");
-}
 
-//
-// ディレクトリ情報
-//
-struct DirInfo
-{
-    using Ptr = std::shared_ptr<DirInfo>;
-    FilePath path_;
-    uint32_t count_;
-    std::list<Ptr> children_;
-};
-DirInfo::Ptr currentDir;
+    // ファイルの作成、変更、削除
+    void fileChanged(const FilePath &path, bool written = false)
+    {
+        indexFile(path, rootPath_, written);
+    }
 
-//
-nlohmann::json makeDirJson(DirInfo::Ptr dptr)
-{
-    nlohmann::json jdir;
-    jdir["Name"]  = dptr->path_;
-    jdir["Count"] = dptr->count_;
-    if (!dptr->children_.empty())
+    // ディレクトリの中身を反映
+    // シンボリックリンクのディレクトリは走査(listDirectory)と同じく辿らない(リンク先のファイルは含める)
+    void addEntries(const FilePath &dir)
     {
-        nlohmann::json children;
-        int idx = 0;
-        for (auto c : dptr->children_)
+        std::error_code ec;
+        for (const auto &entry : std::filesystem::directory_iterator(dir, ec))
         {
-            children[idx++] = makeDirJson(c);
+            std::error_code sec;
+            if (entry.is_directory(sec))
+            {
+                if (!entry.is_symlink(sec))
+                {
+                    dirAdded(entry.path());
+                }
+            }
+            else
+            {
+                fileChanged(entry.path());
+            }
         }
-        jdir["Children"] = children;
     }
-    return jdir;
-};
 
-//
-void repliesDirList(const httplib::Request &req, httplib::Response &res)
-{
-    if (!currentDir)
+    // ディレクトリ追加
+    void dirAdded(const FilePath &path)
     {
-        return;
-    }
-
-    nlohmann::json jsonTop;
-    jsonTop["Dir"] = makeDirJson(currentDir);
+        std::error_code ec;
+        if (std::filesystem::is_symlink(path, ec) || !indexDir(path))
+        {
+            return;
+        }
+        addWatch(path);
+        printVerbose("new dir: ", path);
 
-    res.set_content(jsonTop.dump(), "application/json");
-}
+        // 監視を始める前に作られたものを拾う
+        addEntries(path);
+    }
 
-//
-// ディレクトリ走査
-//
-bool checkDirectory(FilePath targetDir, const FilePath rootPath, bool dispErr = false)
-{
-    try
+    // ディレクトリ削除
+    void dirRemoved(const FilePath &path)
     {
-        printVerbose("check dir: ", targetDir);
-        auto errorDump = [&](const char *msg)
+        auto dirName = path.string();
+        auto it      = dirIndex.find(dirName);
+        if (it == dirIndex.end())
+        {
+            return;
+        }
+        if (auto *parent = editDir(path.parent_path()))
+        {
+            parent->children_.remove(it->second);
+        }
+        auto prefix = dirName + "/";
+        std::erase_if(dirIndex, [&](const auto &d)
+                      { return d.first == dirName || d.first.rfind(prefix, 0) == 0; });
+        removeWatches(path);
+        printVerbose("removed dir: ", path);
+
+        // 中のファイルは削除扱い(辿り終えてから差し替える)
+        std::vector<FileInfoPtr> files;
+        auto removeFile = [&](const FileInfoPtr &finfo)
         {
-            if (dispErr)
+            if (!finfo->delete_)
             {
-                std::cerr << msg << ": " << targetDir << std::endl;
+                files.push_back(finfo);
             }
         };
+        fileList.forEachWithPrefix(makeFileKey(path, rootPath_).string() + "/", removeFile);
+        for (auto &finfo : files)
+        {
+            updateFileInfo(finfo);
+        }
+    }
 
-        if (!std::filesystem::exists(targetDir))
+    // イベントを取りこぼしたので全部確認し直す
+    void rescan()
+    {
+        printVerbose("inotify queue overflow, rescan");
+        // 辿っている最中には差し替えないのでパスを先に集める
+        std::vector<FilePath> paths;
+        fileList.forEachWithPrefix("", [&](const FileInfoPtr &finfo)
+                                   { paths.push_back(finfo->path_); });
+        for (auto &p : paths)
         {
-            // 無いよ
-            errorDump("not exist");
-            return false;
+            fileChanged(p);
         }
-        if (!std::filesystem::is_directory(targetDir))
+        std::vector<FilePath> dirs;
+        for (auto &d : dirIndex)
         {
-            // ディレクトリじゃない
-            errorDump("not directory");
-            return false;
+            dirs.emplace_back(d.first);
+        }
+        for (auto &dir : dirs)
+        {
+            std::error_code ec;
+            if (!std::filesystem::is_directory(std::filesystem::symlink_status(dir, ec)))
+            {
+                dirRemoved(dir);
+                continue;
+            }
+            addEntries(dir);
         }
+    }
 
-        auto dptr    = std::make_shared<DirInfo>();
-        dptr->path_  = targetDir.filename();
-        dptr->count_ = 0;
-        if (currentDir)
+    //
+    void handleEvent(const inotify_event &ev)
+    {
+        if (ev.mask & IN_Q_OVERFLOW)
         {
-            currentDir->children_.push_back(dptr);
+            rescan();
+            return;
         }
-        else
+        auto w = watches_.find(ev.wd);
+        if (w == watches_.end())
+        {
+            return;
+        }
+        if (ev.mask & IN_IGNORED)
+        {
+            auto id = watchIds_.find(w->second.string());
+            if (id != watchIds_.end() && id->second == ev.wd)
+            {
+                watchIds_.erase(id);
+            }
+            watches_.erase(w);
+            return;
+        }
+        if (ev.len == 0)
         {
-            printVerbose("First Directory: ", targetDir);
+            return;
         }
 
-        // ディレクトリ内全部リスト
-        for (const auto &entry : std::filesystem::directory_iterator(targetDir))
+        auto path = w->second / ev.name;
+        if (ev.mask & IN_ISDIR)
         {
-            if (recursiveMode && entry.is_directory())
+            if (ev.mask & (IN_CREATE | IN_MOVED_TO))
             {
-                currentDir = dptr;
-                checkDirectory(entry.path(), rootPath);
+                dirAdded(path);
             }
-            else if (entry.is_regular_file())
+            else if (ev.mask & (IN_DELETE | IN_MOVED_FROM))
             {
-                using namespace std::chrono;
-                auto wtime   = entry.last_write_time().time_since_epoch();
-                auto sec     = duration_cast<seconds>(wtime);
-                auto fptr    = std::make_shared<FileInfo>();
-                auto keyName = entry.path().lexically_relative(rootPath);
-#if _WIN32
-                fptr->path_ = translateToPosix(entry.path());
-                fptr->key_  = translateToPosix(keyName);
-#else
-                fptr->path_ = entry.path();
-                fptr->key_  = keyName;
-#endif
-                fptr->time_   = sec.count();
-                fptr->size_   = entry.file_size();
-                fptr->delete_ = false;
-                fileList.insert(fptr->key_.string(), fptr);
-                dptr->count_++;
+                dirRemoved(path);
+            }
+            return;
+        }
+        fileChanged(path, ev.mask & IN_CLOSE_WRITE);
+    }
+
+    //
+    void run()
+    {
+        alignas(inotify_event) char buffer[64 * 1024];
+        using namespace std::chrono;
+        bool pending = false; // 未公開の変更がある
+        steady_clock::time_point deadline;
+        for (;;)
+        {
+            // 続けて届く変更はまとめて、最初の変更から一定時間内に公開する
+            int timeout = -1;
+            if (pending)
+            {
+                auto rest = duration_cast<milliseconds>(deadline - steady_clock::now()).count();
+                timeout   = static_cast<int>(std::max<int64_t>(rest, 0));
+            }
+            pollfd pfd{fd_, POLLIN, 0};
+            auto ready = ::poll(&pfd, 1, timeout);
+            if (ready < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (ready == 0)
+            {
+                std::lock_guard lock{indexMutex};
+                publishIndex();
+                pending = false;
+                continue;
+            }
+            auto len = ::read(fd_, buffer, sizeof(buffer));
+            if (len <= 0)
+            {
+                if (len < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+                std::cerr << "inotify read error" << std::endl;
+                liveIndex = false;
+                return;
+            }
 
-                printVerbose("File: ", fptr->path_, "(", fptr->time_, ")");
+            std::lock_guard lock{indexMutex};
+            for (char *p = buffer; p < buffer + len;)
+            {
+                auto *ev = reinterpret_cast<inotify_event *>(p);
+                p += sizeof(inotify_event) + ev->len;
+                try
+                {
+                    handleEvent(*ev);
+                }
+                catch (std::exception &exp)
+                {
+                    std::cerr << exp.what() << std::endl;
+                }
+            }
+            if (!pending)
+            {
+                pending  = true;
+                deadline = steady_clock::now() + milliseconds{PublishDelay};
             }
         }
-        currentDir = dptr;
     }
-    catch (std::exception &exp)
+
+  public:
+    // 走査の前に準備する(監視は走査中にディレクトリ毎に追加し、変更はstart()まで溜めておく)
+    bool open(const FilePath &rootPath)
     {
-        std::cerr << exp.what() << std::endl;
+        fd_ = ::inotify_init1(IN_CLOEXEC);
+        if (fd_ < 0)
+        {
+            std::cerr << "inotify_init failed" << std::endl;
+            return false;
+        }
+        rootPath_ = rootPath;
+        return true;
     }
 
-    return true;
-}
+    // 走査するディレクトリの監視を追加(走査のスレッドから呼ぶ)
+    void watch(const FilePath &dir) { addWatch(dir); }
+
+    // 走査が終わったら溜まった変更から反映を始める
+    void start()
+    {
+        std::thread{[this] { run(); }}.detach();
+    }
+};
+DirectoryWatcher directoryWatcher;
+#endif
 
 } // namespace
 
@@ -304,6 +3763,47 @@ int main(int argc, char **argv)
         // ssl certificate path
         "ssl_cert_path", "specify certificate path as argument",
         cxxopts::value<std::string>()->default_value("."))(
+        // watch directory
+        "w,watch",
+        "watch directory changes (Linux; without it /list?update=true re-stats every file under "
+        "the prefix, so each sync costs O(files) even with no changes)",
+        cxxopts::value<bool>()->default_value("true"))(
+        // change journal
+        "journal", "change journal file to keep generations across restarts",
+        cxxopts::value<std::string>())(
+        // index snapshot
+        "snapshot", "index snapshot file for fast restart", cxxopts::value<std::string>())(
+        // snapshot interval
+        "snapshot_interval", "seconds between snapshot saves",
+        cxxopts::value<int>()->default_value("60"))(
+        // content hash
+        "hash", "content hash: none, xxh64 or sha256 (xxh64 + sha256)",
+        cxxopts::value<std::string>()->default_value("none"))(
+        // hash threads
+        "hash_threads", "number of threads for content hashing",
+        cxxopts::value<int>()->default_value("2"))(
+        // hash cache
+        "hash_cache", "content hash cache file", cxxopts::value<std::string>())(
+        // file serving
+        "file_server", "file serving: mmap (from the page cache, plain HTTP only) or mount",
+        cxxopts::value<std::string>()->default_value("mmap"))(
+        // compression
+        "compress", "compress /files and /list with zstd or gzip when the client accepts it",
+        cxxopts::value<bool>()->default_value("true"))(
+        // compressed file cache
+        "compress_cache", "directory to cache compressed files", cxxopts::value<std::string>())(
+        // compressed file cache size
+        "compress_cache_size", "compressed file cache size in MiB",
+        cxxopts::value<size_t>()->default_value("1024"))(
+        // upload
+        "writable", "accept uploads (PUT /files/...) from clients",
+        cxxopts::value<bool>()->default_value("false"))(
+        // scan threads
+        "scan_threads", "number of threads for the startup scan (0: number of cores)",
+        cxxopts::value<int>()->default_value("0"))(
+        // metrics
+        "metrics", "serve request and index metrics at /metrics (Prometheus text format)",
+        cxxopts::value<bool>()->default_value("true"))(
         // file directory
         "dir", "target directory", cxxopts::value<std::string>()->default_value("."));
 
@@ -316,17 +3816,119 @@ int main(int argc, char **argv)
         return 0;
     }
 
-    verboseMode   = result["verbose"].as<bool>();
-    recursiveMode = result["recursive"].as<bool>();
+    verboseMode     = result["verbose"].as<bool>();
+    recursiveMode   = result["recursive"].as<bool>();
+    compressEnabled = result["compress"].as<bool>();
+    writableMode    = result["writable"].as<bool>();
+    if (compressEnabled && result.count("compress_cache"))
+    {
+        auto capacity = result["compress_cache_size"].as<size_t>() * 1024 * 1024;
+        auto cacheDir = result["compress_cache"].as<std::string>();
+        if (capacity > 0 && !compressCache.open(cacheDir, capacity))
+        {
+            return 1;
+        }
+    }
 
     // ファイルリスト収集
     FilePath targetDir{result["dir"].as<std::string>()};
     auto parentPath = targetDir.parent_path();
-    if (!checkDirectory(targetDir, parentPath, true))
+    ChangeJournal::KnownMap known;
+    if (result.count("journal"))
+    {
+        known = journal.load(result["journal"].as<std::string>());
+    }
+    auto scanThreads = result["scan_threads"].as<int>();
+    if (scanThreads <= 0)
+    {
+        scanThreads = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    // 監視は走査しながら追加する(走査中の変更は走査後にまとめて反映)
+    DirHook watchDir;
+#if __linux__
+    if (result["watch"].as<bool>() && directoryWatcher.open(parentPath))
+    {
+        watchDir = [](const FilePath &dir) { directoryWatcher.watch(dir); };
+    }
+#endif
+
+    // スナップショットがあればそれで始めて、走査は裏で行う
+    bool warmStart = false;
+    if (result.count("snapshot") && std::filesystem::is_directory(targetDir))
+    {
+        warmStart = loadSnapshot(result["snapshot"].as<std::string>(), targetDir, parentPath);
+    }
+    if (!warmStart)
+    {
+        if (!checkDirectory(targetDir, parentPath, scanThreads, watchDir))
+        {
+            return 1;
+        }
+        reconcileJournal(std::move(known), parentPath);
+    }
+    publishIndex();
+    if (result.count("journal") && !journal.rewrite(result["journal"].as<std::string>()))
     {
         return 1;
     }
 
+    // 内容のハッシュ
+    auto hashMode = result["hash"].as<std::string>();
+    if (hashMode != "none")
+    {
+        if (hashMode != "xxh64" && hashMode != "sha256")
+        {
+            std::cerr << "unknown hash: " << hashMode << std::endl;
+            return 1;
+        }
+        std::optional<FilePath> cachePath;
+        if (result.count("hash_cache"))
+        {
+            cachePath = result["hash_cache"].as<std::string>();
+        }
+        hashService.start(std::max(result["hash_threads"].as<int>(), 1), hashMode == "sha256",
+                          cachePath);
+    }
+
+    auto startLive = [watch = bool{watchDir}]
+    {
+#if __linux__
+        if (watch)
+        {
+            directoryWatcher.start();
+            liveIndex = true;
+            printVerbose("watching directory changes");
+        }
+#endif
+        std::lock_guard lock{indexMutex};
+        hashService.requestMissing();
+    };
+    if (warmStart)
+    {
+        std::thread{[=]
+                    {
+                        rescanIndex(targetDir, parentPath, scanThreads, watchDir);
+                        startLive();
+                    }}
+            .detach();
+    }
+    else
+    {
+        startLive();
+    }
+    if (result.count("snapshot"))
+    {
+        std::optional<uint64_t> saved;
+        if (warmStart)
+        {
+            saved = loadIndex()->version_;
+        }
+        std::thread{snapshotLoop, FilePath{result["snapshot"].as<std::string>()}, targetDir,
+                    std::max(result["snapshot_interval"].as<int>(), 1), saved}
+            .detach();
+    }
+
     // SSL使用
     std::unique_ptr<httplib::Server> svrptr;
     if (result["ssl"].as<bool>())
@@ -350,6 +3952,15 @@ int main(int argc, char **argv)
         svrptr = std::make_unique<httplib::Server>();
     }
 
+    // ファイル配信の方式
+    auto fileServer = result["file_server"].as<std::string>();
+    if (fileServer != "mmap" && fileServer != "mount")
+    {
+        std::cerr << "unknown file server: " << fileServer << std::endl;
+        return 1;
+    }
+    mappedFiles = fileServer == "mmap" && !result["ssl"].as<bool>();
+
     // サーバースタート
     httplib::Server &svr = *svrptr;
     if (!svr.is_valid())
@@ -362,6 +3973,17 @@ int main(int argc, char **argv)
     svr.set_error_handler(errorHandler);
     svr.Get("/list", repliesFileList);
     svr.Get("/dir", repliesDirList);
+    svr.Get("/blocks", repliesBlockList);
+    svr.Post("/batch", repliesBatch);
+
+    // 計測(応答を書き終わったところでloggerが呼ばれる)
+    bool metrics = result["metrics"].as<bool>();
+    if (metrics)
+    {
+        svr.Get("/metrics", repliesMetrics);
+        svr.set_logger([](const auto &req, const auto &res) { serverMetrics.finish(req, res); });
+        svr.new_task_queue = [] { return new MeteredTaskQueue(CPPHTTPLIB_THREAD_POOL_COUNT); };
+    }
 
     // 絶対パスと対象ディレクトリ名
     auto absPath = std::filesystem::canonical(targetDir);
@@ -377,6 +3999,25 @@ int main(int argc, char **argv)
     {
         return 1;
     }
+    svr.set_pre_routing_handler(
+        [mountPoint, targetDir, metrics](const auto &req, auto &res)
+        {
+            if (metrics)
+            {
+                serverMetrics.begin();
+            }
+            return repliesFile(req, res, mountPoint, targetDir);
+        });
+    if (writableMode)
+    {
+        auto upload = [mountPoint, targetDir, parentPath](const httplib::Request &req,
+                                                          httplib::Response &res,
+                                                          const httplib::ContentReader &reader)
+        { repliesUpload(req, res, reader, mountPoint, targetDir, parentPath); };
+        svr.Put("/files/.*", upload);
+        svr.Post("/files/.*", upload);
+        std::cout << "accept uploads" << std::endl;
+    }
 
     if (result["auto"].as<bool>())
     {